@@ -296,6 +296,21 @@ void App::parseArgs()
                    " is loaded, all of the script hashes in the database will be written to outputfile as a JSON array."),
            QString("outputfile"),
          },
+         {
+           "export-snapshot",
+           QString("Export a snapshot. If specified, after the database is loaded, a consistent snapshot of the entire"
+                   " database at the current block height is written to snapshotdir (which must not exist or must be"
+                   " empty), along with a manifest of table hashes. The snapshot may then be used with --import-snapshot"
+                   " to bootstrap a new server without a full synch."),
+           QString("snapshotdir"),
+         },
+         {
+           "import-snapshot",
+           QString("Import a snapshot previously created with --export-snapshot. The snapshot's tables are checked"
+                   " against its manifest, and then copied into the datadir, which must not already contain a database."
+                   " Before synching resumes, the snapshot's block hash is checked against bitcoind's."),
+           QString("snapshotdir"),
+         },
      };
 
     parser.addOptions(allOptions);
@@ -348,6 +363,7 @@ void App::parseArgs()
     if (parser.isSet("q") || conf.boolValue("quiet")) options->verboseDebug = false;
     if (parser.isSet("S") || conf.boolValue("syslog")) options->syslogMode = true;
     if (parser.isSet("C") || conf.boolValue("checkdb")) options->doSlowDbChecks = true;
+    if (conf.boolValue("checkdb_background")) options->slowDbChecksInBackground = true;
     // parse --polltime
     // note despite how confusingly the below line reads, the CLI parser value takes precedence over the conf file here.
     const QString polltimeStr = conf.value("polltime", parser.value("T"));
@@ -830,6 +846,88 @@ void App::parseArgs()
         // log this later in case we are in syslog mode
         Util::AsyncOnObject(this, [klfn]{ Debug() << "config: db_keep_log_file_num = " << klfn; });
     }
+    if (conf.hasValue("db_undo_depth")) {
+        bool ok;
+        const int64_t depth = conf.int64Value("db_undo_depth", -1, &ok);
+        if (!ok || !options->db.isUndoDepthInBounds(depth))
+            throw BadArgs(QString("db_undo_depth: bad value. Specify a value in the range [%1, %2]")
+                          .arg(options->db.minUndoDepth).arg(options->db.maxUndoDepth));
+        options->db.undoDepth = unsigned(depth);
+        // log this later in case we are in syslog mode
+        Util::AsyncOnObject(this, [depth]{ Debug() << "config: db_undo_depth = " << depth; });
+    }
+    // conf: db_headers_in_ram
+    if (conf.hasValue("db_headers_in_ram")) {
+        bool ok;
+        options->db.headersInRam = conf.boolValue("db_headers_in_ram", options->db.defaultHeadersInRam, &ok);
+        if (!ok)
+            throw BadArgs("db_headers_in_ram: bad value. Specify a boolean value such as 0, 1, true, or false");
+        // log this later in case we are in syslog mode
+        Util::AsyncOnObject(this, [val = options->db.headersInRam]{ Debug() << "config: db_headers_in_ram = " << val; });
+    }
+    // conf: db_initial_sync_mode
+    if (conf.hasValue("db_initial_sync_mode")) {
+        bool ok;
+        options->db.initialSyncMode = conf.boolValue("db_initial_sync_mode", options->db.defaultInitialSyncMode, &ok);
+        if (!ok)
+            throw BadArgs("db_initial_sync_mode: bad value. Specify a boolean value such as 0, 1, true, or false");
+        // log this later in case we are in syslog mode
+        Util::AsyncOnObject(this, [val = options->db.initialSyncMode]{ Debug() << "config: db_initial_sync_mode = " << val; });
+    }
+    // conf: db_initial_sync_checkpoint
+    if (conf.hasValue("db_initial_sync_checkpoint")) {
+        bool ok;
+        const int64_t n = conf.int64Value("db_initial_sync_checkpoint", -1, &ok);
+        if (!ok || !options->db.isInitialSyncCheckpointIntervalInBounds(n))
+            throw BadArgs(QString("db_initial_sync_checkpoint: bad value. Specify a value in the range [%1, %2]")
+                          .arg(options->db.minInitialSyncCheckpointInterval).arg(options->db.maxInitialSyncCheckpointInterval));
+        options->db.initialSyncCheckpointInterval = unsigned(n);
+        // log this later in case we are in syslog mode
+        Util::AsyncOnObject(this, [n]{ Debug() << "config: db_initial_sync_checkpoint = " << n; });
+    }
+    // conf: db_compaction_rate_limit
+    if (conf.hasValue("db_compaction_rate_limit")) {
+        bool ok;
+        const int64_t rate = conf.int64Value("db_compaction_rate_limit", -1, &ok);
+        if (!ok || !options->db.isCompactionRateLimitInBounds(rate))
+            throw BadArgs(QString("db_compaction_rate_limit: bad value. Specify 0 (no limit) or a value in the range [%1, %2]")
+                          .arg(options->db.minCompactionRateLimit).arg(options->db.maxCompactionRateLimit));
+        options->db.compactionRateLimit = unsigned(rate);
+        // log this later in case we are in syslog mode
+        Util::AsyncOnObject(this, [rate]{ Debug() << "config: db_compaction_rate_limit = " << rate; });
+    }
+    // conf: db_paths_<table> -- a comma-separated list of dir[:target_size_GB], e.g. /mnt/nvme/fulcrum:50,/mnt/hdd/fulcrum
+    for (const auto & table : options->db.tableNames + options->db.legacyTableNames) {
+        const QString key = "db_paths_" + table;
+        if (!conf.hasValue(key))
+            continue;
+        const QStringList entries = conf.value(key).split(',', QString::SplitBehavior::SkipEmptyParts);
+        QList<Options::DBOpts::TablePath> paths;
+        for (int i = 0; i < entries.size(); ++i) {
+            Options::DBOpts::TablePath tp;
+            tp.dir = entries[i].trimmed();
+            // a trailing :<number> is the target size (anything else after a colon is part of the path, e.g. C:\)
+            if (const int pos = tp.dir.lastIndexOf(':'); pos > 0) {
+                bool ok;
+                if (const double gb = tp.dir.mid(pos + 1).trimmed().toDouble(&ok); ok) {
+                    if (gb <= 0.)
+                        throw BadArgs(QString("%1: bad target size \"%2\"").arg(key, entries[i].trimmed()));
+                    tp.targetSize = uint64_t(gb * 1e9);
+                    tp.dir = tp.dir.left(pos).trimmed();
+                }
+            }
+            if (tp.dir.isEmpty())
+                throw BadArgs(QString("%1: empty path").arg(key));
+            if (!tp.targetSize && i + 1 < entries.size())
+                throw BadArgs(QString("%1: every path but the last must specify a target size in GB, e.g. /mnt/nvme/fulcrum:50").arg(key));
+            paths.push_back(tp);
+        }
+        if (paths.isEmpty())
+            throw BadArgs(QString("%1: specify one or more paths").arg(key));
+        options->db.tablePaths[table] = paths;
+        // log this later in case we are in syslog mode
+        Util::AsyncOnObject(this, [key, val = conf.value(key)]{ Debug() << "config: " << key << " = " << val; });
+    }
 
     // warn user that no hostname was specified if they have peerDiscover turned on
     if (!options->hostName.has_value() && options->peerDiscovery && options->peerAnnounceSelf) {
@@ -866,6 +964,24 @@ void App::parseArgs()
     if (const auto outFile = parser.value("dump-sh"); !outFile.isEmpty()) {
         options->dumpScriptHashes = outFile; // we do no checking here, but Controller::startup will throw BadArgs if it cannot open this file for writing.
     }
+    // parse --export-snapshot & --import-snapshot
+    if (const auto dir = parser.value("export-snapshot"); !dir.isEmpty()) {
+        options->exportSnapshot = dir; // Storage::exportSnapshot will throw BadArgs if this directory is not usable
+    }
+    if (const auto dir = parser.value("import-snapshot"); !dir.isEmpty()) {
+        if (!QFileInfo(dir).isDir())
+            throw BadArgs(QString("import-snapshot: \"%1\" is not a directory").arg(dir));
+        options->importSnapshot = dir;
+    }
+    // Snapshots and initial sync checkpoints are made of hard links into the datadir, so they need all tables there.
+    if (!options->db.tablePaths.isEmpty()) {
+        if (!options->importSnapshot.isEmpty() || !options->exportSnapshot.isEmpty())
+            throw BadArgs("import-snapshot and export-snapshot cannot be used while any db_paths_* option is set");
+        if (options->db.initialSyncMode) {
+            options->db.initialSyncMode = false;
+            Util::AsyncOnObject(this, []{ Log() << "db_paths_* is set, db_initial_sync_mode has been disabled"; });
+        }
+    }
 }
 
 namespace {
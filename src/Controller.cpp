@@ -61,6 +61,10 @@ void Controller::startup()
         // this may take a long time but normally this branch is not taken
         dumpScriptHashes(options->dumpScriptHashes);
 
+    if (! options->exportSnapshot.isEmpty())
+        // this may take a while, depending on how large the db is and on whether hard links can be used
+        storage->exportSnapshot(options->exportSnapshot);
+
     bitcoindmgr = std::make_shared<BitcoinDMgr>(options->bitcoind.first, options->bitcoind.second, options->rpcuser, options->rpcpassword);
     {
         auto constexpr waitTimer = "wait4bitcoind", callProcessTimer = "callProcess";
@@ -406,27 +410,120 @@ void DownloadBlocksTask::do_get(unsigned int bnum)
 }
 
 
+/// On reorg, walks backwards from `fromHeight` asking bitcoind for its block hash at each height (kBatchSize heights
+/// at a time), until it finds the most recent height at which our header chain agrees with bitcoind's. The Controller
+/// then rewinds all of the orphaned blocks in one go via Storage::undoLatestBlocks().
+struct FindForkPointTask : public CtlTask
+{
+    FindForkPointTask(Controller *ctl_, std::shared_ptr<Storage> storage, int fromHeight, int minHeight)
+        : CtlTask(ctl_, "Task.FindForkPoint"), storage(storage), next(fromHeight), minHeight(minHeight) {}
+    ~FindForkPointTask() override { stop(); } // paranoia
+    void process() override;
+
+    const std::shared_ptr<Storage> storage;
+    int next; ///< the highest height not yet checked
+    const int minHeight; ///< we give up if there is no common ancestor at or above this height
+    int forkHeight = -1; ///< the result: the latest height where our chain and bitcoind's chain agree
+    bool tooDeep = false; ///< set if we errored because the fork point is below minHeight
+
+    static constexpr int kBatchSize = 16; ///< the number of getblockhash requests we have in flight at once
+
+private:
+    std::map<int, QByteArray> hashes; ///< height -> bitcoind's block hash, for the current batch
+    int batchLow = 0, nPending = 0;
+    bool failed = false;
+
+    void checkBatch();
+};
+
+void FindForkPointTask::process()
+{
+    if (ctl->isStopping() || failed)
+        return; // short-circuit early return if controller is stopping
+    if (next < minHeight) {
+        tooDeep = true;
+        errorCode = next;
+        errorMessage = QString("no common ancestor with bitcoind's chain was found at or above height %1").arg(minHeight);
+        emit errored();
+        return;
+    }
+    batchLow = std::max(next - kBatchSize + 1, minHeight);
+    nPending = next - batchLow + 1;
+    hashes.clear();
+    for (int height = next; height >= batchLow; --height) {
+        submitRequest("getblockhash", {height}, [this, height](const RPC::Message & resp){
+            if (failed) return;
+            const auto hash = Util::ParseHexFast(resp.result().toByteArray());
+            if (hash.length() != HashLen) {
+                Warning() << resp.method << ": at height " << height << " hash not valid (decoded size: " << hash.length() << ")";
+                failed = true;
+                errorCode = height;
+                errorMessage = QString("invalid hash for height %1").arg(height);
+                emit errored();
+                return;
+            }
+            hashes[height] = hash;
+            if (--nPending == 0)
+                checkBatch();
+        });
+    }
+}
+
+void FindForkPointTask::checkBatch()
+{
+    for (int height = next; height >= batchLow; --height) {
+        if (const auto hdr = storage->headerForHeight(unsigned(height)); hdr.has_value() && BTC::HashRev(*hdr) == hashes[height]) {
+            forkHeight = height;
+            emit success();
+            return;
+        }
+    }
+    next = batchLow - 1;
+    AGAIN();
+}
+
+
 /// We use the "getrawmempool false" (nonverbose) call to get the initial list of mempool tx's.  This is the
 /// most efficient.  With fill mempools bitcoind CPU usage could spike to 100% if we use the verbose more.
 /// It turns out we don't need that verbose data anyway (such as a full ancestor count) -- it's enough to have a bool
 /// flag for "has unconfirmed parent tx", and be done with it.  Everything else we can calculate.
+///
+/// New tx's are downloaded with up to kMaxTxsInFlight getrawtransaction requests outstanding at once (BitcoinDMgr
+/// spreads these round-robin over all of its connections). Each reply is hex-decoded, deserialized and has its
+/// output HashXs computed on the app-wide ThreadPool (see Mempool::decodeNewTx). Only the final wiring of the tx graph
+/// (Storage::addMempoolTxs, called from processResults()) happens serially.
 struct SynchMempoolTask : public CtlTask
 {
-    SynchMempoolTask(Controller *ctl_, std::shared_ptr<Storage> storage, const std::atomic_bool & notifyFlag)
-        : CtlTask(ctl_, "SynchMempool"), storage(storage), notifyFlag(notifyFlag)
+    SynchMempoolTask(Controller *ctl_, std::shared_ptr<Storage> storage, const std::atomic_bool & notifyFlag,
+                     const std::optional<Controller::MempoolFingerprint> & prevFingerprint)
+        : CtlTask(ctl_, "SynchMempool"), storage(storage), notifyFlag(notifyFlag), prevFingerprint(prevFingerprint)
         { scriptHashesAffected.reserve(SubsMgr::kRecommendedPendingNotificationsReserveSize); }
     ~SynchMempoolTask() override;
     void process() override;
 
     const std::shared_ptr<Storage> storage;
     const std::atomic_bool & notifyFlag;
+    /// The fingerprint as of the end of the previous successful run, if any. If bitcoind's getmempoolinfo and our
+    /// mempool still match it, this run is skipped without fetching getrawmempool.
+    const std::optional<Controller::MempoolFingerprint> prevFingerprint;
+    /// Set by doGetMempoolInfo(); its generation is filled in once we are done. Controller saves it on success.
+    std::optional<Controller::MempoolFingerprint> fingerprint;
+    bool skipped = false; ///< set on success if the fingerprint matched and getrawmempool was not fetched
     bool isdlingtxs = false;
+    bool failed = false; ///< set if we emitted errored(); late replies and ThreadPool completions are then ignored
     Mempool::TxMap txsNeedingDownload, txsWaitingForResponse;
-    using DldTxsMap = robin_hood::unordered_flat_map<TxHash, std::pair<Mempool::TxRef, bitcoin::CTransactionRef>, HashHasher>;
-    DldTxsMap txsDownloaded;
+    /// The downloaded tx's, along with the data that was precomputed for them in the ThreadPool
+    Mempool::NewTxsMap txsDownloaded;
     unsigned expectedNumTxsDownloaded = 0;
     const bool TRACE = Trace::isEnabled(); // set this to true to print more debug
 
+    /// The maximum number of getrawtransaction requests we keep outstanding at once
+    static constexpr size_t kMaxTxsInFlight = BitcoinDMgr::N_CLIENTS * 32;
+
+    double t0 = 0.; ///< timestamp of the first getrawmempool of this task; used to time the refresh
+    double elapsedSecs = 0.; ///< set on success: how long the whole refresh took
+    double lockHeldSecs = 0.; ///< set on success: how long processResults() held the mempool locks exclusively (summed)
+
     /// The scriptHashes that were affected by this refresh/synch cycle. Used for notifications.
     std::unordered_set<HashX, HashHasher> scriptHashesAffected;
 
@@ -439,9 +536,11 @@ struct SynchMempoolTask : public CtlTask
         // all the droppedTx scripthashes for each retry, so we never clear the set.
     }
 
+    void doGetMempoolInfo();
     void doGetRawMempool();
-    void doDLNextTx();
+    void doDLNextTxs();
     void processResults();
+    void fail(const QString &msg);
 };
 
 SynchMempoolTask::~SynchMempoolTask() {
@@ -457,23 +556,33 @@ void SynchMempoolTask::process()
 {
     if (ctl->isStopping())
         return; // short-circuit early return if controller is stopping
-    if (!isdlingtxs)
+    if (failed)
+        return;
+    if (!fingerprint)
+        doGetMempoolInfo();
+    else if (!isdlingtxs)
         doGetRawMempool();
     else if (!txsNeedingDownload.empty()) {
-        doDLNextTx();
+        doDLNextTxs();
     } else if (txsWaitingForResponse.empty()) {
         try {
             processResults();
         } catch (const std::exception & e) {
             Error() << "Caught exception when processing mempool tx's: " << e.what();
+            failed = true;
             emit errored();
             return;
         }
-    } else {
-        Error() << "Unexpected state in " << __PRETTY_FUNCTION__ << ". FIXME!";
-        emit errored();
-        return;
     }
+    // else: still waiting on outstanding downloads; each one calls AGAIN() when it completes
+}
+
+void SynchMempoolTask::fail(const QString &msg)
+{
+    if (failed) return;
+    Error() << msg;
+    failed = true;
+    emit errored();
 }
 
 
@@ -485,7 +594,7 @@ void Controller::printMempoolStatusToLog() const
         {
             auto [mempool, lock] = storage->mempool();
             newSize = mempool.txs.size();
-            numAddresses = mempool.hashXTxs.size();
+            numAddresses = mempool.numHashXs();
         } // release mempool lock
         printMempoolStatusToLog(newSize, numAddresses, false);
     }
@@ -516,189 +625,114 @@ void Controller::printMempoolStatusToLog(size_t newSize, size_t numAddresses, bo
 void SynchMempoolTask::processResults()
 {
     if (txsDownloaded.size() != expectedNumTxsDownloaded) {
-        Error() << __PRETTY_FUNCTION__ << ": Expected to downlaod " << expectedNumTxsDownloaded << ", instead got " << txsDownloaded.size() << ". FIXME!";
-        emit errored();
+        fail(QString("%1: Expected to download %2, instead got %3. FIXME!").arg(__func__).arg(expectedNumTxsDownloaded).arg(txsDownloaded.size()));
         return;
     }
-    size_t oldSize = 0, newSize = 0, oldNumAddresses = 0, newNumAddresses = 0;
+    // Throws if a prevout can't be found in either the mempool or the db. The synch process then aborts and hopefully
+    // we recover with a reorg or a new block or somesuch.
+    const auto res = storage->addMempoolTxs(txsDownloaded, scriptHashesAffected, TRACE);
+    lockHeldSecs = res.lockHeldSecs;
     {
-        auto [mempool, lock] = storage->mutableMempool(); // grab mempool struct exclusively
-        oldSize = mempool.txs.size();
-        oldNumAddresses = mempool.hashXTxs.size();
-        // first, do new outputs for all tx's, and put the new tx's in the mempool struct
-        for (auto & [hash, pair] : txsDownloaded) {
-            auto & [tx, ctx] = pair;
-            assert(hash == tx->hash);
-            mempool.txs[tx->hash] = tx; // save tx right now to map, since we need to find it later for possible spends, etc if subsequent tx's refer to this tx.
-            IONum n = 0;
-            const auto numTxo = ctx->vout.size();
-            if (LIKELY(tx->txos.size() != numTxo)) {
-                // we do it this way (reserve then resize) to avoid the automatic 2^N prealloc of normal vector .resize()
-                tx->txos.reserve(numTxo);
-                tx->txos.resize(numTxo);
-            }
-            for (const auto & out : ctx->vout) {
-                const auto & script = out.scriptPubKey;
-                if (!BTC::IsOpReturn(script)) {
-                    // UTXO only if it's not OP_RETURN -- can't do 'continue' here as that would throw off the 'n' counter
-                    HashX sh = BTC::HashXFromCScript(out.scriptPubKey);
-                    // the below is a hack to save memory by re-using the same shallow copy of 'sh' each time
-                    auto hxit = mempool.hashXTxs.find(sh);
-                    if (hxit != mempool.hashXTxs.end()) {
-                        // found existing, re-use sh as a shallow copy
-                        sh = hxit->first;
-                    } else {
-                        // new entry, insert, update hxit
-                        auto pair = mempool.hashXTxs.insert({sh, decltype(hxit->second)()});
-                        hxit = pair.first;
-                    }
-                    // end memory saving hack
-                    TXOInfo &txoInfo = tx->txos[n];
-                    txoInfo = TXOInfo{out.nValue, sh, {}, {}};
-                    tx->hashXs[sh].utxo.insert(n);
-                    hxit->second.push_back(tx); // save tx to hashx -> tx vector (amortized constant time insert at end -- we will sort and uniqueify this at end of this function)
-                    scriptHashesAffected.insert(sh);
-                    assert(txoInfo.isValid());
-                }
-                tx->fee -= out.nValue; // update fee (fee = ins - outs, so we "add" the outs as a negative)
-                ++n;
-            }
-            assert(n == numTxo);
-            // . <-- at this point the .txos vec is built, with everything isValid() except for the OP_RETURN outs, which are all !isValid()
-        }
-        // next, do new inputs for all tx's, debiting/crediting either a mempool tx or querying db for the relevant utxo
-        for (auto & [hash, pair] : txsDownloaded) {
-            auto & [tx, ctx] = pair;
-            assert(hash == tx->hash);
-            IONum inNum = 0;
-            for (const auto & in : ctx->vin) {
-                const IONum prevN = IONum(in.prevout.GetN());
-                const TxHash prevTxId = BTC::Hash2ByteArrayRev(in.prevout.GetTxId());
-                const TXO prevTXO{prevTxId, prevN};
-                TXOInfo prevInfo;
-                QByteArray sh; // shallow copy of prevInfo.hashX
-                if (auto it = mempool.txs.find(prevTxId); it != mempool.txs.end()) {
-                    // prev is a mempool tx
-                    tx->hasUnconfirmedParentTx = true; ///< mark the current tx we are processing as having an unconfirmed parent (this is used for sorting later and by the get_mempool & listUnspent code)
-                    auto prevTxRef = it->second;
-                    assert(bool(prevTxRef));
-                    if (prevN >= prevTxRef->txos.size()
-                            || !(prevInfo = prevTxRef->txos[prevN]).isValid())
-                        // defensive programming paranoia
-                        throw InternalError(QString("FAILED TO FIND A VALID PREVIOUS TXOUTN %1 IN MEMPOOL for TxHash: %2")
-                                            .arg(prevN).arg(QString(prevTxId.toHex())));
-                    sh = prevInfo.hashX;
-                    tx->hashXs[sh].unconfirmedSpends[prevTXO] = prevInfo;
-                    prevTxRef->hashXs[sh].utxo.erase(prevN); // remove this spend from utxo set for prevTx in mempool
-                    if (TRACE) Debug() << hash.toHex() << " unconfirmed spend: " << prevTXO.toString() << " " << prevInfo.amount.ToString().c_str();
-                } else {
-                    // prev is a confirmed tx
-                    const auto optTXOInfo = storage->utxoGetFromDB(prevTXO, false); // this may also throw on low-level db error
-                    if (UNLIKELY(!optTXOInfo.has_value())) {
-                        // Uh oh. If it wasn't in the mempool or in the db.. something is very wrong with our code.
-                        // We will throw if missing, and the synch process aborts and hopefully we recover with a reorg
-                        // or a new block or somesuch.
-                        throw InternalError(QString("FAILED TO FIND PREVIOUS TX %1 IN EITHER MEMPOOL OR DB for TxHash: %2 (input %3)")
-                                            .arg(prevTXO.toString()).arg(QString(prevTxId.toHex())).arg(inNum));
-                    }
-                    prevInfo = *optTXOInfo;
-                    sh = prevInfo.hashX;
-                    // hack to save memory by re-using existing sh QByteArray and/or forcing a shallow-copy
-                    auto hxit = tx->hashXs.find(sh);
-                    if (hxit != tx->hashXs.end()) {
-                        // existing found, re-use same unerlying QByteArray memory for sh
-                        sh = prevInfo.hashX = hxit->first;
-                    } else {
-                        // new entry, insert, update hxit
-                        auto pair = tx->hashXs.insert({sh, decltype(hxit->second)()});
-                        hxit = pair.first;
-                    }
-                    // end memory saving hack
-                    hxit->second.confirmedSpends[prevTXO] = prevInfo;
-                    if (TRACE) Debug() << hash.toHex() << " confirmed spend: " << prevTXO.toString() << " " << prevInfo.amount.ToString().c_str();
-                }
-                tx->fee += prevInfo.amount;
-                assert(sh == prevInfo.hashX);
-                mempool.hashXTxs[sh].push_back(tx); // mark this hashX as having been "touched" because of this input (note we push dupes here out of order but sort and uniqueify at the end)
-                scriptHashesAffected.insert(sh);
-                ++inNum;
-            }
-
-            // Now, compactify some data structures to take up less memory by rehashing thier unordered_maps/unordered_sets..
-            // we do this once for each new tx we see.. and it can end up saving tons of space. Note the below structures
-            // are either fixed in size or will only ever shrink as the mempool evolves so this is a good time to do this.
-            tx->hashXs.rehash(tx->hashXs.size());
-            for (auto & [sh, ioinfo] : tx->hashXs) {
-                ioinfo.confirmedSpends.rehash(ioinfo.confirmedSpends.size());  // this is fixed once built
-                ioinfo.unconfirmedSpends.rehash(ioinfo.unconfirmedSpends.size()); // this is fixed once built
-                ioinfo.utxo.rehash(ioinfo.utxo.size()); // this may shrink but we rehash it once now to the largest size it will ever have
-            }
-        }
-
-        // now, sort and uniqueify data structures made temporarily inconsistent above (have dupes, are out-of-order)
-        for (const auto & sh : scriptHashesAffected) {
-            if (auto it = mempool.hashXTxs.find(sh); LIKELY(it != mempool.hashXTxs.end()))
-                Util::sortAndUniqueify<Mempool::TxRefOrdering>(it->second);
-            //else {}
-            // Note: It's possible for the scriptHashesAffected set to refer to sh's no longer in the mempool because
-            // we sometimes retry this task when we detect mempool drops, with the scriptHasesAffected set containing
-            // the dropped address hashes.  This is why the if conditional above exists.
-        }
-
-        newSize = mempool.txs.size();
-        newNumAddresses = mempool.hashXTxs.size();
-    } // release mempool lock
-    if (oldSize != newSize && Debug::isEnabled()) {
-        Controller::printMempoolStatusToLog(newSize, newNumAddresses, true, true);
+        auto [mempool, lock] = storage->mempool();
+        fingerprint->generation = mempool.generation;
+    }
+    if (res.oldSize != res.newSize && Debug::isEnabled()) {
+        Controller::printMempoolStatusToLog(res.newSize, res.newNumHashXs, true, true);
     }
+    elapsedSecs = Util::getTimeSecs() - t0;
+    if (expectedNumTxsDownloaded)
+        DebugM("Mempool refresh: downloaded and processed ", expectedNumTxsDownloaded, Util::Pluralize(" new tx", expectedNumTxsDownloaded),
+               " in ", QString::number(elapsedSecs, 'f', 3), " secs (mempool write lock held for ",
+               QString::number(lockHeldSecs * 1e3, 'f', 3), " msec)");
     emit success();
 }
 
-void SynchMempoolTask::doDLNextTx()
+void SynchMempoolTask::doDLNextTxs()
 {
-    Mempool::TxRef tx;
-    if (auto it = txsNeedingDownload.begin(); it == txsNeedingDownload.end()) {
-        Error() << "FIXME -- txsNeedingDownload is empty in " << __func__;
-        emit errored();
-        return;
-    } else {
-        tx = it->second;
-        it = txsNeedingDownload.erase(it); // pop it off the front
+    // Keep up to kMaxTxsInFlight requests outstanding. BitcoinDMgr round-robins these over all of its connections, so
+    // this keeps every bitcoind client busy rather than doing one round-trip at a time.
+    while (!txsNeedingDownload.empty() && txsWaitingForResponse.size() < kMaxTxsInFlight) {
+        auto it = txsNeedingDownload.begin();
+        Mempool::TxRef tx = it->second;
+        txsNeedingDownload.erase(it); // pop it off the front
+        assert(bool(tx));
+        const auto hashHex = Util::ToHexFast(tx->hash);
+        txsWaitingForResponse[tx->hash] = tx;
+        submitRequest("getrawtransaction", {hashHex, false}, [this, hashHex, tx](const RPC::Message & resp){
+            if (failed) return;
+            if (TRACE)
+                Debug() << "got reply for tx: " << hashHex << " " << resp.result().toString().length()/2 << " bytes";
+            // Decoding, deserializing and hashing the outputs are done in the ThreadPool. Only the resulting NewTx is
+            // handed back to this thread.
+            auto dld = std::make_shared<Mempool::NewTx>();
+            ::AppThreadPool()->submitWork(this,
+                // work (ThreadPool thread)
+                [dld, tx, hexData = resp.result().toString()] {
+                    QByteArray txdata = hexData.toUtf8();
+                    const int expectedLen = txdata.length() / 2;
+                    txdata = Util::ParseHexFast(txdata);
+                    if (txdata.length() != expectedLen)
+                        throw Exception("Received tx data is of the wrong length -- bad hex? FIXME");
+                    *dld = Mempool::decodeNewTx(txdata, tx); // checks the hash, deserializes, computes outHashXs & prevouts
+                },
+                // completion (this thread)
+                [this, dld] {
+                    if (failed) return;
+                    const auto & hash = dld->tx->hash;
+                    txsDownloaded[hash] = std::move(*dld);
+                    txsWaitingForResponse.erase(hash);
+                    AGAIN();
+                },
+                // fail (this thread)
+                [this](const QString &msg) { fail(msg); });
+        });
     }
-    assert(bool(tx));
-    const auto hashHex = Util::ToHexFast(tx->hash);
-    txsWaitingForResponse[tx->hash] = tx;
-    submitRequest("getrawtransaction", {hashHex, false}, [this, hashHex, tx](const RPC::Message & resp){
-        QByteArray txdata = resp.result().toString().toUtf8();
-        const int expectedLen = txdata.length() / 2;
-        txdata = Util::ParseHexFast(txdata);
-        if (txdata.length() != expectedLen) {
-            Error() << "Received tx data is of the wrong length -- bad hex? FIXME";
-            emit errored();
-            return;
-        } else if (BTC::HashRev(txdata) != tx->hash) {
-            Error() << "Received tx data appears to not match requested tx! FIXME!!";
-            emit errored();
-            return;
-        }
-        tx->sizeBytes = unsigned(expectedLen); // save size now -- this is needed later to calculate fees and for everything else.
-
-        if (TRACE)
-            Debug() << "got reply for tx: " << hashHex << " " << txdata.length() << " bytes";
+}
 
-        {
-            // tmp mutable object will be moved into CTransactionRef below via a move constructor
-            bitcoin::CMutableTransaction ctx = BTC::Deserialize<bitcoin::CMutableTransaction>(txdata);
-            txsDownloaded[tx->hash] = {tx, bitcoin::MakeTransactionRef(std::move(ctx)) };
+void SynchMempoolTask::doGetMempoolInfo()
+{
+    t0 = Util::getTimeSecs();
+    submitRequest("getmempoolinfo", {}, [this](const RPC::Message & resp){
+        const auto map = resp.result().toMap();
+        Controller::MempoolFingerprint fp;
+        bool ok1, ok2, ok3;
+        fp.size = map.value("size").toLongLong(&ok1);
+        fp.bytes = map.value("bytes").toLongLong(&ok2);
+        fp.usage = map.value("usage").toLongLong(&ok3);
+        if (!ok1 || !ok2 || !ok3) {
+            // unexpected reply; use a fingerprint that never matches, which just means we always do the full poll
+            DebugM(resp.method, ": unexpected reply, ignoring: ", resp.result().toString());
+            fp = Controller::MempoolFingerprint{};
         }
-        txsWaitingForResponse.erase(tx->hash);
+        if (prevFingerprint && fp.size >= 0) {
+            {
+                auto [mempool, lock] = storage->mempool();
+                fp.generation = mempool.generation;
+            }
+            if (fp == *prevFingerprint) {
+                // Neither bitcoind's mempool nor ours changed since we last synched them: nothing to do.
+                if (TRACE) Debug() << resp.method << ": fingerprint unchanged (" << fp.size << " txs), skipping getrawmempool";
+                fingerprint = fp;
+                skipped = true;
+                elapsedSecs = Util::getTimeSecs() - t0;
+                emit success();
+                return;
+            }
+        }
+        fingerprint = fp; // the generation is filled in by processResults()
         AGAIN();
     });
 }
 
 void SynchMempoolTask::doGetRawMempool()
 {
-    submitRequest("getrawmempool", {false}, [this](const RPC::Message & resp){
+    // Any tx added to our mempool after this point (e.g. a tx broadcast by a client) may be missing from the reply, so
+    // we must not mistake it for a tx that bitcoind dropped (see below).
+    const auto genAtRequest = [this]{
+        auto [mempool, lock] = storage->mempool();
+        return mempool.generation;
+    }();
+    submitRequest("getrawmempool", {false}, [this, genAtRequest](const RPC::Message & resp){
         bool clearMempool = false; // this is set below in rare cases at the end of this lamba
         Defer deferredClearMempoolIfNeeded(
             [this, &clearMempool] {
@@ -711,29 +745,32 @@ void SynchMempoolTask::doGetRawMempool()
             });
         int newCt = 0;
         const QVariantList txidList = resp.result().toList();
-        // Grab the mempool data struct and lock it *shared*.  This improves performance vs. an exclusive lock here.
-        // Since we aren't modifying it.. this is fine.  We are the only subsystem that ever modifies it anyway, so
-        // invariants will hold regardless.
-        auto [mempool, lock] = storage->mempool();
-        const auto oldCt = mempool.txs.size();
-        auto droppedTxs = Util::keySet<std::unordered_set<TxHash, HashHasher>>(mempool.txs);
+        // Parse the txids to binary up-front, outside the lock. We work only with binary hashes from here on.
+        std::vector<TxHash> hashes;
+        hashes.reserve(size_t(txidList.size()));
         for (const auto & var : txidList) {
-            const auto txidHex = var.toString().trimmed().toLower();
-            const TxHash hash = Util::ParseHexFast(txidHex.toUtf8());
-            if (hash.length() != HashLen) {
+            hashes.push_back(Util::ParseHexFast(var.toString().toLatin1())); // ParseHexFast accepts upper or lower case
+            if (hashes.back().length() != HashLen) {
                 Error() << resp.method << ": got an empty tx hash";
                 emit errored();
                 return;
             }
-            static const QVariantList EmptyList; // avoid constructng this for each iteration
-            if (auto it = mempool.txs.find(hash); it != mempool.txs.end()) {
-                droppedTxs.erase(hash); // mark this tx as "not dropped" since it was in the mempool before and is in the mempool now.
+        }
+        // Grab the mempool data struct and lock it *shared*.  This improves performance vs. an exclusive lock here.
+        // Since we aren't modifying it.. this is fine.  Note that other writers (broadcast) may have added tx's since
+        // the request was sent, which bitcoind may not have had when it produced this reply. Those have a
+        // Tx::generation > genAtRequest and are not considered dropped below.
+        auto [mempool, lock] = storage->mempool();
+        const auto oldCt = mempool.txs.size();
+        size_t nExisting = 0;
+        for (const auto & hash : hashes) {
+            if (mempool.txs.count(hash)) {
+                ++nExisting;
                 if (TRACE) Debug() << "Existing mempool tx: " << hash.toHex();
             } else {
                 if (TRACE) Debug() << "New mempool tx: " << hash.toHex();
                 ++newCt;
                 Mempool::TxRef tx = std::make_shared<Mempool::Tx>();
-                tx->hashXs.max_load_factor(1.0); // hopefully this will save some memory by expicitly setting it to 1.0
                 tx->hash = hash;
                 // Note: we end up calculating the fee ourselves since I don't trust doubles here. I wish bitcoind would have returned sats.. :(
                 txsNeedingDownload[hash] = tx;
@@ -741,6 +778,16 @@ void SynchMempoolTask::doGetRawMempool()
             // at this point we have a valid tx ptr
         }
 
+        // If every tx we had is still in bitcoind's mempool (the common case), we are done. Otherwise, figure out
+        // which ones were dropped (ignoring the ones added after the request was sent).
+        std::unordered_set<TxHash, HashHasher> droppedTxs;
+        if (UNLIKELY(nExisting != oldCt)) {
+            for (const auto & [hash, tx] : mempool.txs)
+                if (tx->generation <= genAtRequest)
+                    droppedTxs.insert(hash);
+            for (const auto & hash : hashes)
+                droppedTxs.erase(hash);
+        }
         if (UNLIKELY(!droppedTxs.empty())) {
             // If tx's were dropped, we clear the mempool and try again. We also enqueue notifications for the dropped
             // tx's.
@@ -749,7 +796,7 @@ void SynchMempoolTask::doGetRawMempool()
             // NOTIFICATION
             if (recommendFullRetry) {
                 // NOTIFICATION of all ...
-                scriptHashesAffected.merge(Util::keySet<decltype(scriptHashesAffected)>(mempool.hashXTxs));
+                scriptHashesAffected.merge(mempool.hashXSet<decltype(scriptHashesAffected)>());
                 DebugM("Will notify for all ", scriptHashesAffected.size(), " addresses of mempool for notificatons ...");
             } else {
                 // just the dropped tx's
@@ -757,7 +804,7 @@ void SynchMempoolTask::doGetRawMempool()
                     if (auto it = mempool.txs.find(txid); it != mempool.txs.end()) {
                         const auto & tx = it->second;
                         if (tx) // paranoia: tx will always be a valid reference.
-                            scriptHashesAffected.merge(Util::keySet<decltype(scriptHashesAffected)>(tx->hashXs));
+                            tx->forEachHashXIdx([&](Mempool::HashXIdx idx){ scriptHashesAffected.insert(mempool.hashXForIdx(idx)); });
                     }
                 }
                 DebugM("Will notify for ", scriptHashesAffected.size(), " addresses belonging to the dropped tx's for notificatons ...");
@@ -785,7 +832,7 @@ struct Controller::StateMachine
 {
     enum State {
         Begin=0, WaitingForChainInfo, GetBlocks, DownloadingBlocks, FinishedDL, End, Failure, IBD, Retry,
-        SynchMempool, SynchingMempool, SynchMempoolFinished
+        SynchMempool, SynchingMempool, SynchMempoolFinished, FindingForkPoint, VerifyingSnapshot
     };
     State state = Begin;
     int ht = -1; ///< the latest height bitcoind told us this run
@@ -807,6 +854,7 @@ struct Controller::StateMachine
                                                         "FinishedDL", "End",
                                                         "Failure", "IBD", "Retry",
                                                         "SynchMempool", "SynchingMempool", "SynchMempoolFinished",
+                                                        "FindingForkPoint", "VerifyingSnapshot",
                                                         "Unknown" /* this should always be last */ };
         auto idx = qMin(size_t(state), std::size(stateStrings)-1);
         return stateStrings[idx];
@@ -953,9 +1001,13 @@ void Controller::process(bool beSilentIfUpToDate)
                           << "Some protocol methods such as \"blockchain.address.*\" will not work correctly. "
                           << "Please update your software and/or report this to the developers.";
             }
+            sm->ht = task->info.blocks;
+            if (const auto snapshotHeight = storage->unverifiedSnapshotHeight(); snapshotHeight.has_value()) {
+                process_VerifySnapshot(*snapshotHeight); // must happen before we modify the db in any way
+                return;
+            }
             QByteArray tipHeader;
             const auto [tip, tipHash] = storage->latestTip(&tipHeader);
-            sm->ht = task->info.blocks;
             if (tip == sm->ht) {
                 if (task->info.bestBlockhash == tipHash) { // no reorg
                     if (!beSilentIfUpToDate) {
@@ -968,14 +1020,14 @@ void Controller::process(bool beSilentIfUpToDate)
                 } else {
                     // height ok, but best block hash mismatch.. reorg
                     Warning() << "We have bestBlock " << tipHash.toHex() << ", but bitcoind reports bestBlock " << task->info.bestBlockhash.toHex() << "."
-                              << " Possible reorg, will rewind back 1 block and try again ...";
-                    process_DoUndoAndRetry(); // attempt to undo 1 block and try again.
+                              << " Possible reorg, will rewind to the fork point and try again ...";
+                    process_DoUndoAndRetry(); // find the fork point, undo back to it, and download the new branch
                     return;
                 }
             } else if (tip > sm->ht) {
                 Warning() << "We have height " << tip << ", but bitcoind reports height " << sm->ht << "."
-                          << " Possible reorg, will rewind back 1 block and try again ...";
-                process_DoUndoAndRetry(); // attempt to undo 1 block and try again.
+                          << " Possible reorg, will rewind to the fork point and try again ...";
+                process_DoUndoAndRetry(); // find the fork point, undo back to it, and download the new branch
                 return;
             } else {
                 Log() << "Block height " << sm->ht << ", downloading new blocks ...";
@@ -1053,18 +1105,48 @@ void Controller::process(bool beSilentIfUpToDate)
         emit synchFailure();
     } else if (sm->state == State::SynchMempool) {
         // ...
-        auto task = newTask<SynchMempoolTask>(true, this, storage, masterNotifySubsFlag);
+        // Give the task the last fingerprint so that it may skip an unchanged poll, unless we've skipped too many in a
+        // row. It's reset while the task runs and only restored on success.
+        std::optional<MempoolFingerprint> fp;
+        if (nMempoolPollsSkippedInARow < kMaxMempoolPollsSkippedInARow)
+            fp = lastMempoolFingerprint;
+        lastMempoolFingerprint.reset();
+        auto task = newTask<SynchMempoolTask>(true, this, storage, masterNotifySubsFlag, fp);
         task->threadObjectDebugLifecycle = Trace::isEnabled(); // suppress verbose lifecycle prints unless trace mode
         connect(task, &CtlTask::success, this, [this, task]{
             if (UNLIKELY(!sm || isTaskDeleted(task) || sm->state != State::SynchingMempool))
                 // task was stopped from underneath us and/or this response is stale.. so return and ignore
                 return;
+            lastMempoolFingerprint = task->fingerprint;
+            if (task->skipped) {
+                ++mempoolRefreshStats.nPollsSkipped;
+                ++nMempoolPollsSkippedInARow;
+            } else {
+                ++mempoolRefreshStats.nPollsFull;
+                nMempoolPollsSkippedInARow = 0;
+            }
+            if (const auto n = task->expectedNumTxsDownloaded; n > 0) {
+                auto & rs = mempoolRefreshStats;
+                ++rs.nRefreshes;
+                rs.lastNumTxs = n;
+                rs.lastSecs = task->elapsedSecs;
+                rs.lastLockSecs = task->lockHeldSecs;
+                if (n >= rs.maxNumTxs) {
+                    rs.maxNumTxs = n;
+                    rs.maxSecs = task->elapsedSecs;
+                    rs.maxLockSecs = task->lockHeldSecs;
+                }
+            }
             sm->state = State::SynchMempoolFinished;
             AGAIN();
         });
         sm->state = State::SynchingMempool;
     } else if (sm->state == State::SynchingMempool) {
         // ... nothing..
+    } else if (sm->state == State::FindingForkPoint) {
+        // ... nothing.. the FindForkPointTask will advance the state (see process_DoUndoAndRetry)
+    } else if (sm->state == State::VerifyingSnapshot) {
+        // ... nothing.. the FindForkPointTask will advance the state (see process_VerifySnapshot)
     } else if (sm->state == State::SynchMempoolFinished) {
         // ...
         sm->state = State::End;
@@ -1181,7 +1263,7 @@ bool Controller::process_VerifyAndAddBlock(PreProcessedBlockPtr ppb)
 
     } catch (const HeaderVerificationFailure & e) {
         DebugM("addBlock exception: ", e.what());
-        Log() << "Possible reorg detected at height " << ppb->height << ", rewinding 1 block and trying again ...";
+        Log() << "Possible reorg detected at height " << ppb->height << ", rewinding to the fork point and trying again ...";
         process_DoUndoAndRetry();
         return false;
     } catch (const std::exception & e) {
@@ -1198,18 +1280,108 @@ bool Controller::process_VerifyAndAddBlock(PreProcessedBlockPtr ppb)
 void Controller::process_DoUndoAndRetry()
 {
     assert(sm);
-    try {
-        storage->undoLatestBlock(masterNotifySubsFlag);
+    const int tip = storage->latestTip().first;
+    // Stop any block downloads in progress; whatever they fetch may be on the orphaned branch. Note that any blocks
+    // that still arrive via putBlock are ignored since we leave the DownloadingBlocks state below.
+    sm->ppBlocks.clear();
+    std::vector<CtlTask *> dlTasks;
+    for (const auto & [task, uptr] : tasks)
+        if (dynamic_cast<DownloadBlocksTask *>(task))
+            dlTasks.push_back(task);
+    for (auto *task : dlTasks)
+        rmTask(task);
+    // The fork point must be at or below bitcoind's height, and we can only rewind as far as we have undo info for.
+    const int fromHeight = sm->ht >= 0 ? std::min(tip, sm->ht) : tip;
+    const auto earliestUndo = storage->earliestUndoHeight();
+    const int minHeight = std::max({tip - int(storage->configuredUndoDepth()), earliestUndo ? int(*earliestUndo) - 1 : tip, 0});
+    auto task = newTask<FindForkPointTask>(false, this, storage, fromHeight, minHeight);
+    task->threadObjectDebugLifecycle = Trace::isEnabled(); // suppress debug prints here unless we are in trace mode
+    sm->state = StateMachine::State::FindingForkPoint;
+    connect(task, &CtlTask::success, this, [this, task, tip]{
+        if (UNLIKELY(!sm || isTaskDeleted(task) || sm->state != StateMachine::State::FindingForkPoint))
+            // task was stopped from underneath us and/or this response is stale.. so return and ignore
+            return;
+        const int forkHeight = task->forkHeight;
+        try {
+            if (const int n = tip - forkHeight; n > 0) {
+                DebugM("Fork point is at height ", forkHeight, ", rewinding ", n, Util::Pluralize(" block", n));
+                storage->undoLatestBlocks(unsigned(n), masterNotifySubsFlag);
+            }
+        } catch (const std::exception & e) {
+            Fatal() << "Failed to rewind: " << e.what() << inconsistentStateSorry;
+            sm->state = StateMachine::State::Failure;
+            // upon return to event loop, will shut down
+            return;
+        }
         // . <-- If we get here, rollback was successful.
-        // We flag the state to retry, which retries the full download right away
-        // (Note: this may eventually lead us to roll back again and again until we reorg to the sufficient depth).
-        sm->state = StateMachine::State::Retry;
-        AGAIN(); // schedule us again to do cleanup
-    } catch (const std::exception & e) {
-        Fatal() << "Failed to rewind: " << e.what() << inconsistentStateSorry;
+        if (sm->ht > forkHeight) {
+            // Download and apply the new branch right away, without going back to the Begin state.
+            Log() << "Rewound to height " << forkHeight << ", downloading new blocks ...";
+            sm->state = StateMachine::State::GetBlocks;
+        } else
+            // Unlikely: nothing to download. Retry the full cycle right away.
+            sm->state = StateMachine::State::Retry;
+        AGAIN();
+    });
+    connect(task, &CtlTask::errored, this, [this, task]{
+        if (UNLIKELY(!sm || isTaskDeleted(task) || sm->state != StateMachine::State::FindingForkPoint))
+            return;
+        if (task->tooDeep) {
+            Fatal() << "Failed to rewind: " << task->errorMessage << ". The reorg is deeper than the available undo info."
+                    << inconsistentStateSorry;
+            sm->state = StateMachine::State::Failure;
+            // upon return to event loop, will shut down
+            return;
+        }
+        Error() << "Task errored: " << task->objectName() << ", error: " << task->errorMessage;
+        genericTaskErrored();
+    });
+}
+
+void Controller::process_VerifySnapshot(unsigned snapshotHeight)
+{
+    assert(sm);
+    if (sm->ht < int(snapshotHeight)) {
+        // bitcoind doesn't have the block yet; we will try again later via the poll timer
+        Warning() << "bitcoind is at height " << sm->ht << ", which is below the imported snapshot height "
+                  << snapshotHeight << ". Waiting for bitcoind to catch up before checking the snapshot ...";
         sm->state = StateMachine::State::Failure;
-        // upon return to event loop, will shut down
+        AGAIN();
+        return;
     }
+    // fromHeight == minHeight: the task succeeds iff our header at the snapshot height is bitcoind's block at that height
+    auto task = newTask<FindForkPointTask>(false, this, storage, int(snapshotHeight), int(snapshotHeight));
+    task->threadObjectDebugLifecycle = Trace::isEnabled(); // suppress debug prints here unless we are in trace mode
+    sm->state = StateMachine::State::VerifyingSnapshot;
+    connect(task, &CtlTask::success, this, [this, task, snapshotHeight]{
+        if (UNLIKELY(!sm || isTaskDeleted(task) || sm->state != StateMachine::State::VerifyingSnapshot))
+            // task was stopped from underneath us and/or this response is stale.. so return and ignore
+            return;
+        try {
+            storage->setSnapshotVerified();
+        } catch (const std::exception & e) {
+            Fatal() << e.what();
+            sm->state = StateMachine::State::Failure;
+            return;
+        }
+        Log() << "Imported snapshot at height " << snapshotHeight << " matches bitcoind's chain, proceeding ...";
+        sm->state = StateMachine::State::Retry; // start over from Begin, this time synching normally
+        AGAIN();
+    });
+    connect(task, &CtlTask::errored, this, [this, task, snapshotHeight]{
+        if (UNLIKELY(!sm || isTaskDeleted(task) || sm->state != StateMachine::State::VerifyingSnapshot))
+            return;
+        if (task->tooDeep) {
+            Fatal() << "The imported snapshot's block at height " << snapshotHeight << " is not in bitcoind's chain. "
+                    << "The snapshot may be from a different chain or fork. Delete the datadir and import a snapshot "
+                    << "taken from a server following the same chain as this bitcoind, or resynch.";
+            sm->state = StateMachine::State::Failure;
+            // upon return to event loop, will shut down
+            return;
+        }
+        Error() << "Task errored: " << task->objectName() << ", error: " << task->errorMessage;
+        genericTaskErrored();
+    });
 }
 
 // -- CtlTask
@@ -1321,6 +1493,24 @@ auto Controller::stats() const -> Stats
         m["StateMachine"] = m2;
     } else
         m["StateMachine"] = QVariant(); // null
+    {
+        const auto & rs = mempoolRefreshStats;
+        const auto fmt = [](unsigned n, double secs, double lockSecs) {
+            return QVariantMap{{"numTxs", n}, {"secs", QString::number(secs, 'f', 3)},
+                               {"txs/sec", secs > 0. ? QString::number(n / secs, 'f', 1) : QString()},
+                               {"writeLockHeld", QString::number(lockSecs * 1e3, 'f', 3) + " msec"}};
+        };
+        m["Mempool refresh"] = rs.nRefreshes ? QVariantMap{
+            {"count", rs.nRefreshes},
+            {"latest", fmt(rs.lastNumTxs, rs.lastSecs, rs.lastLockSecs)},
+            {"largest", fmt(rs.maxNumTxs, rs.maxSecs, rs.maxLockSecs)},
+            {"maxTxsInFlight", qulonglong(SynchMempoolTask::kMaxTxsInFlight)},
+        } : QVariant();
+        m["Mempool polls"] = QVariantMap{
+            {"full", rs.nPollsFull},
+            {"skipped (unchanged)", rs.nPollsSkipped},
+        };
+    }
     m["activeTimers"] = activeTimerMapForStats();
     QVariantList l;
     { // task list
@@ -1395,18 +1585,16 @@ auto Controller::debug(const StatsParams &p) const -> Stats // from StatsMixin
             m["sizeBytes"] = tx->sizeBytes;
             m["fee"] = tx->fee.ToString().c_str();
             m["hasUnconfirmedParentTx"] = tx->hasUnconfirmedParentTx;
-            static const auto TXOInfo2Map = [](const TXOInfo &info) -> QVariantMap {
-                return QVariantMap{
-                    { "amount", QString::fromStdString(info.amount.ToString()) },
-                    { "scriptHash", info.hashX.toHex() },
-                };
-            };
             QVariantMap txos;
             IONum num = 0;
-            for (const auto & info : tx->txos) {
+            for (const auto & out : tx->txos) {
                 QVariantMap infoMap;
-                if (info.isValid())
-                    infoMap = TXOInfo2Map(info);
+                if (out.isValid())
+                    infoMap = QVariantMap{
+                        { "amount", QString::fromStdString(out.amount.ToString()) },
+                        { "scriptHash", mempool.hashXForIdx(out.hashXIdx).toHex() },
+                        { "spentInMempool", out.spentInMempool },
+                    };
                 else
                     infoMap = QVariantMap{
                         { "amount" , QVariant() },
@@ -1416,49 +1604,53 @@ auto Controller::debug(const StatsParams &p) const -> Stats // from StatsMixin
                 txos[QString::number(num++)] = infoMap;
             }
             m["txos"] = txos;
-            QVariantMap hxs;
-            static const auto IOInfo2Map = [](const Mempool::Tx::IOInfo &inf) -> QVariantMap {
-                QVariantMap ret;
-#if QT_VERSION < QT_VERSION_CHECK(5, 14, 0)
-                const auto vl = QVariantList::fromStdList( Util::toList<std::list<QVariant>>(inf.utxo) );
-#else
-                const auto vl = Util::toList<QVariantList>(inf.utxo);
-#endif
-                ret["utxos"] = vl;
-                ret["utxos (BucketCount)"] = qlonglong(inf.utxo.bucket_count());
-                ret["utxos (LoadFactor)"] = QString::number(double(inf.utxo.load_factor()), 'f', 4);
-                QVariantMap cs;
-                for (const auto & [txo, info] : inf.confirmedSpends)
-                    cs[txo.toString()] = TXOInfo2Map(info);
-                ret["confirmedSpends"] = cs;
-                ret["confirmedSpends (LoadFactor)"] = QString::number(double(inf.confirmedSpends.load_factor()), 'f', 4);
-                QVariantMap us;
-                for (const auto & [txo, info] : inf.unconfirmedSpends)
-                    us[txo.toString()] = TXOInfo2Map(info);
-                ret["unconfirmedSpends"] = us;
-                ret["unconfirmedSpends (LoadFactor)"] = QString::number(double(inf.unconfirmedSpends.load_factor()), 'f', 4);
-                return ret;
-            };
-            for (const auto & [sh, ioinfo] : tx->hashXs)
-                hxs[sh.toHex()] = IOInfo2Map(ioinfo);
-            m["hashXs"] = hxs;
-            m["hashXs (LoadFactor)"] = QString::number(double(tx->hashXs.load_factor()), 'f', 4);
+            QVariantMap spends;
+            for (const auto & spend : tx->spends)
+                spends[spend.txo.toString()] = QVariantMap{
+                    { "amount", QString::fromStdString(spend.amount.ToString()) },
+                    { "scriptHash", mempool.hashXForIdx(spend.hashXIdx).toHex() },
+                    { "confirmed", spend.confirmed },
+                };
+            m["spends"] = spends;
 
             txs[hash.toHex()] = m;
         }
         mp["txs"] = txs;
         mp["txs (LoadFactor)"] = QString::number(double(mempool.txs.load_factor()), 'f', 4);
         QVariantMap hxs;
-        for (const auto & [sh, txset] : mempool.hashXTxs) {
-            QVariantList l;
-            for (const auto & tx : txset)
-                if (tx) l.push_back(tx->hash.toHex());
-            hxs[sh.toHex()] = l;
+        for (const auto & shard : mempool.hashXTxShards) {
+            for (const auto & [sh, txset] : shard) {
+                QVariantList l;
+                for (const auto & tx : txset)
+                    if (tx) l.push_back(tx->hash.toHex());
+                hxs[sh.toHex()] = l;
+            }
         }
         mp["hashXTxs"] = hxs;
-        mp["hashXTxs (LoadFactor)"] = QString::number(double(mempool.hashXTxs.load_factor()), 'f', 4);
+        QVariantList lfs;
+        for (const auto & shard : mempool.hashXTxShards)
+            lfs.push_back(QString::number(double(shard.load_factor()), 'f', 4));
+        mp["hashXTxs (LoadFactor per shard)"] = lfs;
         ret["mempool_debug"] = mp;
     }
+    if (p.contains("mempool_mem")) {
+        Mempool::MemUsage mu;
+        {
+            auto [mempool, lock] = storage->mempool();
+            mu = mempool.memUsage();
+        }
+        const auto perTx = [n = std::max(mu.nTxs, size_t(1))](size_t bytes) { return QString::number(double(bytes) / n, 'f', 1); };
+        ret["mempool_mem"] = QVariantMap{
+            { "txs", qulonglong(mu.nTxs) },
+            { "hashXs", qulonglong(mu.nHashXs) },
+            { "outs", qulonglong(mu.nOuts) },
+            { "spends", qulonglong(mu.nSpends) },
+            { "tx bytes (est.)", qulonglong(mu.txBytes) },
+            { "index bytes (est.)", qulonglong(mu.indexBytes) },
+            { "bytes/tx (est.)", perTx(mu.txBytes + mu.indexBytes) },
+            { "tx bytes/tx (est.)", perTx(mu.txBytes) },
+        };
+    }
     if (p.contains("subs")) {
         const auto timeLeft = kDefaultTimeout - (Util::getTime() - t0/1000000) - 50;
         ret["subscriptions"] = storage->subs()->debugSafe(p, std::max(5, int(timeLeft)));
@@ -29,6 +29,7 @@
 
 #include <atomic>
 #include <memory>
+#include <optional>
 #include <tuple>
 #include <shared_mutex>
 #include <type_traits>
@@ -63,6 +64,20 @@ public:
     /// for debug printing when it receives new mempool tx's.
     static void printMempoolStatusToLog(size_t newSize, size_t numAddresses, bool useDebugLogger, bool force = false);
 
+    /// A cheap summary of bitcoind's mempool (from getmempoolinfo), plus our Mempool::generation, as of the end of the
+    /// last successful SynchMempoolTask. If neither has changed by the next poll, it skips getrawmempool entirely.
+    struct MempoolFingerprint {
+        qint64 size = -1, bytes = -1, usage = -1;
+        std::uint64_t generation = 0;
+        bool operator==(const MempoolFingerprint &o) const {
+            return size == o.size && bytes == o.bytes && usage == o.usage && generation == o.generation;
+        }
+        bool operator!=(const MempoolFingerprint &o) const { return !(*this == o); }
+    };
+    /// After this many polls in a row are skipped, the next one fetches getrawmempool regardless, as a safety net
+    /// against fingerprint collisions (e.g. one tx expiring and another of the same size arriving in between polls).
+    static constexpr unsigned kMaxMempoolPollsSkippedInARow = 10;
+
 signals:
     /// Emitted whenever bitcoind is detected to be up-to-date, and everything is synched up.
     /// note this is not emitted during regular polling, but only after `synchronizing` was emitted previously.
@@ -137,7 +152,12 @@ private:
     void process_DownloadingBlocks();
     bool process_VerifyAndAddBlock(PreProcessedBlockPtr); ///< helper called from within DownloadingBlocks state -- makes sure block is sane and adds it to db
     void process_PrintProgress(unsigned height, size_t nTx, size_t nIns, size_t nOuts, size_t nSH);
-    void process_DoUndoAndRetry(); ///< internal -- calls storage->undoLatestBlock() and schedules a task death and retry.
+    /// internal -- locates the fork point with bitcoind's chain via a FindForkPointTask, rewinds to it in one batch
+    /// via storage->undoLatestBlocks(), then proceeds directly to downloading the new branch.
+    void process_DoUndoAndRetry();
+    /// internal -- if the db was imported from a snapshot, checks bitcoind's block hash at the snapshot height (via a
+    /// FindForkPointTask) before any synching is done. A mismatch is fatal.
+    void process_VerifySnapshot(unsigned snapshotHeight);
 
     size_t nBlocksDownloadedSoFar() const; ///< not 100% accurate. call this only from this thread
     std::tuple<size_t, size_t, size_t> nTxInOutSoFar() const; ///< not 100% accurate. call this only from this thread
@@ -152,6 +172,18 @@ private:
     /// takes locks, prints to Log() every 30 seconds if there were changes
     void printMempoolStatusToLog() const;
 
+    /// Timing info for SynchMempoolTask runs, shown in /stats. Only accessed from this thread.
+    struct MempoolRefreshStats {
+        qint64 nRefreshes = 0; ///< number of successful SynchMempoolTask runs that downloaded at least 1 tx
+        unsigned lastNumTxs = 0, maxNumTxs = 0; ///< new tx's downloaded by the latest and by the largest refresh
+        double lastSecs = 0., maxSecs = 0.; ///< time taken by the latest and by the largest refresh
+        double lastLockSecs = 0., maxLockSecs = 0.; ///< time the exclusive mempool lock was held by each of the above
+        qint64 nPollsFull = 0, nPollsSkipped = 0; ///< polls that fetched getrawmempool vs. those skipped by fingerprint
+    } mempoolRefreshStats;
+
+    std::optional<MempoolFingerprint> lastMempoolFingerprint; ///< reset while a SynchMempoolTask is running
+    unsigned nMempoolPollsSkippedInARow = 0;
+
     /// If --dump-sh was specified on CLI, this will execute at startup() time right after storage has been loaded. May throw.
     void dumpScriptHashes(const QString &fileName) const;
 };
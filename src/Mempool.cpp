@@ -1,5 +1,9 @@
+#include "BTC.h"
+#include "Common.h"
 #include "Mempool.h"
+#include "Util.h"
 
+#include <algorithm>
 #include <functional>
 #include <map>
 
@@ -8,15 +12,9 @@ auto Mempool::calcCompactFeeHistogram(double binSize) const -> FeeHistogramVec
     // this algorithm is taken from:
     // https://github.com/Electron-Cash/electrumx/blob/fbd00416d804c286eb7de856e9399efb07a2ceaf/electrumx/server/mempool.py#L139
     FeeHistogramVec ret;
-    std::map<unsigned, unsigned, std::greater<unsigned>> histogram; // sorted map, descending order by key
+    const auto & histogram = feeRateBuckets; // sorted map, descending order by key; maintained as tx's are added
 
-    for (const auto & [txid, tx] : txs) {
-        const auto feeRate = unsigned(tx->fee / bitcoin::Amount::satoshi()) // sats
-                             /  std::max(tx->sizeBytes, 1u); // per byte
-        histogram[feeRate] += tx->sizeBytes; // accumulate size by feeRate
-    }
-
-    // now, compact the bins
+    // compact the bins
     ret.reserve(8);
     unsigned cumSize = 0;
     double r = 0.;
@@ -33,3 +31,87 @@ auto Mempool::calcCompactFeeHistogram(double binSize) const -> FeeHistogramVec
     ret.shrink_to_fit(); // save memory
     return ret;
 }
+
+auto Mempool::decodeNewTx(const QByteArray &rawTx, TxRef tx) -> NewTx
+{
+    NewTx ret;
+    const TxHash hash = BTC::HashRev(rawTx);
+    if (!tx) {
+        tx = std::make_shared<Tx>();
+        tx->hash = hash;
+    } else if (hash != tx->hash)
+        throw Exception("Received tx data appears to not match requested tx! FIXME!!");
+    tx->sizeBytes = unsigned(rawTx.length()); // save size now -- this is needed later to calculate fees and for everything else.
+    {
+        // tmp mutable object will be moved into CTransactionRef below via a move constructor
+        bitcoin::CMutableTransaction ctx = BTC::Deserialize<bitcoin::CMutableTransaction>(rawTx);
+        ret.ctx = bitcoin::MakeTransactionRef(std::move(ctx));
+    }
+    ret.outHashXs.reserve(ret.ctx->vout.size());
+    for (const auto & out : ret.ctx->vout)
+        ret.outHashXs.push_back(BTC::IsOpReturn(out.scriptPubKey) ? HashX() : BTC::HashXFromCScript(out.scriptPubKey));
+    ret.prevouts.reserve(ret.ctx->vin.size());
+    for (const auto & in : ret.ctx->vin)
+        ret.prevouts.push_back(TXO{BTC::Hash2ByteArrayRev(in.prevout.GetTxId()), IONum(in.prevout.GetN())});
+    ret.tx = std::move(tx);
+    return ret;
+}
+
+bool Mempool::rebuildIndexes()
+{
+    hashXIdxMap.clear();
+    for (auto & shard : hashXTxShards)
+        shard.clear();
+    feeRateBuckets.clear();
+    hashXIdxMap.reserve(hashXTable.size());
+    for (size_t i = 0; i < hashXTable.size(); ++i)
+        hashXIdxMap.emplace(hashXTable[i], HashXIdx(i));
+    bool ok = true;
+    for (const auto & [txid, tx] : txs) {
+        tx->forEachHashXIdx([&](HashXIdx idx){
+            if (UNLIKELY(idx >= hashXTable.size())) { ok = false; return; }
+            const auto & sh = hashXTable[idx];
+            hashXTxsShardFor(sh)[sh].push_back(tx);
+        });
+        feeHistogramAdd(*tx);
+    }
+    for (auto & shard : hashXTxShards)
+        for (auto & [sh, txvec] : shard)
+            Util::sortAndUniqueify<TxRefOrdering>(txvec);
+    return ok;
+}
+
+namespace {
+    // Approximate sizes used by Mempool::memUsage() below, for 64-bit platforms. These are estimates, not measurements.
+    constexpr size_t kMallocOverhead = 16; ///< per heap allocation
+    constexpr size_t kSharedPtrCtlBlock = 16; ///< std::make_shared control block
+    constexpr size_t kHashHeapBytes = 24 /* QArrayData */ + HashLen + 1 + kMallocOverhead; ///< a non-shared 32-byte QByteArray's heap block
+}
+
+auto Mempool::memUsage() const -> MemUsage
+{
+    MemUsage ret;
+    ret.nTxs = txs.size();
+    ret.nHashXs = hashXTable.size();
+    for (const auto & [txid, tx] : txs) {
+        if (!tx) continue;
+        ret.nOuts += tx->txos.size();
+        ret.nSpends += tx->spends.size();
+        ret.txBytes += kSharedPtrCtlBlock + kMallocOverhead + sizeof(Tx) + kHashHeapBytes /* tx->hash */
+                       + tx->txos.capacity() * sizeof(Tx::Out) + (tx->txos.capacity() ? kMallocOverhead : 0)
+                       + tx->spends.capacity() * sizeof(Tx::Spend) + (tx->spends.capacity() ? kMallocOverhead : 0)
+                       + tx->spends.size() * kHashHeapBytes; /* Spend::txo.prevoutHash */
+    }
+    // indices: the robin_hood tables (1 info byte per slot), the per-hashX tx vectors, and the interned hashX data
+    const auto tableBytes = [](const auto &map, size_t slotSize) -> size_t {
+        return map.mask() ? (map.mask() + 1) * (slotSize + 1) : 0;
+    };
+    ret.indexBytes = tableBytes(txs, sizeof(TxMap::value_type)) + tableBytes(hashXIdxMap, sizeof(std::pair<HashX, HashXIdx>))
+                     + hashXTable.capacity() * sizeof(HashX) + hashXTable.size() * kHashHeapBytes;
+    for (const auto & shard : hashXTxShards) {
+        ret.indexBytes += tableBytes(shard, sizeof(void *));
+        for (const auto & [sh, txvec] : shard)
+            ret.indexBytes += sizeof(HashXTxMap::value_type) + txvec.capacity() * sizeof(TxRef) + kMallocOverhead;
+    }
+    return ret;
+}
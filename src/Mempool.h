@@ -22,8 +22,14 @@
 #include "TXO.h"
 
 #include "bitcoin/amount.h"
+#include "bitcoin/transaction.h"
 #include "robin_hood/robin_hood.h"
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <limits>
 #include <list>
 #include <map>
 #include <memory>
@@ -38,37 +44,72 @@
 struct Mempool
 {
 
-    /// This info, with the exception of `hashXs` comes from bitcoind via the "getrawmempool true" RPC call.
+    /// Index into the interned scripthash table owned by the Mempool (see `hashXTable` below). Tx's refer to
+    /// scripthashes this way rather than each holding their own QByteArray copies.
+    using HashXIdx = std::uint32_t;
+    static constexpr HashXIdx NoHashXIdx = std::numeric_limits<HashXIdx>::max();
+
+    /// This info, with the exception of `txos` and `spends` comes from bitcoind via the "getrawmempool" and
+    /// "getrawtransaction" RPC calls.
+    ///
+    /// The tx's inputs and outputs are kept in two flat vectors rather than in per-scripthash node-based maps and
+    /// sets. Mempool tx's have few inputs and outputs, so a linear scan (or a binary search for `spends`) is both
+    /// smaller and faster than hashing.
     struct Tx
     {
         TxHash hash; ///< in reverse bitcoind order (ready for hex encode), fixed value.
         unsigned sizeBytes = 0;
         bitcoin::Amount fee{bitcoin::Amount::zero()}; ///< we calculate this fee ourselves since in the past I noticed we get a funny value sometimes that's off by 1 or 2 sats --  which I suspect is due limitations of doubles, perhaps?
         bool hasUnconfirmedParentTx = false; ///< If true, this tx depends on another tx in the mempool. This is fixed once calculated properly by the SynchMempoolTask in Controller.cpp
+        /// The Mempool::generation this tx was added in (0 for tx's restored from a saved mempool). SynchMempoolTask
+        /// uses this to tell apart tx's that were added after it asked bitcoind for its mempool.
+        std::uint64_t generation = 0;
+
+        /// An output of this tx.
+        struct Out {
+            bitcoin::Amount amount;
+            HashXIdx hashXIdx = NoHashXIdx; ///< NoHashXIdx for OP_RETURN outputs (which are not indexed)
+            /// Set if a descendant tx in the mempool spends this output. Unspent outputs get _added_ to the
+            /// "unconfirmed" balance in RPC get_balance and appear in RPC listunspent.
+            bool spentInMempool = false;
+
+            bool isValid() const { return hashXIdx != NoHashXIdx; }
+        };
 
-        /// These are all the txos in this tx. Once set-up, this doesn't change (unlike IOInfo.utxo).
-        /// Note that this vector is always sized to the number of txouts in the tx. It may, however, contain !isValid
-        /// txo entries if an entry was an OP_RETURN (and thus was not indexed with a scripthash).  Code using this
-        /// vector should check if txos[i].isValid().
-        std::vector<TXOInfo> txos;
-
-        struct IOInfo {
-            /// spends. .confirmedSpends here affects get_balance. We use unordered_map here because it wastes less space than robin_hood on fixed-sized maps
-            std::unordered_map<TXO, TXOInfo, std::hash<TXO>>
-                /// Spends of txo's from the db (confirmed) utxoset.
-                /// - Items here get _subtracted_ from the "unconfirmed" in RPC get_balance.
-                /// - Items appearing here also suppress confirmed utxo items from appearing in RPC listunspent (since they are spent in mempool).
-                confirmedSpends,
-                /// spends of mempool ancestor txos. Items appearing here will not appear in the ancestor's
-                /// IOInfo::utxo map (their insertion here accompanies a deletion of those ancestor items).
-                unconfirmedSpends;
-            /// UNSPENT outs, this is used to modify listunspent and get_balance. This map may get items deleted as
-            /// the mempool evolves if new descendants appear that spend these txos (those descendants will list the
-            /// item that gets deleted from here in their own IOInfo::unconfirmedSpends map).
-            /// + Items here get _added_ to the "unconfirmed" balance in RPC get_balance.
-            std::unordered_set<IONum> utxo; ///< IONums which are indices into the txos vector declared above. We use an unordered_set here because it's more efficient than a regular set, and we don't care about order anyway.
+        /// An input of this tx.
+        struct Spend {
+            HashXIdx hashXIdx = NoHashXIdx; ///< the scripthash of the output being spent
+            /// If true, this spends a txo from the db (confirmed) utxoset. Such spends get _subtracted_ from the
+            /// "unconfirmed" in RPC get_balance, and suppress the confirmed utxo from appearing in RPC listunspent.
+            /// If false, this spends an output of a mempool ancestor, which is then marked `spentInMempool`.
+            bool confirmed = false;
+            TXO txo;
+            bitcoin::Amount amount;
         };
 
+        /// All the outputs of this tx, indexed by IONum. Once set-up, this doesn't change (except for
+        /// Out::spentInMempool). Entries for OP_RETURN outputs are !isValid().
+        std::vector<Out> txos;
+
+        /// All the inputs of this tx, sorted by hashXIdx. Fixed once built.
+        std::vector<Spend> spends;
+
+        /// Returns the [begin, end) range of `spends` that spend outputs belonging to `hashXIdx`.
+        std::pair<std::vector<Spend>::const_iterator, std::vector<Spend>::const_iterator>
+        spendsFor(HashXIdx idx) const {
+            return std::equal_range(spends.cbegin(), spends.cend(), Spend{idx, false, {}, {}},
+                                    [](const Spend &a, const Spend &b) { return a.hashXIdx < b.hashXIdx; });
+        }
+
+        /// Calls f(HashXIdx) for every scripthash involved in this tx. May call it more than once for the same index.
+        template <typename Func>
+        void forEachHashXIdx(Func && f) const {
+            for (const auto & out : txos)
+                if (out.isValid()) f(out.hashXIdx);
+            for (const auto & spend : spends)
+                f(spend.hashXIdx);
+        }
+
         bool operator<(const Tx &o) const {
             // paranoia -- bools may sometimes not always be 1 or 0 in pathological circumstances.
             const uint8_t nParentMe = hasUnconfirmedParentTx ? 1 : 0,
@@ -78,10 +119,6 @@ struct Mempool
                 return nParentMe < nParentOther;
             return hash < o.hash;
         }
-
-        /// This should always contain all the HashX's involved in this tx. Note the use of unordered_map which can
-        /// save space vs. robin_hood for immutable maps (which this is, once built)
-        std::unordered_map<HashX, IOInfo, HashHasher> hashXs;
     };
 
     using TxRef = std::shared_ptr<Tx>;
@@ -102,13 +139,84 @@ struct Mempool
     };
     /// Note: The TxRefs here here point to the same object as the mapped_type in the TxMap above
     /// Note that while the mapped_type is a vector, it is guaranteed to contain unique TxRefs, ordered by
-    /// TxRefOrdering above.  This invariant is maintained in Controller.cpp, SynchMempoolTask::processResults().
+    /// TxRefOrdering above.  This invariant is maintained by Storage::addMempoolTxs().
     using HashXTxMap = robin_hood::unordered_node_map<HashX, std::vector<TxRef>, HashHasher>;
 
+    /// A tx that has been decoded but not yet added to the mempool, along with the data precomputed for it. These are
+    /// built off-thread with decodeNewTx() and then wired into the mempool by Storage::addMempoolTxs().
+    struct NewTx {
+        TxRef tx;
+        bitcoin::CTransactionRef ctx;
+        std::vector<HashX> outHashXs; ///< one per vout; empty for OP_RETURN outputs
+        std::vector<TXO> prevouts; ///< one per vin
+    };
+    using NewTxsMap = robin_hood::unordered_node_map<TxHash, NewTx, HashHasher>;
+    /// Deserializes `rawTx` (binary, not hex) and computes its output HashXs and prevouts. If `tx` is not null, its
+    /// hash must already be set and the data is checked against it; otherwise a new Tx is created for the data.
+    /// Sets tx->sizeBytes. Throws Exception on bad data. Thread-safe (it's intended to be called in the ThreadPool).
+    static NewTx decodeNewTx(const QByteArray &rawTx, TxRef tx = {});
+
+    /// The HashX -> TxRefs index is split into this many shards by HashX, so that Storage can lock each one
+    /// independently (see Storage::mempoolForHashX and Storage::MempoolWriter).
+    static constexpr unsigned kNumHashXShards = 16;
+    static unsigned hashXShard(const HashX &hashX) {
+        // HashX's are sha256 hashes, so the first byte is as good as any
+        return hashX.isEmpty() ? 0u : unsigned(uint8_t(hashX.at(0))) % kNumHashXShards;
+    }
+
 
     // -- Data members of struct Mempool --
     TxMap txs;
-    HashXTxMap hashXTxs;
+    /// Incremented on every modification (tx's added, or clear()). SynchMempoolTask uses this to tell whether the
+    /// mempool is still the one it last synched with bitcoind. Guarded by the tx map lock (see Storage.h).
+    std::uint64_t generation = 0;
+    /// Sharded HashX -> TxRefs index. Use the accessors below rather than touching the shards directly.
+    std::array<HashXTxMap, kNumHashXShards> hashXTxShards;
+
+    HashXTxMap & hashXTxsShardFor(const HashX &hashX) { return hashXTxShards[hashXShard(hashX)]; }
+    /// Returns the (unique, ordered) tx's involving `hashX`, or nullptr if it's not in the mempool.
+    const std::vector<TxRef> * txsForHashX(const HashX &hashX) const {
+        const auto & shard = hashXTxShards[hashXShard(hashX)];
+        const auto it = shard.find(hashX);
+        return it != shard.end() ? &it->second : nullptr;
+    }
+    /// The number of distinct scripthashes involved in the mempool
+    size_t numHashXs() const {
+        size_t ret = 0;
+        for (const auto & shard : hashXTxShards) ret += shard.size();
+        return ret;
+    }
+    /// Returns all the scripthashes involved in the mempool, as a `Set` (e.g. an unordered_set).
+    template <typename Set>
+    Set hashXSet() const {
+        Set ret;
+        ret.reserve(numHashXs());
+        for (const auto & shard : hashXTxShards)
+            for (const auto & [sh, txvec] : shard)
+                ret.insert(sh);
+        return ret;
+    }
+
+    /// Interned scripthashes: every HashX in the mempool appears here exactly once, and Tx's refer to it by its index.
+    /// Entries are never removed individually (the mempool is only ever cleared as a whole, see clear()), so indices
+    /// stay valid for as long as the Tx's referring to them do.
+    std::vector<HashX> hashXTable;
+    robin_hood::unordered_flat_map<HashX, HashXIdx, HashHasher> hashXIdxMap;
+
+    /// Returns the index of `hashX` in hashXTable, adding it if it is not already there.
+    HashXIdx internHashX(const HashX &hashX) {
+        auto [it, inserted] = hashXIdxMap.try_emplace(hashX, HashXIdx(hashXTable.size()));
+        if (inserted)
+            hashXTable.push_back(hashX);
+        return it->second;
+    }
+    /// Returns the index of `hashX` in hashXTable, or NoHashXIdx if it is not in the mempool.
+    HashXIdx findHashXIdx(const HashX &hashX) const {
+        const auto it = hashXIdxMap.find(hashX);
+        return it != hashXIdxMap.end() ? it->second : NoHashXIdx;
+    }
+    /// `idx` must be valid (a value previously returned by internHashX() since the last clear()).
+    const HashX & hashXForIdx(HashXIdx idx) const { return hashXTable[idx]; }
 
     inline void clear() {
         // Enforce a little hysteresis about what sizes we may need in the future; reserve 75% of the last size we saw.
@@ -117,13 +225,36 @@ struct Mempool
         // leave space in case we are in a situation where many tx's are coming in quickly.
         // Note that the default implementation of robin_hood clear() never shrinks its hashtables, and requires
         // explicit calles to reserve() even after a clear().
-        const auto txsSize = txs.size(), hxSize = hashXTxs.size();
+        const auto txsSize = txs.size(), hxSize = numHashXs();
+        ++generation;
         txs.clear();
-        hashXTxs.clear();
+        for (auto & shard : hashXTxShards) {
+            const auto shardSize = shard.size();
+            shard.clear();
+            shard.reserve(size_t(shardSize*0.75));
+        }
+        hashXTable.clear();
+        hashXIdxMap.clear();
+        feeRateBuckets.clear();
         txs.reserve(size_t(txsSize*0.75));
-        hashXTxs.reserve(size_t(hxSize*0.75));
+        hashXTable.reserve(size_t(hxSize*0.75));
+        hashXIdxMap.reserve(size_t(hxSize*0.75));
     }
 
+    /// Rebuilds hashXIdxMap, hashXTxShards and feeRateBuckets from `txs` and `hashXTable`. Used after loading a saved
+    /// mempool (see Storage::loadMempool). Returns false if a Tx refers to a HashXIdx that is out of range.
+    bool rebuildIndexes();
+
+    /// Estimated heap + struct memory used by the mempool, for the /debug endpoint. This is computed from the container
+    /// sizes and capacities plus assumed per-allocation overheads (it is not measured), so treat it as an
+    /// approximation. Takes O(N) time.
+    struct MemUsage {
+        size_t nTxs = 0, nHashXs = 0, nOuts = 0, nSpends = 0;
+        size_t txBytes = 0; ///< Tx structs plus their txos & spends vectors
+        size_t indexBytes = 0; ///< txs, hashXTxShards, hashXTable & hashXIdxMap
+    };
+    MemUsage memUsage() const;
+
     // -- Fee histogram support (used by mempool.get_fee_histogram RPC) --
 
     struct FeeHistogramItem {
@@ -131,8 +262,21 @@ struct Mempool
         unsigned cumulativeSize = 0; // bin size, cumulative bytes
     };
     using FeeHistogramVec = std::vector<FeeHistogramItem>;
-    /// This function is potentially going to take a couple of ms at worst on very large mempools.  Even a 1.5k tx
-    /// mempool takes under 1 ms on average hardware, so it's very fast. Storage calls this in refreshMempoolHistogram
-    /// from a periodic background task kicked off in Controller.
+
+    /// Total tx bytes per fee rate (sats/B, truncated), sorted in descending fee rate order. This is maintained
+    /// incrementally: Storage::addMempoolTxs() calls feeHistogramAdd() for each tx once its fee is known, and clear() resets it.
+    /// (Tx's are never removed one at a time; the mempool is only ever cleared as a whole.)
+    std::map<unsigned, unsigned, std::greater<unsigned>> feeRateBuckets;
+
+    static unsigned feeRateOf(const Tx &tx) {
+        return unsigned(tx.fee / bitcoin::Amount::satoshi()) // sats
+               / std::max(tx.sizeBytes, 1u); // per byte
+    }
+    /// Call this once for each tx added to `txs`, after its fee has been calculated.
+    void feeHistogramAdd(const Tx &tx) { feeRateBuckets[feeRateOf(tx)] += tx.sizeBytes; }
+
+    /// Builds the compact histogram from `feeRateBuckets`. This is O(buckets) (the number of distinct fee rates in
+    /// the mempool), regardless of the number of tx's. Storage calls this in refreshMempoolHistogram from a periodic
+    /// background task kicked off in Controller.
     FeeHistogramVec calcCompactFeeHistogram(double binSize = 1e5 /* binSize in bytes */) const;
 };
@@ -190,122 +190,123 @@ namespace Merkle {
         return ret;
     }
 
-    void Cache::initialize(unsigned l)
+    HashVec Cache::computeRoots(unsigned fromSeg, unsigned toSeg, const HashVec *hashes) const
     {
-        ExclusiveLockGuard g(lock);
-        Log() << "Initializing header merkle cache ...";
-        const auto hashes = getHashes(0, l);
-        initialize_nolock(hashes);
+        HashVec ret;
+        ret.reserve(toSeg > fromSeg ? toSeg - fromSeg : 0);
+        for (unsigned seg = fromSeg; seg < toSeg; ++seg) {
+            const unsigned start = seg * segmentLength();
+            if (hashes) {
+                if (UNLIKELY(start + segmentLength() > hashes->size()))
+                    throw InternalError("computeRoots: not enough hashes");
+                ret.emplace_back(root(HashVec(hashes->begin() + start, hashes->begin() + start + segmentLength()), SegmentDepth));
+            } else
+                ret.emplace_back(root(getHashes(start, segmentLength()), SegmentDepth));
+        }
+        return ret;
     }
-    void Cache::initialize(const HashVec &hashes)
+
+    HashVec Cache::initialize(unsigned l, const HashVec &knownRoots)
     {
-        ExclusiveLockGuard g(lock);
+        std::lock_guard g(writeLock);
         Log() << "Initializing header merkle cache ...";
-        initialize_nolock(hashes);
+        const unsigned nComplete = l >> SegmentDepth, nKnown = std::min(nComplete, unsigned(knownRoots.size()));
+        HashVec computed = computeRoots(nKnown, nComplete);
+        initialize_nolock(l, knownRoots, computed);
+        return computed;
     }
-
-    void Cache::initialize_nolock(const HashVec &hashes)
+    HashVec Cache::initialize(const HashVec &hashes, const HashVec &knownRoots)
     {
-        length = unsigned(hashes.size());
-        if (!length)
-            throw BadArgs("Merkle cache was initialized with an empty vector");
-        depthHigher = Merkle::treeDepth(length) / 2;
-        level = getLevel(hashes);
-        initialized = true;
-        DebugM("Merkle cache initialized to length ", length);
-    }
-
-    HashVec Cache::getLevel(const HashVec &hashes) const {
-        return Merkle::level(hashes, depthHigher);
+        std::lock_guard g(writeLock);
+        Log() << "Initializing header merkle cache ...";
+        const unsigned l = unsigned(hashes.size());
+        const unsigned nComplete = l >> SegmentDepth, nKnown = std::min(nComplete, unsigned(knownRoots.size()));
+        HashVec computed = computeRoots(nKnown, nComplete, &hashes);
+        initialize_nolock(l, knownRoots, computed);
+        return computed;
     }
 
-    void Cache::extendTo(unsigned l) {
-        if (l <= length)
-            return;
-        auto start = leafStart(length);
-        // Note this may throw here if a reorg happened and not enough headers now exist. Caller will just send error
-        // to the client, which is what we want.
-        auto hashes = getHashes(start, l-start);
-
-        const auto limit = (start >> depthHigher);
-        if (limit > level.size())
-            throw InternalError("limit > levelSize in extendTo");
-        level.erase(level.begin() + limit, level.end());
-        auto vec = getLevel(hashes);
-        level.reserve(level.size() + vec.size());
-        level.insert(level.end(), vec.begin(), vec.end());
-        length = l;
-        DebugM("Merkle cache extended to length ", length);
+    void Cache::initialize_nolock(unsigned l, const HashVec &knownRoots, HashVec &computed)
+    {
+        const unsigned nComplete = l >> SegmentDepth, nKnown = std::min(nComplete, unsigned(knownRoots.size()));
+        auto roots = std::make_shared<HashVec>();
+        roots->reserve(nComplete);
+        roots->insert(roots->end(), knownRoots.begin(), knownRoots.begin() + nKnown);
+        roots->insert(roots->end(), computed.begin(), computed.end());
+        std::atomic_store(&state, std::shared_ptr<const State>(new State{l, std::move(roots)}));
+        DebugM("Merkle cache initialized to length ", l, ", ", nKnown, " segment roots loaded, ", computed.size(),
+               " computed");
     }
 
-    HashVec Cache::levelFor(unsigned l) const
+    HashVec Cache::extendTo(unsigned l)
     {
         HashVec ret;
-        if (l == length) {
-            ret = level;
+        std::lock_guard g(writeLock);
+        const auto cur = std::atomic_load(&state);
+        if (!cur)
+            throw InternalError(QString("%1: Merkle cache is not initialized").arg(__func__));
+        if (l <= cur->length)
             return ret;
+        const unsigned nHave = unsigned(cur->roots->size()), nComplete = l >> SegmentDepth;
+        auto roots = cur->roots;
+        if (nComplete > nHave) {
+            // Note this may throw here if a reorg happened and not enough headers now exist.
+            ret = computeRoots(nHave, nComplete);
+            auto newRoots = std::make_shared<HashVec>();
+            newRoots->reserve(nComplete);
+            newRoots->insert(newRoots->end(), roots->begin(), roots->end());
+            newRoots->insert(newRoots->end(), ret.begin(), ret.end());
+            roots = std::move(newRoots);
         }
-        unsigned limit = l >> depthHigher;
-        if (limit >= level.size())
-            // should we throw do this instead?
-            //limit = unsigned(level.size());
-            throw InternalError("limit >= levelSize");
-        ret.reserve(limit);
-        ret.insert(ret.end(), level.begin(), level.begin() + limit);
-        const auto leafstart = leafStart(l);
-        const auto count = std::min(segmentLength(), l - leafstart);
-        const auto hashes = getHashes(leafstart, count);
-        const auto vec = getLevel(hashes);
-        ret.reserve(ret.size() + vec.size());
-        ret.insert(ret.end(), vec.begin(), vec.end());
+        std::atomic_store(&state, std::shared_ptr<const State>(new State{l, std::move(roots)}));
+        return ret;
+    }
+
+    HashVec Cache::levelFor(const State &st, unsigned l) const
+    {
+        HashVec ret;
+        const unsigned nComplete = l >> SegmentDepth, nKnown = std::min(nComplete, unsigned(st.roots->size()));
+        ret.reserve(nComplete + 1);
+        ret.insert(ret.end(), st.roots->begin(), st.roots->begin() + nKnown);
+        // Any complete segments we don't have yet (l > st.length can happen if we raced with extendTo), and the
+        // trailing partial segment, if any.
+        for (unsigned start = nKnown << SegmentDepth; start < l; start += segmentLength())
+            ret.emplace_back(root(getHashes(start, std::min(segmentLength(), l - start)), SegmentDepth));
         return ret;
     }
 
-    BranchAndRootPair Cache::branchAndRoot(unsigned length, unsigned index)
+    BranchAndRootPair Cache::branchAndRoot(unsigned length, unsigned index) const
     {
         if (!length)
             throw BadArgs(QString("%1: length must not be 0").arg(__func__));
         if (index >= length)
             throw BadArgs(QString("%1: index must be less than length").arg(__func__));
-        if (!initialized)
+        const auto st = std::atomic_load(&state); // no lock: the state we grab here is immutable
+        if (!st)
             throw InternalError(QString("%1: Merkle cache is not initialized").arg(__func__));
-        BranchAndRootPair ret;
-        ExclusiveLockGuard g(lock);
-        extendTo(length);
-        if (length > this->length) {
-            // ruh-roh.. what to do here?
-            throw InternalError(QString("%1: extendTo failed to extend length to %2").arg(__func__).arg(length));
-        }
-        auto ls = leafStart(index);
-        auto count = std::min(segmentLength(), length - ls);
-        auto leafHashes = getHashes(ls, count);
-        if (length < segmentLength()) {
-            ret = Merkle::branchAndRoot(leafHashes, index);
-            return ret;
-        }
-        auto level = levelFor(length);
-        ret = Merkle::branchAndRootFromLevel(level, leafHashes, index, depthHigher);
-        return ret;
+        const auto ls = leafStart(index);
+        const auto count = std::min(segmentLength(), length - ls);
+        // Note this may throw here if a reorg happened and not enough headers now exist. Caller will just send error
+        // to the client, which is what we want.
+        const auto leafHashes = getHashes(ls, count);
+        if (length < segmentLength())
+            return Merkle::branchAndRoot(leafHashes, index);
+        return Merkle::branchAndRootFromLevel(levelFor(*st, length), leafHashes, index, SegmentDepth);
     }
 
     void Cache::truncate(unsigned length)
     {
-        if (!initialized)
-            return;
         if (!length)
             throw BadArgs(QString("%1: length cannot be 0").arg(__func__));
-        ExclusiveLockGuard g(lock);
-        if (this->length <= length)
-            // we are already smaller than length, so it's fine.
+        std::lock_guard g(writeLock);
+        const auto cur = std::atomic_load(&state);
+        if (!cur || cur->length <= length)
+            // not initialized, or we are already smaller than length, so it's fine.
             return;
-        length = leafStart(length);
-        this->length = length;
-        auto limit = length >> depthHigher;
-        if (limit > level.size()) {
-            limit = unsigned(level.size());
-            Warning() << "limit > levelSize in merkle cache truncate. FIXME!";
-        }
-        level.erase(level.begin()+limit, level.end());
+        auto roots = cur->roots;
+        if (const unsigned nComplete = length >> SegmentDepth; nComplete < roots->size())
+            roots = std::make_shared<const HashVec>(roots->begin(), roots->begin() + nComplete);
+        std::atomic_store(&state, std::shared_ptr<const State>(new State{length, std::move(roots)}));
         DebugM("Merkle cache truncated to length ", length);
     }
 
@@ -23,9 +23,12 @@
 
 #include <QByteArray>
 
+#include <atomic>
 #include <cmath>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <optional>
-#include <shared_mutex>
 #include <utility>
 #include <vector>
 
@@ -86,51 +89,66 @@ namespace Merkle
     BranchAndRootPair branchAndRootFromLevel(const HashVec & level, const HashVec & leafHashes, unsigned index, unsigned depthHigher);
 
     /// EX work-alike merkle cache. We do it this way because pretty much the protocol demands this approach.
-    /// The public methods of this class are all thread-safe (except for the constructor).
+    ///
+    /// The leaf hashes are grouped into fixed-size segments of 2^SegmentDepth hashes, and the roots of all of the
+    /// *complete* segments are cached. Those never change unless the cache is truncated, so the caller may persist
+    /// them (see the return value of extendTo() and initialize()) and hand them back to initialize() on restart.
+    ///
+    /// The cached state is immutable once published, so branchAndRoot() takes no locks. The writers (initialize,
+    /// extendTo, truncate) are serialized by an internal mutex. The public methods of this class are all thread-safe
+    /// (except for the constructor).
     class Cache {
     public:
         using GetHashesFunc = std::function<HashVec(unsigned, unsigned, QString *)>;
 
+        static constexpr unsigned SegmentDepth = 10; ///< the level cached is this many levels above the leaves
+
         /// may throw BadArgs if !func
         Cache(const GetHashesFunc & func);
 
-        bool isInitialized() const { return initialized; }
+        bool isInitialized() const { return bool(std::atomic_load(&state)); }
+
+        /// Initialize the cache to length hashes (which may be 0). knownRoots, if not empty, are the already-known
+        /// roots of the first knownRoots.size() complete segments (as previously returned by this class); they are
+        /// taken as-is. Returns the roots of the rest of the complete segments, which were computed. May throw.
+        HashVec initialize(unsigned length, const HashVec &knownRoots = {});
+        /// Same as above, but using a set of hashes rather than calling the GetHashesFunc. May throw.
+        HashVec initialize(const HashVec &hashes, const HashVec &knownRoots = {});
 
-        /// initialize the cache to length hashes
-        void initialize(unsigned length); ///< takes exclusive lock, may throw
-        /// initialize the cache using a set of hashes
-        void initialize(const HashVec &hashes); ///< takes exclusive lock, may throw
+        /// Extend the cache to length hashes. Returns the roots of the segments that were completed as a result (if
+        /// any). No-op if length <= the current length. May throw.
+        HashVec extendTo(unsigned length);
 
-        BranchAndRootPair branchAndRoot(unsigned length, unsigned index); ///< takes exclusive lock, may throw
+        BranchAndRootPair branchAndRoot(unsigned length, unsigned index) const; ///< lock-free, may throw
 
         /// truncate the cache to at most length hashes
-        void truncate(unsigned length); ///< takes an exclusive lock, will throw BadArgs if length is 0.
+        void truncate(unsigned length); ///< will throw BadArgs if length is 0.
 
-        size_t size() const { SharedLockGuard g(lock); return level.size(); }
+        /// The number of complete segment roots in the cache
+        size_t size() const { const auto st = std::atomic_load(&state); return st ? st->roots->size() : 0; }
+        /// The number of hashes the cache covers
+        unsigned length() const { const auto st = std::atomic_load(&state); return st ? st->length : 0; }
 
     private:
-        using RWLock = std::shared_mutex;
-        using SharedLockGuard = std::shared_lock<RWLock>;
-        using ExclusiveLockGuard = std::lock_guard<RWLock>;
-
-        mutable RWLock lock;
+        struct State {
+            unsigned length = 0;
+            std::shared_ptr<const HashVec> roots; ///< the roots of the first length >> SegmentDepth segments
+        };
+        std::shared_ptr<const State> state; ///< accessed via std::atomic_load/std::atomic_store. null if not initialized.
+        std::mutex writeLock;
         const GetHashesFunc getHashesFunc;
-        unsigned length = 0, depthHigher = 0;
-        HashVec level;
-        std::atomic_bool initialized{false};
-
-        // takes no locks, may throw
-        void initialize_nolock(const HashVec &);
 
         // takes no locks, may throw
         HashVec getHashes(unsigned from, unsigned count) const;
 
-        HashVec getLevel(const HashVec &) const; ///< takes no locks, may throw on bad args
-        inline unsigned segmentLength() const { return 1 << depthHigher; }
-        inline unsigned leafStart(unsigned index) const { return (index >> depthHigher) << depthHigher; }
-        void extendTo(unsigned length); ///< takes no locks
-        HashVec levelFor(unsigned length) const; ///< takes no locks, may throw
-
+        static constexpr unsigned segmentLength() { return 1u << SegmentDepth; }
+        static constexpr unsigned leafStart(unsigned index) { return (index >> SegmentDepth) << SegmentDepth; }
+        /// Returns the roots of segments [fromSeg, toSeg), which must all be complete. Uses hashes if not null, else
+        /// the GetHashesFunc. Takes no locks, may throw.
+        HashVec computeRoots(unsigned fromSeg, unsigned toSeg, const HashVec *hashes = nullptr) const;
+        /// The level (segment roots, including that of the trailing partial segment) for a tree of length hashes.
+        HashVec levelFor(const State &, unsigned length) const; ///< takes no locks, may throw
+        void initialize_nolock(unsigned length, const HashVec &knownRoots, HashVec &computed);
     };
 
     // -- For Testing --
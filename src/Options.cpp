@@ -60,6 +60,10 @@ bool Options::isAddrInPerIPLimitExcludeSet(const QHostAddress &addr, Subnet *mat
     return false;
 }
 
+/* static */ const QStringList Options::DBOpts::tableNames = { "meta", "utxoset", "scripthash_history", "scripthash_unspent",
+                                                               "undo" };
+/* static */ const QStringList Options::DBOpts::legacyTableNames = { "blkinfo" };
+
 QVariantMap Options::toMap() const
 {
     QVariantMap m;
@@ -100,6 +104,7 @@ QVariantMap Options::toMap() const
     m["rpcpassword"] = rpcpassword.isNull() ? QVariant() : QVariant("<hidden>");
     m["datadir"] = datadir;
     m["checkdb"] = doSlowDbChecks;
+    m["checkdb_background"] = slowDbChecksInBackground;
     m["polltime"] = pollTimeSecs;
     m["donation"] = donationAddress;
     m["banner"] = bannerFile;
@@ -140,6 +145,17 @@ QVariantMap Options::toMap() const
     // db advanced options
     m["db_max_open_files"] = qlonglong(db.maxOpenFiles);
     m["db_keep_log_file_num"] = qlonglong(db.keepLogFileNum);
+    m["db_undo_depth"] = qlonglong(db.undoDepth);
+    m["db_headers_in_ram"] = db.headersInRam;
+    m["db_initial_sync_mode"] = db.initialSyncMode;
+    m["db_initial_sync_checkpoint"] = qlonglong(db.initialSyncCheckpointInterval);
+    m["db_compaction_rate_limit"] = qlonglong(db.compactionRateLimit);
+    for (auto it = db.tablePaths.cbegin(); it != db.tablePaths.cend(); ++it) {
+        QVariantList l;
+        for (const auto & tp : it.value())
+            l.push_back(tp.targetSize ? QString("%1:%2").arg(tp.dir).arg(tp.targetSize / 1e9) : tp.dir);
+        m["db_paths_" + it.key()] = l;
+    }
     // ts-format
     m["ts-format"] = logTimestampModeString();
     return m;
@@ -21,6 +21,7 @@
 #include <QMultiHash>
 #include <QHostAddress>
 #include <QList>
+#include <QMap>
 #include <QPair>
 #include <QSslCertificate>
 #include <QSslKey>
@@ -74,6 +75,9 @@ public:
     QString datadir; ///< The directory to store the database. It exists and has appropriate permissions (otherwise the app would have quit on startup).
     /// If true, on db open/startup, we will perform some slow/paranoid db consistency checks
     bool doSlowDbChecks = false;
+    /// If true (and doSlowDbChecks is true), the slow utxo set check runs in the background on the thread pool
+    /// against a read-only db snapshot, so that startup doesn't wait for it. Comes from config: checkdb_background.
+    bool slowDbChecksInBackground = false;
 
     static constexpr double minPollTimeSecs = 0.5, maxPollTimeSecs = 30., defaultPollTimeSecs = 2.;
     /// bitcoin poll time interval. This value will always be in the range [minPollTimeSecs, maxPollTimeSecs] aka [0.5, 30]
@@ -178,6 +182,8 @@ public:
     static constexpr bool isMaxSubsGloballySettingInBounds(int64_t m) { return m >= maxSubsGloballyMin && m <= maxSubsGloballyMax; }
 
     QString dumpScriptHashes;  ///< if specified, a file path to which to dump all scripthashes as JSON, corresponds to --dump-sh CLI arg
+    QString exportSnapshot; ///< if specified, a directory to which to export a db snapshot at startup, corresponds to --export-snapshot CLI arg
+    QString importSnapshot; ///< if specified, a snapshot directory to import into an empty datadir at startup, corresponds to --import-snapshot CLI arg
 
     struct DBOpts {
         static constexpr int defaultMaxOpenFiles = -1, maxOpenFilesMin = 20, maxOpenFilesMax = INT_MAX;
@@ -190,6 +196,56 @@ public:
         /// comes from config db_keep_log_file_num -- default is 5
         unsigned keepLogFileNum = defaultKeepLogFileNum;
         static constexpr bool isKeepLogFileNumInBounds(int64_t k) { return k >= int64_t(minKeepLogFileNum) && k <= int64_t(maxKeepLogFileNum); }
+
+        /// The minimum is BTC::MaxReorgDepth (10) -- we don't want to go below that. (We don't #include BTC.h here.)
+        static constexpr unsigned defaultUndoDepth = 100, minUndoDepth = 10, maxUndoDepth = 100'000;
+        /// comes from config db_undo_depth -- default is 100. The number of blocks from the tip for which we keep
+        /// undo (reorg rewind) information around in the undo db.
+        unsigned undoDepth = defaultUndoDepth;
+        static constexpr bool isUndoDepthInBounds(int64_t d) { return d >= int64_t(minUndoDepth) && d <= int64_t(maxUndoDepth); }
+
+        static constexpr bool defaultHeadersInRam = true;
+        /// comes from config db_headers_in_ram -- default is true. If true, all of the block headers are also kept in
+        /// a contiguous array in memory, which serves header requests (and the merkle cache) without any file I/O.
+        bool headersInRam = defaultHeadersInRam;
+
+        static constexpr bool defaultInitialSyncMode = true;
+        /// comes from config db_initial_sync_mode -- default is true. If true, while the node is more than undoDepth
+        /// blocks behind the tip, block data is written with the WAL off and with auto compactions paused, and a
+        /// checkpoint of the db's is taken every initialSyncCheckpointInterval blocks (see Storage::beginInitialSync).
+        bool initialSyncMode = defaultInitialSyncMode;
+
+        static constexpr unsigned defaultInitialSyncCheckpointInterval = 5000, minInitialSyncCheckpointInterval = 100,
+                                  maxInitialSyncCheckpointInterval = 1'000'000;
+        /// comes from config db_initial_sync_checkpoint -- default is 5000 blocks
+        unsigned initialSyncCheckpointInterval = defaultInitialSyncCheckpointInterval;
+        static constexpr bool isInitialSyncCheckpointIntervalInBounds(int64_t n) {
+            return n >= int64_t(minInitialSyncCheckpointInterval) && n <= int64_t(maxInitialSyncCheckpointInterval);
+        }
+
+        static constexpr unsigned defaultCompactionRateLimit = 100, minCompactionRateLimit = 1, maxCompactionRateLimit = 100'000;
+        /// comes from config db_compaction_rate_limit -- default is 100 (MB/sec), 0 means no limit. The base rate for
+        /// the RocksDB rate limiter shared by all of the db's, which throttles flush and compaction writes. It is raised
+        /// automatically (see Storage::monitorCompactions) while compactions fall behind or writes are stalled.
+        unsigned compactionRateLimit = defaultCompactionRateLimit;
+        static constexpr bool isCompactionRateLimitInBounds(int64_t r) {
+            return r == 0 || (r >= int64_t(minCompactionRateLimit) && r <= int64_t(maxCompactionRateLimit));
+        }
+
+        /// One of the directories a table's .sst files are placed in (see rocksdb::Options::db_paths). RocksDB fills
+        /// the paths in order, level by level, so earlier (smaller, hotter) levels go to the first path(s).
+        struct TablePath {
+            QString dir; ///< the table's files go in a subdirectory of this named after the table
+            uint64_t targetSize = 0; ///< in bytes. 0 for the last path, meaning unlimited.
+        };
+        /// The names of the tables (db's) whose placement may be configured
+        static const QStringList tableNames;
+        /// Tables that older versions kept, and which are migrated away at startup if present ("blkinfo"). Config
+        /// db_paths_<table> is still accepted for these so that the migration can find their files.
+        static const QStringList legacyTableNames;
+        /// comes from config db_paths_<table>, e.g. db_paths_utxoset. Tables not in this map live entirely in the
+        /// datadir (the default). Note the db's metadata (MANIFEST, WAL, etc) always stays in the datadir.
+        QMap<QString, QList<TablePath>> tablePaths;
     };
     DBOpts db;
 
@@ -145,6 +145,29 @@ std::vector<QByteArray> RecordFile::readRecords(uint64_t recNumStart, size_t cou
     return ret;
 }
 
+size_t RecordFile::readRecordsRaw(uint64_t recNumStart, size_t count, void *dest, QString *errStr) const
+{
+    std::shared_lock g(rwlock);
+    count = nrecs > recNumStart ? std::min(count, size_t(nrecs-recNumStart)) : 0;
+    if (!count) {
+        if (errStr) *errStr = "readRecordsRaw specification is out of range";
+        return 0;
+    }
+    QFile f(fileName());
+    if (!f.open(QIODevice::ReadOnly|QIODevice::ExistingOnly) || !f.seek(offsetOfRec(recNumStart))) {
+        if (errStr) *errStr = QString("Unable to open or seek in file %1 (error was: '%2')").arg(fileName()).arg(f.errorString());
+        return 0;
+    }
+    const qint64 nBytes = qint64(count * recsz), nRead = f.read(reinterpret_cast<char *>(dest), nBytes);
+    if (nRead != nBytes) {
+        if (errStr)
+            *errStr = QString("Unable to read %1 records from file %2 (error was: '%3')")
+                             .arg(count).arg(f.fileName()).arg(f.errorString());
+        return nRead > 0 ? size_t(nRead) / recsz : 0;
+    }
+    return count;
+}
+
 uint64_t RecordFile::truncate(uint64_t newNRecs, QString *errStr)
 {
     if (newNRecs >= nrecs) {
@@ -63,6 +63,11 @@ public:
     /// (and *errStr will contain the error message).
     std::vector<QByteArray> readRecords(uint64_t recNumStart, size_t count, QString *errStr = nullptr) const;
 
+    /// Thread-safe. Like the above but reads the records with a single read straight into `dest`, which must have
+    /// room for count * recordSize() bytes. Returns the number of records read. If it is less than `count`, either not
+    /// enough records exist in the file or an error occurred (and *errStr will contain the error message).
+    size_t readRecordsRaw(uint64_t recNumStart, size_t count, void *dest, QString *errStr = nullptr) const;
+
     /// Thread-safe.  Implicitly opens a private copy of the file and reads recNums from the file. Under non-error
     /// circumstances, the returned array will be of the same size as the recNums array, with corresponding indices
     /// containing the data obtained per recNum.  On error the returned array will be shorter than anticipated
@@ -38,5 +38,7 @@ namespace ServerMisc
     constexpr double kMaxSubsWarningsRateLimitSecs = 0.251;
     /// The rate limit for suppression of dupe per-IP "max subs" warnings to log.
     constexpr double kMaxSubsPerIPWarningsRateLimitSecs = 1.0;
+    /// The maximum number of scripthashes accepted by a single blockchain.scripthash.subscribe_many request.
+    constexpr int kMaxSubscribeManyItems = 5000;
 }
 
@@ -1138,22 +1138,40 @@ void Server::rpc_blockchain_block_headers(Client *c, const RPC::Message &m)
     }
     generic_do_async(c, m.id, [height, count, cp_height, this] {
         // EX doesn't seem to return error here if invalid height/no results, so we will do same.
-        const auto hdrs = storage->headersFromHeight(height, std::min(count, MAX_COUNT));
-        const size_t nHdrs = hdrs.size(), hdrSz = size_t(BTC::GetBlockHeaderSize()), hdrHexSz = hdrSz*2;
-        QByteArray hexHeaders(int(nHdrs * hdrHexSz), Qt::Uninitialized);
-        for (size_t i = 0, offset = 0; i < nHdrs; ++i, offset += hdrHexSz) {
-            const auto & hdr = hdrs[i];
-            if (UNLIKELY(hdr.size() != int(hdrSz))) { // ensure header looks the right size
+        const size_t hdrSz = size_t(BTC::GetBlockHeaderSize()), hdrHexSz = hdrSz*2;
+        QByteArray hexHeaders;
+        size_t nHdrs = 0;
+        if (storage->headersInRam()) {
+            // fast path: hex-encode straight out of the in-RAM header array in 1 go (no I/O, no intermediate copies)
+            const auto slice = storage->headersSliceFromHeight(height, std::min(count, MAX_COUNT));
+            nHdrs = slice.count();
+            if (UNLIKELY(nHdrs && slice.headerSize() != hdrSz)) {
                 // this should never happen.
-                Error() << "Header size from db height " << i + height << " is not " << hdrSz << " bytes! Database corruption likely! FIXME!";
+                Error() << "Header size in RAM is not " << hdrSz << " bytes! FIXME!";
                 throw RPCError("Server header store invalid", RPC::Code_InternalError);
             }
-            // fast, in-place conversion to hex
-            Util::ToHexFastInPlace(hdr, hexHeaders.data() + offset, hdrHexSz);
+            hexHeaders = QByteArray(int(nHdrs * hdrHexSz), Qt::Uninitialized);
+            if (nHdrs)
+                Util::ToHexFastInPlace(QByteArray::fromRawData(slice.data(), int(nHdrs * hdrSz)), hexHeaders.data(),
+                                       size_t(hexHeaders.size()));
+        } else {
+            const auto hdrs = storage->headersFromHeight(height, std::min(count, MAX_COUNT));
+            nHdrs = hdrs.size();
+            hexHeaders = QByteArray(int(nHdrs * hdrHexSz), Qt::Uninitialized);
+            for (size_t i = 0, offset = 0; i < nHdrs; ++i, offset += hdrHexSz) {
+                const auto & hdr = hdrs[i];
+                if (UNLIKELY(hdr.size() != int(hdrSz))) { // ensure header looks the right size
+                    // this should never happen.
+                    Error() << "Header size from db height " << i + height << " is not " << hdrSz << " bytes! Database corruption likely! FIXME!";
+                    throw RPCError("Server header store invalid", RPC::Code_InternalError);
+                }
+                // fast, in-place conversion to hex
+                Util::ToHexFastInPlace(hdr, hexHeaders.data() + offset, hdrHexSz);
+            }
         }
         QVariantMap resp{
             {"hex" , QString(hexHeaders)},  // we cast to QString to prevent null for empty string ""
-            {"count", unsigned(hdrs.size())},
+            {"count", unsigned(nHdrs)},
             {"max", MAX_COUNT}
         };
         if (count && cp_height) {
@@ -1386,31 +1404,19 @@ void Server::rpc_blockchain_address_subscribe(Client *c, const RPC::Message &m)
 void Server::impl_sh_subscribe(Client *c, const RPC::Message &m, const HashX &sh, const std::optional<QString> &optAlias)
 {
     const auto CheckSubsLimit = [c, &sh, this](int64_t nShSubs, bool doUnsub) {
-        if (UNLIKELY(nShSubs > options->maxSubsPerIP)) {
-            if (c->perIPData->isWhitelisted()) {
-                // White-listed, let it go, but print to debug log
-                DebugM( c->prettyName(false, false), " exceeded the per-IP subscribe limit with ", nShSubs,
-                        " subs, but it is whitelisted (subnet: ", c->perIPData->whiteListedSubnet().toString(), ")");
-            } else {
-                // Not white-listed .. unsubscribe and throw an error.
-                if (const auto now = Util::getTimeSecs(); now - c->lastWarnedAboutSubsLimit > ServerMisc::kMaxSubsPerIPWarningsRateLimitSecs /* 1.0 secs */) {
-                    // message spam throttled to once per second
-                    Warning() << c->prettyName(false, false) << " exceeded per-IP subscribe limit with " << nShSubs
-                              << " subs, denying subscribe request";
-                    c->lastWarnedAboutSubsLimit = now;
-                }
-                if (doUnsub) {
-                    // unsubscribe client right away
-                    if (LIKELY(storage->subs()->unsubscribe(c, sh))) {
-                        // decrement counters
-                        --c->nShSubs;
-                        --c->perIPData->nShSubs;
-                    } else
-                        // This should never happen but we'll print debug/warning info if it does.
-                        Warning() << c->prettyName(false, false) << " failed to unsubscribe client from a scripthash we just subscribed him to! FIXME!";
-                }
-                throw RPCError("Subscription limit reached", RPC::Code_App_LimitExceeded); // send error to client
+        if (UNLIKELY(isOverPerIPSubsLimit(c, nShSubs))) {
+            // Not white-listed .. unsubscribe and throw an error.
+            if (doUnsub) {
+                // unsubscribe client right away
+                if (LIKELY(storage->subs()->unsubscribe(c, sh))) {
+                    // decrement counters
+                    --c->nShSubs;
+                    --c->perIPData->nShSubs;
+                } else
+                    // This should never happen but we'll print debug/warning info if it does.
+                    Warning() << c->prettyName(false, false) << " failed to unsubscribe client from a scripthash we just subscribed him to! FIXME!";
             }
+            throw RPCError("Subscription limit reached", RPC::Code_App_LimitExceeded); // send error to client
         }
     };
     // First, check the Per-IP subs limit right away before we do anything. This has a potential race condition
@@ -1500,6 +1506,128 @@ void Server::impl_sh_subscribe(Client *c, const RPC::Message &m, const HashX &sh
         emit c->sendResult(m.id, result); ///<  may be 'null' if status was empty (indicates no history for scripthash)
     }
 }
+bool Server::isOverPerIPSubsLimit(Client *c, int64_t nShSubs)
+{
+    if (LIKELY(nShSubs <= options->maxSubsPerIP))
+        return false;
+    if (c->perIPData->isWhitelisted()) {
+        // White-listed, let it go, but print to debug log
+        DebugM( c->prettyName(false, false), " exceeded the per-IP subscribe limit with ", nShSubs,
+                " subs, but it is whitelisted (subnet: ", c->perIPData->whiteListedSubnet().toString(), ")");
+        return false;
+    }
+    if (const auto now = Util::getTimeSecs(); now - c->lastWarnedAboutSubsLimit > ServerMisc::kMaxSubsPerIPWarningsRateLimitSecs /* 1.0 secs */) {
+        // message spam throttled to once per second
+        Warning() << c->prettyName(false, false) << " exceeded per-IP subscribe limit with " << nShSubs
+                  << " subs, denying subscribe request";
+        c->lastWarnedAboutSubsLimit = now;
+    }
+    return true;
+}
+void Server::rpc_blockchain_scripthash_subscribe_many(Client *c, const RPC::Message &m)
+{
+    const QVariantList l = m.paramsList().front().toList();
+    if (l.isEmpty())
+        throw RPCError("Expected a non-empty list of scripthashes");
+    if (l.size() > ServerMisc::kMaxSubscribeManyItems)
+        throw RPCError(QString("Too many scripthashes; the maximum per request is %1").arg(ServerMisc::kMaxSubscribeManyItems));
+    std::vector<HashX> shs;
+    shs.reserve(size_t(l.size()));
+    for (const auto & var : l) {
+        shs.push_back(validateHashHex( var.toString() ));
+        if (shs.back().length() != HashLen)
+            throw RPCError("Invalid scripthash");
+    }
+    // Check the Per-IP subs limit right away, as impl_sh_subscribe does. The exact check is done below.
+    if (isOverPerIPSubsLimit(c, c->perIPData->nShSubs + 1))
+        throw RPCError("Subscription limit reached", RPC::Code_App_LimitExceeded);
+
+    // Notifications are sent exactly as for blockchain.scripthash.subscribe, so that clients need no special handling
+    const StatusCallback notifyCB = [c](const HashX &sh, const StatusHash &status) {
+        static const QString method("blockchain.scripthash.subscribe");
+        QVariant statusHexMaybeNull; // if empty we simply notify as 'null' (this is unlikely in practice but may happen on reorg)
+        if (!status.isEmpty())
+            statusHexMaybeNull = Util::ToHexFast(status);
+        emit c->sendNotification(method, QVariantList{Util::ToHexFast(sh), statusHexMaybeNull});
+    };
+    std::vector<SubsMgr::SubscribeResult> results;
+    try {
+        results = storage->subs()->subscribeMany(c, shs, notifyCB);
+    } catch (const SubsMgr::LimitReached &e) {
+        if (Util::getTimeSecs() - lastSubsWarningPrintTime > ServerMisc::kMaxSubsWarningsRateLimitSecs /* ~250 ms */) {
+            // rate limit printing
+            Warning() << "Exception from SubsMgr: " << e.what() << " (while serving subscribe_many request for " << c->prettyName(false, false) << ")";
+            lastSubsWarningPrintTime = Util::getTimeSecs();
+        }
+        emit globalSubsLimitReached(); // connected to the SrvMgr, which will loop through all IPs and kick all clients for the most-subscribed IP
+        throw RPCError("Subscription limit reached", RPC::Code_App_LimitExceeded); // send error to client
+    }
+    std::vector<HashX> newShs; // the scripthashes this client was not already subscribed to
+    for (size_t i = 0; i < shs.size(); ++i)
+        if (results[i].first)
+            newShs.push_back(shs[i]);
+    // Undoes the new subs when we end up replying with an error. Must be called in the client's thread.
+    const auto unsubscribeNew = [this, c](const std::vector<HashX> &newShs) {
+        for (const auto & sh : newShs)
+            if (storage->subs()->unsubscribe(c, sh)) {
+                --c->nShSubs;
+                --c->perIPData->nShSubs;
+            }
+    };
+    if (const int nNew = int(newShs.size()); nNew) {
+        if (c->nShSubs.fetch_add(nNew) == 0)
+            DebugM(c->prettyName(false, false), " is now subscribed to at least one scripthash");
+        if (isOverPerIPSubsLimit(c, c->perIPData->nShSubs += nNew)) {
+            // This catches races and requests that would take the IP over the limit: undo the new subs and throw.
+            unsubscribeNew(newShs);
+            throw RPCError("Subscription limit reached", RPC::Code_App_LimitExceeded); // send error to client
+        }
+    }
+    // Statuses: the cached ones are returned as-is, and the rest are computed together in the thread pool.
+    std::vector<std::optional<StatusHash>> statuses;
+    statuses.reserve(results.size());
+    bool anyMissing = false;
+    for (auto & [wasNew, optStatus] : results) {
+        anyMissing = anyMissing || !optStatus.has_value();
+        statuses.push_back(std::move(optStatus));
+    }
+    const auto ToResult = [](const std::vector<std::optional<StatusHash>> &statuses) {
+        QVariantList ret;
+        ret.reserve(int(statuses.size()));
+        for (const auto & status : statuses)
+            // `null` for no history, otherwise hex encoded bytes
+            ret.push_back(status->isEmpty() ? QVariant() : QVariant(QString(Util::ToHexFast(*status))));
+        return ret;
+    };
+    if (!anyMissing) {
+        emit c->sendResult(m.id, ToResult(statuses));
+        return;
+    }
+    generic_do_async(c, m.id, [shs=std::move(shs), statuses=std::move(statuses), newShs=std::move(newShs), ToResult,
+                               unsubscribeNew, c, this]() mutable {
+        std::vector<HashX> toCompute;
+        for (size_t i = 0; i < shs.size(); ++i)
+            if (!statuses[i].has_value())
+                toCompute.push_back(shs[i]);
+        std::vector<StatusHash> computed;
+        try {
+            computed = storage->subs()->getFullStatuses(toCompute);
+        } catch (const std::exception &) {
+            // The client gets an internal error, so don't leave it subscribed to the new scripthashes (as for the
+            // limit case above). This is done in the client's thread; it's a no-op if the client is gone by then.
+            Util::AsyncOnObject(c, [unsubscribeNew, newShs]{ unsubscribeNew(newShs); });
+            throw;
+        }
+        size_t k = 0;
+        for (size_t i = 0; i < shs.size(); ++i) {
+            if (!statuses[i].has_value()) {
+                storage->subs()->maybeCacheStatusResult(shs[i], computed[k]);
+                statuses[i] = computed[k++];
+            }
+        }
+        return QVariant(ToResult(statuses));
+    });
+}
 void Server::rpc_blockchain_scripthash_unsubscribe(Client *c, const RPC::Message &m)
 {
     const auto sh = parseFirstShParamCommon(m);
@@ -1530,12 +1658,13 @@ void Server::rpc_blockchain_transaction_broadcast(Client *c, const RPC::Message
     // no need to validate hex here -- bitcoind does validation for us!
     generic_async_to_bitcoind(c, m.id, "sendrawtransaction", QVariantList{ rawtxhex },
         // print to log, echo bitcoind's reply to client
-        [size=rawtxhex.length()/2, c, this](const RPC::Message & reply){
+        [size=rawtxhex.length()/2, c, this, rawtxhex](const RPC::Message & reply){
             QVariant ret = reply.result();
             ++c->info.nTxSent;
             c->info.nTxBytesSent += unsigned(size);
             emit broadcastTxSuccess(unsigned(size));
             Log() << "Broadcast tx for client " << c->id << ", size: " << size << " bytes, response: " << ret.toString();
+            addBroadcastTxToMempool(rawtxhex);
             static const Version FirstNonVulberableECVersion(3,3,4);
             if (const auto uaVersion = c->info.uaVersion(); uaVersion.isValid() && uaVersion < FirstNonVulberableECVersion) {
                 // The below is to warn old clients that they are vulnerable to a phishing attack.
@@ -1571,6 +1700,35 @@ void Server::rpc_blockchain_transaction_broadcast(Client *c, const RPC::Message
     );
     // <-- do nothing right now, return without replying. Will respond when daemon calls us back in callbacks above.
 }
+void Server::addBroadcastTxToMempool(const QByteArray &rawtxhex)
+{
+    // bitcoind accepted the tx, so rather than wait for the next SynchMempoolTask poll to pick it up, we add it to the
+    // mempool right away (in the ThreadPool) and notify the affected scripthashes.
+    ::AppThreadPool()->submitWork(this, [rawtxhex, storage=storage] {
+        const int expectedLen = rawtxhex.length() / 2;
+        const QByteArray rawtx = Util::ParseHexFast(rawtxhex);
+        if (rawtx.length() != expectedLen)
+            return; // shouldn't happen since bitcoind accepted it
+        Mempool::NewTxsMap txs;
+        std::unordered_set<HashX, HashHasher> scriptHashesAffected;
+        try {
+            auto ntx = Mempool::decodeNewTx(rawtx);
+            const TxHash hash = ntx.tx->hash;
+            txs.emplace(hash, std::move(ntx));
+            if (const auto res = storage->addMempoolTxs(txs, scriptHashesAffected); res.nAdded)
+                DebugM("Added broadcast tx ", Util::ToHexFast(hash), " to mempool, ", scriptHashesAffected.size(),
+                       Util::Pluralize(" address", scriptHashesAffected.size()), " affected");
+        } catch (const std::exception &e) {
+            // This is not an error: the tx may spend an output of a tx that isn't in our mempool yet, or it was
+            // mined in the meantime. The next mempool refresh will pick it up in that case.
+            DebugM("Could not add broadcast tx to mempool right away: ", e.what());
+            return;
+        }
+        if (!scriptHashesAffected.empty())
+            storage->subs()->enqueueNotifications(std::move(scriptHashesAffected));
+    });
+}
+
 void Server::rpc_blockchain_transaction_get(Client *c, const RPC::Message &m)
 {
     QVariantList l = m.paramsList();
@@ -1757,6 +1915,7 @@ HEY_COMPILER_PUT_STATIC_HERE(Server::StaticData::registry){
     { {"blockchain.scripthash.get_mempool", true,               false,    PR{1,1},                    },          MP(rpc_blockchain_scripthash_get_mempool) },
     { {"blockchain.scripthash.listunspent", true,               false,    PR{1,1},                    },          MP(rpc_blockchain_scripthash_listunspent) },
     { {"blockchain.scripthash.subscribe",   true,               false,    PR{1,1},                    },          MP(rpc_blockchain_scripthash_subscribe) },
+    { {"blockchain.scripthash.subscribe_many",true,             false,    PR{1,1},                    },          MP(rpc_blockchain_scripthash_subscribe_many) },
     { {"blockchain.scripthash.unsubscribe", true,               false,    PR{1,1},                    },          MP(rpc_blockchain_scripthash_unsubscribe) },
 
     { {"blockchain.transaction.broadcast",  true,               false,    PR{1,1},                    },          MP(rpc_blockchain_transaction_broadcast) },
@@ -2053,7 +2212,7 @@ void AdminServer::rpc_getinfo(Client *c, const RPC::Message &m)
         QVariantMap mp;
         auto [mempool, lock] = storage->mempool();
         mp["txs"] = qulonglong(mempool.txs.size());
-        mp["addresses"] = qulonglong(mempool.hashXTxs.size());
+        mp["addresses"] = qulonglong(mempool.numHashXs());
         std::size_t sizeTotal = 0;
         std::int64_t feeTotal = 0;
         std::for_each(mempool.txs.begin(), mempool.txs.end(), [&sizeTotal, &feeTotal](const auto &pair){
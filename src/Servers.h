@@ -372,6 +372,8 @@ private:
     void rpc_blockchain_scripthash_listunspent(Client *, const RPC::Message &); // fully implemented
     void rpc_blockchain_scripthash_subscribe(Client *, const RPC::Message &); // fully implemented
     void rpc_blockchain_scripthash_unsubscribe(Client *, const RPC::Message &); // fully implemented
+    /// Fulcrum extension: subscribes to a list of scripthashes at once, returning the list of their statuses.
+    void rpc_blockchain_scripthash_subscribe_many(Client *, const RPC::Message &);
     // transaction
     void rpc_blockchain_transaction_broadcast(Client *, const RPC::Message &); // fully implemented
     void rpc_blockchain_transaction_get(Client *, const RPC::Message &); // fully implemented
@@ -389,6 +391,12 @@ private:
     void impl_sh_subscribe(Client *, const RPC::Message &, const HashX &scriptHash,
                            const std::optional<QString> & aliasUsedForNotifications = {});
     void impl_sh_unsubscribe(Client *, const RPC::Message &, const HashX &scriptHash);
+    /// Returns true if a client's IP having `nShSubs` subscriptions is over the per-IP limit (and it's not whitelisted).
+    /// Rate-limited warnings are printed to the log.
+    bool isOverPerIPSubsLimit(Client *c, int64_t nShSubs);
+    /// Called after a successful blockchain.transaction.broadcast. Asynchronously adds the tx to the mempool (see
+    /// Storage::addMempoolTxs) and enqueues notifications for the scripthashes it touches.
+    void addBroadcastTxToMempool(const QByteArray &rawtxhex);
     /// Commonly used by above methods.  Takes the first address argument in the m.paramsList() and converts it to
     /// a scripthash, returning the raw bytes.  Will throw RPCError on invalid argument.
     /// It is assumed the caller already ensured m.paramsList() has at least 1 item in it (which the RPC machinery
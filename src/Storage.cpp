@@ -16,6 +16,7 @@
 // along with this program (see LICENSE.txt).  If not, see
 // <https://www.gnu.org/licenses/>.
 //
+#include "App.h"
 #include "BTC.h"
 #include "CostCache.h"
 #include "Mempool.h"
@@ -23,28 +24,40 @@
 #include "RecordFile.h"
 #include "Storage.h"
 #include "SubsMgr.h"
+#include "ThreadPool.h"
 
 #include <rocksdb/db.h>
 #include <rocksdb/iterator.h>
 #include <rocksdb/merge_operator.h>
 #include <rocksdb/options.h>
+#include <rocksdb/rate_limiter.h>
 #include <rocksdb/slice.h>
+#include <rocksdb/statistics.h>
 #include <rocksdb/table.h>
+#include <rocksdb/utilities/checkpoint.h>
 
 #include <QByteArray>
+#include <QCryptographicHash>
 #include <QDir>
 #include <QFileInfo>
+#include <QStorageInfo>
+#include <QTimer>
 #include <QVector> // we use this for the Height2Hash cache to save on memcopies since it's implicitly shared.
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <cstring> // for memcpy
+#include <deque>
+#include <limits>
 #include <list>
+#include <memory>
 #include <optional>
 #include <shared_mutex>
 #include <string>
 #include <tuple>
 #include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -59,7 +72,10 @@ HistoryTooLarge::~HistoryTooLarge() {} // weak vtable warning suppression
 namespace {
     /// Encapsulates the 'meta' db table
     struct Meta {
-        uint32_t magic = 0xf33db33f, version = 0x1;
+        /// Bump kCurrentVersion whenever the on-disk format changes. Versions in the range
+        /// [kMinUpgradeableVersion, kCurrentVersion) are upgraded in-place on startup (see Storage::upgradeDB).
+        static constexpr uint32_t kCurrentVersion = 0x3, kMinUpgradeableVersion = 0x1;
+        uint32_t magic = 0xf33db33f, version = kCurrentVersion;
         QString chain; ///< "test", "main", etc
         uint16_t platformBits = sizeof(long)*8U; ///< we save the platform wordsize to the db
     };
@@ -67,6 +83,7 @@ namespace {
     // some database keys we use -- todo: if this grows large, move it elsewhere
     static const bool falseMem = false, trueMem = true;
     static const rocksdb::Slice kMeta{"meta"}, kDirty{"dirty"}, kUtxoCount{"utxo_count"},
+                                kSnapshotUnverified{"snapshot_unverified"},
                                 kTrue(reinterpret_cast<const char *>(&trueMem), sizeof(trueMem)),
                                 kFalse(reinterpret_cast<const char *>(&falseMem), sizeof(trueMem));
 
@@ -151,6 +168,38 @@ namespace {
         return ret;
     }
 
+    /// Unsigned LEB128-style varints, used by the compact history and undo encodings. Each byte carries 7 bits of
+    /// payload, least significant group first, with the high bit set on every byte except the last.
+    constexpr size_t kMaxVarIntSize = 10; ///< ceil(64 / 7)
+    /// Writes v to buf (which must have room for at least kMaxVarIntSize bytes). Returns the number of bytes written.
+    inline size_t EncodeVarInt(char *buf, uint64_t v) {
+        size_t n = 0;
+        while (v >= 0x80) {
+            buf[n++] = char(uint8_t(v) | 0x80);
+            v >>= 7;
+        }
+        buf[n++] = char(uint8_t(v));
+        return n;
+    }
+    inline void AppendVarInt(QByteArray &ba, uint64_t v) {
+        char buf[kMaxVarIntSize];
+        ba.append(buf, int(EncodeVarInt(buf, v)));
+    }
+    /// Reads a varint from [cur, end), advancing cur past it. Returns false if the buffer ended before the varint
+    /// did, or if the varint is longer than kMaxVarIntSize bytes.
+    inline bool ReadVarInt(const char * &cur, const char *end, uint64_t &out) {
+        uint64_t ret = 0;
+        for (unsigned shift = 0; cur < end && shift < 64; shift += 7) {
+            const auto b = uint8_t(*cur++);
+            ret |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                out = ret;
+                return true;
+            }
+        }
+        return false;
+    }
+
     // specializations
     template <> QByteArray Serialize(const Meta &);
     template <> Meta Deserialize(const QByteArray &, bool *);
@@ -162,10 +211,17 @@ namespace {
     template <> bitcoin::Amount Deserialize(const QByteArray &, bool *);
     // TxNumVec
     using TxNumVec = std::vector<TxNum>;
-    // this serializes a vector of TxNums to a compact representation (6 bytes, eg 48 bits per TxNum), in little endian byte order
+    /// Size of the trailer at the end of a serialized TxNumVec: the last (absolute) TxNum as a 6-byte little endian int.
+    constexpr size_t kTxNumVecTrailerSize = CompactTXO::compactTxNumSize();
+    // this serializes an ascending vector of TxNums to a compact representation: the first TxNum as a varint, followed
+    // by the delta from the previous TxNum as a varint for each subsequent TxNum, followed by a 6-byte trailer of the
+    // last TxNum (so that ConcatOperator can append to it in constant time). Returns an empty QByteArray for an
+    // empty vector or if the vector is not sorted.
     template <> QByteArray Serialize(const TxNumVec &);
-    // this deserializes a vector of TxNums from a compact representation (6 bytes, eg 48 bits per TxNum), assuming little endian byte order
+    // this deserializes a vector of TxNums from the compact delta-varint representation described above
     template <> TxNumVec Deserialize(const QByteArray &, bool *);
+    // deserializes the legacy (db version 1) representation: 6 bytes (48 bits) per TxNum, little endian byte order
+    TxNumVec DeserializeTxNumVecV1(const QByteArray &, bool *);
 
     // CompactTXO -- not currently used since we prefer toBytes() directly (TODO: remove if we end up never using this)
     template <> QByteArray Serialize(const CompactTXO &);
@@ -203,6 +259,46 @@ namespace {
     /// Helper to just get the status error string as a QString
     QString StatusString(const rocksdb::Status & status) { return QString::fromStdString(status.ToString()); }
 
+    /// The initial sync checkpoint lives in this directory in the datadir. It holds a (hard-linked) checkpoint of
+    /// each db plus a manifest with the RecordFile counts. While a new checkpoint is being made it is "<name>.tmp".
+    const QString kInitialSyncCheckpointName = "initial_sync_checkpoint";
+
+    /// Sum of "rocksdb.total-sst-files-size" for `dbs`
+    template <typename DBs>
+    uint64_t TotalSstBytes(const DBs &dbs) {
+        uint64_t total = 0;
+        for (auto *db : dbs)
+            if (uint64_t val; db && db->GetIntProperty(rocksdb::DB::Properties::kTotalSstFilesSize, &val))
+                total += val;
+        return total;
+    }
+
+    /// Called at startup if an initial sync checkpoint was restored. The RecordFiles are append-only and so are not
+    /// part of the checkpoint; instead they are truncated back to the record count saved in its manifest.
+    void TruncateToCheckpoint(RecordFile &rf, uint64_t n) {
+        if (rf.numRecords() < n)
+            throw DatabaseFormatError(QString("%1 has %2 records but the initial sync checkpoint expects %3. Please"
+                                              " delete the datadir and resynch.").arg(rf.fileName()).arg(rf.numRecords()).arg(n));
+        if (QString err; rf.numRecords() > n && (rf.truncate(n, &err) != n || !err.isEmpty()))
+            throw DatabaseError(QString("Failed to truncate %1 to the initial sync checkpoint: %2").arg(rf.fileName(), err));
+    }
+
+    /// Keys in the undo db are block heights serialized big-endian (as of db version 3), so that the db's bytewise
+    /// key order is also height order. This allows us to prune expired undo infos with a single DeleteRange.
+    QByteArray UndoKey(uint32_t height) {
+        const char bytes[sizeof(height)] = { char(height >> 24), char(height >> 16), char(height >> 8), char(height) };
+        return QByteArray(bytes, int(sizeof(bytes)));
+    }
+    /// The inverse of the above. Returns an empty optional if `key` is not of the expected size.
+    std::optional<uint32_t> UndoKeyToHeight(const rocksdb::Slice &key) {
+        std::optional<uint32_t> ret;
+        if (key.size() != sizeof(uint32_t))
+            return ret;
+        const auto *b = reinterpret_cast<const uint8_t *>(key.data());
+        ret = uint32_t(b[0]) << 24 | uint32_t(b[1]) << 16 | uint32_t(b[2]) << 8 | uint32_t(b[3]);
+        return ret;
+    }
+
     /// DB read/write helpers
     /// NOTE: these may throw DatabaseError
     /// If missingOk=false, then the returned optional is guaranteed to have a value if this function returns without throwing.
@@ -339,8 +435,8 @@ namespace {
                                 .arg(StatusString(st)));
     }
 
-    //// A helper data struct -- written to the blkinfo table. This helps localize a txnum to a specific position in
-    /// a block.  The table is keyed off of block_height(uint32_t) -> serialized BlkInfo (raw bytes)
+    //// A helper data struct -- written to the blkinfos file. This helps localize a txnum to a specific position in
+    /// a block.  The file has one record per block height, each being a serialized BlkInfo (raw bytes)
     struct BlkInfo {
         TxNum txNum0 = 0;
         unsigned nTx = 0;
@@ -374,14 +470,54 @@ namespace {
         std::vector<UTXOAddUndo> addUndos;
         std::vector<UTXODelUndo> delUndos;
 
+        /// The serialized form does not store the TXO prevoutHash for either of the above two arrays, since it can be
+        /// recovered from the txNum2txHash file via the txNum (which is stored). If this is true, the TXO's in
+        /// addUndos and delUndos have an empty prevoutHash and ResolveUndoTxHashes() must be called before use.
+        bool txHashesMissing = false;
+
         [[maybe_unused]] QString toDebugString() const;
 
         [[maybe_unused]] bool operator==(const UndoInfo &) const; // for debug ser/deser
 
         bool isValid() const { return hash.size() == HashLen; } ///< cheap, imperfect check for validity
-        void clear() { height = 0; hash.clear(); blkInfo = BlkInfo(); scriptHashes.clear(); addUndos.clear(); delUndos.clear(); }
+        void clear() { height = 0; hash.clear(); blkInfo = BlkInfo(); scriptHashes.clear(); addUndos.clear(); delUndos.clear(); txHashesMissing = false; }
     };
 
+    /// Fills in the TXO prevoutHash for all the addUndos and delUndos of `u` by reading them from the txNum2txHash
+    /// file (a no-op if !u.txHashesMissing). Call this before truncating txNumsFile. Throws on error.
+    void ResolveUndoTxHashes(UndoInfo &u, const RecordFile &txNumsFile) {
+        if (!u.txHashesMissing)
+            return;
+        QString err;
+        if (!u.addUndos.empty()) {
+            // all of the additions are in this block, so read the block's txhashes in one sequential read
+            const auto hashes = txNumsFile.readRecords(u.blkInfo.txNum0, u.blkInfo.nTx, &err);
+            if (hashes.size() != u.blkInfo.nTx)
+                throw DatabaseError(QString("Failed to read the txhashes for block %1 from the txNum2txHash file: %2")
+                                    .arg(u.height).arg(err));
+            for (auto & [txo, hashX, ctxo] : u.addUndos) {
+                const auto idx = ctxo.txNum() - u.blkInfo.txNum0;
+                if (UNLIKELY(ctxo.txNum() < u.blkInfo.txNum0 || idx >= hashes.size()))
+                    throw DatabaseFormatError(QString("Undo info for block %1 references txNum %2 which is outside the block")
+                                              .arg(u.height).arg(ctxo.txNum()));
+                txo.prevoutHash = hashes[idx];
+            }
+        }
+        if (!u.delUndos.empty()) {
+            std::vector<uint64_t> txNums;
+            txNums.reserve(u.delUndos.size());
+            for (const auto & [txo, info] : u.delUndos)
+                txNums.push_back(info.txNum);
+            const auto hashes = txNumsFile.readRandomRecords(txNums, &err);
+            if (hashes.size() != txNums.size())
+                throw DatabaseError(QString("Failed to read the spent txo txhashes for block %1 from the txNum2txHash file: %2")
+                                    .arg(u.height).arg(err));
+            for (size_t i = 0; i < hashes.size(); ++i)
+                std::get<0>(u.delUndos[i]).prevoutHash = hashes[i];
+        }
+        u.txHashesMissing = false;
+    }
+
     QString UndoInfo::toDebugString() const {
         QString ret;
         QTextStream ts(&ret);
@@ -402,7 +538,9 @@ namespace {
     template <> UndoInfo Deserialize(const QByteArray &, bool *);
 
 
-    /// Associative merge operator used for scripthash history concatenation
+    /// Associative merge operator used for scripthash history concatenation.  Both operands are serialized TxNumVecs
+    /// (delta-varint encoded, see Serialize(const TxNumVec &)).  Appending re-bases the first varint of the new value
+    /// against the existing value's trailer (its last TxNum), so it runs in constant time plus the copy.
     /// TODO: this needs to be made more efficient by implementing the real MergeOperator interface and combining
     /// appends efficiently to reduce allocations.  Right now it's called for each append.
     class ConcatOperator : public rocksdb::AssociativeMergeOperator {
@@ -411,6 +549,11 @@ namespace {
 
         mutable std::atomic<unsigned> merges = 0;
 
+        /// If true, operands are in the legacy (db version 1) fixed 6-byte format and are simply concatenated. Set
+        /// by Storage::loadCheckMeta() before the scripthash_history db is opened, and cleared once upgradeDB() has
+        /// rewritten every value in the current format.
+        std::atomic_bool legacyFixedWidth = false;
+
         // Gives the client a way to express the read -> modify -> write semantics
         // key:           (IN) The key that's associated with this merge operation.
         // existing_value:(IN) null indicates the key does not exist before this op
@@ -437,13 +580,31 @@ namespace {
     {
         (void)key; (void)logger;
         ++merges;
-        new_value->resize( (existing_value ? existing_value->size() : 0) + value.size() );
-        char *cur = new_value->data();
-        if (existing_value) {
-            std::memcpy(cur, existing_value->data(), existing_value->size());
-            cur += existing_value->size();
+        if (legacyFixedWidth || !existing_value || existing_value->empty() || value.empty()) {
+            new_value->resize( (existing_value ? existing_value->size() : 0) + value.size() );
+            char *cur = new_value->data();
+            if (existing_value) {
+                std::memcpy(cur, existing_value->data(), existing_value->size());
+                cur += existing_value->size();
+            }
+            std::memcpy(cur, value.data(), value.size());
+            return true;
         }
-        std::memcpy(cur, value.data(), value.size());
+        if (UNLIKELY(existing_value->size() <= kTxNumVecTrailerSize || value.size() <= kTxNumVecTrailerSize))
+            return false; // corrupt data
+        const size_t existingBodySize = existing_value->size() - kTxNumVecTrailerSize;
+        const TxNum last = CompactTXO::txNumFromCompactBytes(reinterpret_cast<const uint8_t *>(existing_value->data() + existingBodySize));
+        const char *vcur = value.data(), *const vend = value.data() + value.size();
+        uint64_t first;
+        if (UNLIKELY(!ReadVarInt(vcur, vend - kTxNumVecTrailerSize, first) || first < last))
+            return false; // corrupt data or out-of-order append
+        char buf[kMaxVarIntSize];
+        const size_t bufLen = EncodeVarInt(buf, first - last);
+        // existing body (sans trailer) + re-based first delta + rest of value (including its trailer, which is now the last TxNum)
+        new_value->reserve(existingBodySize + bufLen + size_t(vend - vcur));
+        new_value->append(existing_value->data(), existingBodySize);
+        new_value->append(buf, bufLen);
+        new_value->append(vcur, size_t(vend - vcur));
         return true;
     }
 
@@ -464,23 +625,45 @@ struct Storage::Pvt
     struct RocksDBs {
         const rocksdb::ReadOptions defReadOpts; ///< avoid creating this each time
         const rocksdb::WriteOptions defWriteOpts; ///< avoid creating this each time
+        /// Used by addBlock for the block data tables (utxoset, scripthash_unspent, scripthash_history).
+        /// Same as defWriteOpts, except that the WAL is disabled while in initial sync mode. Guarded by blocksLock.
+        rocksdb::WriteOptions blockWriteOpts;
 
         rocksdb::Options opts, shistOpts;
 
         std::shared_ptr<ConcatOperator> concatOperator;
+        /// Shared by all of the db's. Null if db_compaction_rate_limit = 0.
+        std::shared_ptr<rocksdb::RateLimiter> rateLimiter;
+        /// One per db (so that e.g. read latency can be told apart per table). Filled in as the db's are opened.
+        std::unordered_map<const rocksdb::DB *, std::shared_ptr<rocksdb::Statistics>> statistics;
 
-        std::unique_ptr<rocksdb::DB> meta, blkinfo, utxoset,
+        std::unique_ptr<rocksdb::DB> meta, utxoset,
                                      shist, shunspent, // scripthash_history and scripthash_unspent
                                      undo; // undo (reorg rewind)
+
+        /// All 5 db's, in the order they are opened
+        std::array<rocksdb::DB *, 5> all() const { return { meta.get(), utxoset.get(), shist.get(), shunspent.get(), undo.get() }; }
+        /// The db's addBlock writes to via blockWriteOpts
+        std::array<rocksdb::DB *, 3> blockData() const { return { utxoset.get(), shist.get(), shunspent.get() }; }
     } db;
 
     std::unique_ptr<RecordFile> txNumsFile;
     std::unique_ptr<RecordFile> headersFile;
-
-    /// Big lock used for block/history updates. Public methods that read the history such as getHistory and listUnspent
-    /// take this as read-only (shared), and addBlock and undoLatestBlock take this as read/write (exclusively).
-    /// This is intended to be a coarse lock.  Currently the update code takes this along with headerVerifierLock and
-    /// blkInfoLock at the same time, so it's (as of now) equivalent to either of those two locks.
+    /// One BlkInfo per block height. Replaces the blkinfo db of older versions (see migrateLegacyBlkInfoDB).
+    std::unique_ptr<RecordFile> blkInfosFile;
+    /// The roots of the complete segments of the header merkle cache (see Merkle::Cache), one per record, so that the
+    /// cache needn't be rebuilt on startup. Kept in sync with the cache by appendHeader and deleteHeadersPastHeight.
+    std::unique_ptr<RecordFile> merkleRootsFile;
+
+    /// Taken exclusively by undoLatestBlocks for the duration of a rewind, and shared by the query paths reading
+    /// through a ReadView. A rewind truncates the RecordFiles (which are not covered by the RocksDB snapshots in a
+    /// ReadView), so a stale view cannot be used across it. addBlock only appends, so it doesn't take this lock.
+    mutable RWLock rewindLock;
+
+    /// Big lock used for block/history updates. addBlock and undoLatestBlock take this as read/write (exclusively).
+    /// The query paths such as getHistory and listUnspent do not take it; they read from the published ReadView
+    /// (see below) instead. This is intended to be a coarse lock.  Currently the update code takes this along with
+    /// headerVerifierLock and blkInfoLock at the same time, so it's (as of now) equivalent to either of those two locks.
     /// TODO: See about removing all the other locks and keeping one general RWLock for all updates?
     mutable RWLock blocksLock;
 
@@ -490,13 +673,241 @@ struct Storage::Pvt
     std::atomic<TxNum> txNumNext{0};
 
     std::vector<BlkInfo> blkInfos;
-    std::map<TxNum, unsigned> blkInfosByTxNum; ///< ordered map of TxNum0 for a block -> index into above blkInfo array
-    RWLock blkInfoLock; ///< locks blkInfos and blkInfosByTxNum
+    RWLock blkInfoLock; ///< locks blkInfos (but not txNum0Index below, which is read lock-free)
+
+    /// Flat, sorted array of the first TxNum of each block (index == height), used by heightForTxNum() to do a
+    /// lock-free binary search. Views are immutable once published and are swapped in RCU-style (via std::atomic_store)
+    /// by the writers, who always hold blkInfoLock exclusively, so there is only ever 1 writer at a time. Successive
+    /// views share the same Buffer: addBlock appends into a slot past the end of the currently-published view and then
+    /// publishes a new view with size + 1, so readers never see a slot being written. Anything that shrinks the array
+    /// (undoLatestBlocks) builds a fresh Buffer, since slots in the old one may still be visible to readers.
+    struct TxNum0Index {
+        struct Buffer {
+            std::unique_ptr<TxNum[]> data;
+            size_t capacity = 0;
+        };
+        std::shared_ptr<Buffer> buf;
+        size_t size = 0; ///< number of blocks in this view
+        TxNum txNumEnd = 0; ///< one past the last TxNum of the last block in this view
+
+        /// Returns the BlkInfo for a height, if it is in this view
+        std::optional<BlkInfo> blkInfo(BlockHeight height) const {
+            std::optional<BlkInfo> ret;
+            if (height < size) {
+                const TxNum txNum0 = buf->data[height], next = height + 1 < size ? buf->data[height + 1] : txNumEnd;
+                ret.emplace(txNum0, unsigned(next - txNum0));
+            }
+            return ret;
+        }
+        /// Returns the height of the block containing TxNum n, if it is in this view
+        std::optional<unsigned> heightForTxNum(TxNum n) const {
+            std::optional<unsigned> ret;
+            if (size && n < txNumEnd) {
+                const TxNum * const base = buf->data.get();
+                const TxNum *first = base;
+                // Branchless binary search for the last txNum0 <= n (the ternary compiles to a cmov). Since the blocks
+                // are contiguous and n < txNumEnd, that block is the one containing n.
+                for (size_t len = size; len > 1; ) {
+                    const size_t half = len / 2;
+                    first += first[half] <= n ? half : 0;
+                    len -= half;
+                }
+                if (*first <= n)
+                    ret = unsigned(first - base);
+            }
+            return ret;
+        }
+    };
+    std::shared_ptr<const TxNum0Index> txNum0Index = std::make_shared<const TxNum0Index>();
+
+    /// Call with blkInfoLock held exclusively. Publishes a new txNum0Index with the block appended.
+    void txNum0IndexAppend(TxNum txNum0, unsigned nTx) {
+        auto next = std::make_shared<TxNum0Index>(*std::atomic_load(&txNum0Index));
+        if (!next->buf || next->size >= next->buf->capacity)
+            next->buf = newTxNum0Buffer(next->buf ? next->buf->data.get() : nullptr, next->size);
+        next->buf->data[next->size++] = txNum0;
+        next->txNumEnd = txNum0 + nTx;
+        std::atomic_store(&txNum0Index, std::shared_ptr<const TxNum0Index>(std::move(next)));
+    }
+    /// Call with blkInfoLock held exclusively (or before any readers exist). Publishes a new txNum0Index built from
+    /// scratch from blkInfos.
+    void txNum0IndexRebuild() {
+        auto next = std::make_shared<TxNum0Index>();
+        next->buf = newTxNum0Buffer(nullptr, 0, blkInfos.size());
+        for (const auto & bi : blkInfos) {
+            next->buf->data[next->size++] = bi.txNum0;
+            next->txNumEnd = bi.txNum0 + bi.nTx;
+        }
+        std::atomic_store(&txNum0Index, std::shared_ptr<const TxNum0Index>(std::move(next)));
+    }
+    /// Returns a new Buffer with room for at least minCap + 1 entries (grown ~1.5x), with the first n entries of
+    /// old copied in.
+    static std::shared_ptr<TxNum0Index::Buffer> newTxNum0Buffer(const TxNum *old, size_t n, size_t minCap = 0) {
+        auto ret = std::make_shared<TxNum0Index::Buffer>();
+        ret->capacity = std::max(minCap, n) + std::max(n, minCap) / 2 + 1024;
+        ret->data = std::make_unique<TxNum[]>(ret->capacity);
+        if (old && n) std::copy(old, old + n, ret->data.get());
+        return ret;
+    }
+
+    /// All of the raw block headers, back to back in 1 contiguous array, if config db_headers_in_ram is enabled (null
+    /// otherwise). Kept in sync with the headers RecordFile by appendHeader and deleteHeadersPastHeight, and published
+    /// the same way as txNum0Index above: appends go into spare capacity past the end of the current view, and a
+    /// truncation builds a new Buffer, so any view (or HeadersSlice) a reader holds never changes underneath it.
+    struct HeaderArray {
+        struct Buffer {
+            std::unique_ptr<char[]> data;
+            size_t capacity = 0; ///< in headers
+        };
+        std::shared_ptr<Buffer> buf;
+        size_t count = 0; ///< number of headers in this view
+        size_t hdrSize = 0;
+
+        const char *header(size_t height) const { return buf->data.get() + height * hdrSize; }
+    };
+    std::shared_ptr<const HeaderArray> headerArray;
+
+    /// Call with headerVerifierLock held exclusively (or from startup). Publishes a new headerArray with the first
+    /// `keep` headers of the current one followed by `hdrs` (a truncation if hdrs is empty). No-op if disabled.
+    void headerArrayUpdate(size_t keep, const std::vector<QByteArray> &hdrs) {
+        const auto cur = std::atomic_load(&headerArray);
+        if (!cur) return;
+        auto next = std::make_shared<HeaderArray>(*cur);
+        keep = std::min(keep, cur->count);
+        const size_t newCount = keep + hdrs.size();
+        if (keep < cur->count || !next->buf || newCount > next->buf->capacity) {
+            // shrinking or growing: copy into a fresh buffer since readers may still be looking at the current one
+            auto nb = std::make_shared<HeaderArray::Buffer>();
+            nb->capacity = newCount + newCount / 2 + 1024;
+            nb->data = std::make_unique<char[]>(nb->capacity * next->hdrSize);
+            if (keep) std::memcpy(nb->data.get(), cur->buf->data.get(), keep * next->hdrSize);
+            next->buf = std::move(nb);
+        }
+        char *out = next->buf->data.get() + keep * next->hdrSize;
+        for (const auto & h : hdrs) {
+            if (UNLIKELY(size_t(h.size()) != next->hdrSize))
+                throw InternalError(QString("headerArrayUpdate: bad header size %1").arg(h.size()));
+            std::memcpy(out, h.constData(), next->hdrSize);
+            out += next->hdrSize;
+        }
+        next->count = newCount;
+        std::atomic_store(&headerArray, std::shared_ptr<const HeaderArray>(std::move(next)));
+    }
+
+    /// An immutable view of the committed state as of the end of the last addBlock or undoLatestBlocks: a RocksDB
+    /// snapshot of each of the tables the query paths read, plus the in-memory state that goes with it. Published
+    /// (via std::atomic_store) by publishReadView() at the end of each commit. Readers grab the current one and read
+    /// through it without taking blocksLock, so a block being committed never stalls them. The headers and txnums
+    /// RecordFiles are only ever appended to by addBlock, so reads from them past the end of a view are never needed,
+    /// and rewinds (which truncate them) are excluded via rewindLock.
+    struct ReadView {
+        /// A RocksDB snapshot of a db (released when the last view referencing it goes away), and ReadOptions that
+        /// read from it.
+        struct Snap {
+            std::shared_ptr<const rocksdb::Snapshot> snapshot;
+            rocksdb::ReadOptions readOpts;
+            Snap() = default;
+            Snap(rocksdb::DB *db, const rocksdb::ReadOptions &defOpts)
+                : snapshot(db->GetSnapshot(), [db](const rocksdb::Snapshot *s){ db->ReleaseSnapshot(s); }),
+                  readOpts(defOpts) { readOpts.snapshot = snapshot.get(); }
+        };
+        Snap shist, shunspent, utxoset;
+        std::shared_ptr<const TxNum0Index> txNum0Index = std::make_shared<const TxNum0Index>();
+        int tipHeight = -1; ///< == txNum0Index->size - 1
+        TxNum txNumNext = 0;
+    };
+    /// Note: this is declared after `db` so that it (and its snapshots) are destroyed before the dbs are closed.
+    std::shared_ptr<const ReadView> readView_ = std::make_shared<const ReadView>();
+
+    std::shared_ptr<const ReadView> readView() const { return std::atomic_load(&readView_); }
+
+    /// Call at the end of a commit, with blocksLock held exclusively (or from startup), once all of the writes to the
+    /// dbs have been issued.
+    void publishReadView() {
+        auto v = std::make_shared<ReadView>();
+        v->shist = ReadView::Snap(db.shist.get(), db.defReadOpts);
+        v->shunspent = ReadView::Snap(db.shunspent.get(), db.defReadOpts);
+        v->utxoset = ReadView::Snap(db.utxoset.get(), db.defReadOpts);
+        v->txNum0Index = std::atomic_load(&txNum0Index);
+        v->tipHeight = int(v->txNum0Index->size) - 1;
+        v->txNumNext = txNumNext;
+        std::atomic_store(&readView_, std::shared_ptr<const ReadView>(std::move(v)));
+    }
 
     std::atomic<int64_t> utxoCt = 0;
 
     std::atomic<uint32_t> earliestUndoHeight = UINT32_MAX; ///< the purpose of this is to control when we issue "delete" commands to the db for deleting expired undo infos from the undo db
 
+    /// If the db was imported from a snapshot that has not yet been checked against bitcoind, this is its height.
+    std::atomic<uint32_t> unverifiedSnapshotHeight = UINT32_MAX;
+
+    /// Progress of the utxo set check when it runs in the background (checkdb_background), for /stats
+    struct BackgroundCheck {
+        std::atomic_bool running{false}, ok{false}, failed{false};
+        std::atomic_int64_t nChecked{0}, nExpected{0};
+        std::atomic<double> tStart{0.}, tEnd{0.};
+    } bgCheck;
+
+    /// Expired undo infos are pruned from the undo db in one DeleteRange once at least this many have accumulated.
+    static constexpr unsigned kUndoPruneInterval = 25;
+    struct UndoPruneStats {
+        std::atomic_uint64_t nPrunes{0}, nPruned{0}, pruneNanos{0}, nCompactions{0}, compactNanos{0}, nCompactionsFailed{0};
+        std::atomic_uint32_t lastPruneHeight{0}; ///< the last height that was pruned (0 if none yet)
+    } undoPruneStats;
+
+    /// Initial sync write mode (config: db_initial_sync_mode). See Storage::beginInitialSync.
+    struct InitialSync {
+        static constexpr size_t kWriteBufferSize = 256 * 1024 * 1024; ///< memtable size for the block data db's while active
+        /// At each checkpoint, auto compactions are re-enabled until the next checkpoint for any block data db that has
+        /// accumulated more than this many L0 files, since point lookups (e.g. of utxos) get slower as L0 grows.
+        static constexpr uint64_t kMaxL0Files = 64;
+
+        std::atomic_bool active{false}; ///< written with blocksLock held
+        unsigned blocksSinceCheckpoint = 0; ///< guarded by blocksLock
+        /// If startup() restored a checkpoint, this is its manifest. The loadCheck* functions truncate the RecordFiles
+        /// to the counts in it. Only used during startup().
+        QVariantMap restoredManifest;
+
+        // stats
+        std::atomic<double> tStart{0.}, tEnd{0.};
+        std::atomic_int startHeight{-1}, endHeight{-1};
+        std::atomic_uint64_t nBlocks{0}, nCheckpoints{0}, checkpointNanos{0}, sstBytesStart{0}, sstBytesEnd{0},
+                             sstBytesCompacted{0}, compactNanos{0};
+        std::atomic_bool compacting{false};
+    } initialSync;
+
+    /// Write stall and compaction monitoring, and the tuning of the shared rate limiter. See Storage::monitorCompactions.
+    struct CompactionMonitor {
+        static constexpr int kIntervalMsec = 1000;
+        static constexpr int64_t kMaxBoost = 8; ///< the rate limit is raised to at most this multiple of the base rate
+        /// Pending compaction bytes (summed over all db's) above kPendingHigh and growing means compactions are falling
+        /// behind, below kPendingLow means they have caught up.
+        static constexpr uint64_t kPendingLow = 64ull * 1024 * 1024, kPendingHigh = 1024ull * 1024 * 1024;
+
+        std::atomic_int64_t rate{0}; ///< the current rate limit in bytes/sec, 0 if there is no rate limiter
+        std::atomic_uint64_t pendingBytes{0}, nSamples{0}, nStoppedSamples{0}, nDelayedSamples{0}, nRaises{0};
+        std::atomic_bool writeStopped{false};
+
+        /// Per-block write stall and compaction time, updated by addBlock
+        struct Block { BlockHeight height; uint64_t commitMicros, stallMicros, compactMicros; };
+        static constexpr size_t kMaxRecentBlocks = 10;
+        std::mutex recentLock; ///< guards recentBlocks
+        std::deque<Block> recentBlocks;
+        std::atomic_uint64_t nBlocks{0}, nStalledBlocks{0}, stallMicros{0}, maxStallMicros{0}, compactMicros{0};
+    } compactionMonitor;
+
+    /// Returns the cumulative {write stall, compaction} time in usec across all db's
+    std::pair<uint64_t, uint64_t> stallAndCompactMicros() const {
+        uint64_t stall = 0, compact = 0;
+        for (const auto & [dbp, stats] : db.statistics) {
+            rocksdb::HistogramData h;
+            stats->histogramData(rocksdb::COMPACTION_TIME, &h);
+            stall += stats->getTickerCount(rocksdb::STALL_MICROS);
+            compact += h.sum;
+        }
+        return { stall, compact };
+    }
+
     /// This cache is anticipated to see heavy use for get_history, so we may wish to make it larger. MAKE THIS CONFIGURABLE.
     static constexpr size_t kMaxNum2HashMemoryBytes = 100*1000*1000; ///< 100MiB max cache
     CostCache<TxNum, TxHash> lruNum2Hash{kMaxNum2HashMemoryBytes};
@@ -520,16 +931,54 @@ struct Storage::Pvt
                            height2HashesHits = 0, height2HashesMisses = 0;
     } lruCacheStats;
 
+    /// Warm restart: the keys of the above two caches are saved on shutdown and prefetched again in the background
+    /// on startup. See Storage::saveWarmCaches and Storage::prefetchWarmCaches.
+    struct WarmCaches {
+        static constexpr quint32 kMagic = 0xfc0ca4e5, kVersion = 1;
+        static constexpr int kChunkSize = 8192; ///< the keys are prefetched in sorted chunks of this many, one per pool job
+        std::atomic<double> tStart{0.}, tEnd{0.};
+        std::atomic_uint64_t nNum2Hash{0}, nHeight2Hashes{0}; ///< the number of keys loaded from the file
+        std::atomic_int pendingChunks{0};
+    } warmCaches;
+
     /// this object is thread safe, but it needs to be initialized with headers before allowing client connections.
     std::unique_ptr<Merkle::Cache> merkleCache;
 
     HeaderHash genesisHash; // written-to once by either loadHeaders code or addBlock for block 0. Guarded by headerVerifierLock.
 
-    Mempool mempool; ///< app-wide mempool data -- does not get saved to db. Controller.cpp writes to this
+    Mempool mempool; ///< app-wide mempool data -- saved to a file on shutdown, see saveMempool(). Controller.cpp writes to this
     Mempool::FeeHistogramVec mempoolFeeHistogram; ///< refreshed periodically by refreshMempoolHistogram()
-    RWLock mempoolLock;
+    Lock mempoolFeeHistogramLock; ///< guards mempoolFeeHistogram
+    // See the "Mempool locking" comment in Storage.h for how these are used
+    RWLock mempoolLock; ///< the global mempool lock
+    RWLock mempoolTxsLock;
+    std::array<RWLock, Mempool::kNumHashXShards> mempoolShardLocks;
+    Lock mempoolWriterLock;
 };
 
+namespace {
+    /// Places table `name`'s .sst files per config db_paths_<table>, if specified, by adding its paths to
+    /// `opts.db_paths`. With db_paths set, RocksDB no longer looks for .sst files in the db's own directory, so this
+    /// refuses (throws) if that directory still has any: those must first be moved by the user (see the example config).
+    void SetupTablePaths(rocksdb::Options &opts, const Options &options, const QString &name)
+    {
+        const auto tablePaths = options.db.tablePaths.value(name);
+        if (tablePaths.isEmpty())
+            return;
+        const QString path = options.datadir + QDir::separator() + name;
+        if (const auto ssts = QDir(path).entryList(QStringList{ "*.sst" }, QDir::Files); !ssts.isEmpty())
+            throw DatabaseError(QString("db_paths_%1 is set, but the %1 database has %2 .sst files in %3. Either unset"
+                                        " db_paths_%1, or stop Fulcrum and move the .sst files from %3 into %4 first.")
+                                .arg(name).arg(ssts.size()).arg(path, tablePaths.front().dir + QDir::separator() + name));
+        for (const auto & tp : tablePaths) {
+            const QString dir = tp.dir + QDir::separator() + name; // a subdir per table since file names would clash
+            if (!QDir().mkpath(dir))
+                throw DatabaseError(QString("Unable to create directory %1 for the %2 database").arg(dir, name));
+            opts.db_paths.emplace_back(dir.toStdString(), tp.targetSize ? tp.targetSize : std::numeric_limits<uint64_t>::max());
+        }
+    }
+} // namespace
+
 Storage::Storage(const std::shared_ptr<const Options> & options_)
     : Mgr(nullptr), options(options_), subsmgr(new SubsMgr(options, this)), p(std::make_unique<Pvt>())
 {
@@ -554,6 +1003,14 @@ void Storage::startup()
         p->merkleCache = std::make_unique<Merkle::Cache>(std::bind(&Storage::merkleCacheHelperFunc, this, _1, _2, _3));
     }
 
+    std::optional<uint32_t> upgradeFromVersion;
+
+    std::optional<QVariantMap> importedSnapshot;
+    if (!options->importSnapshot.isEmpty())
+        importedSnapshot = importSnapshot(options->importSnapshot); // may throw
+
+    const bool restoredInitialSync = restoreInitialSyncCheckpoint(); // may throw
+
     {   // open all db's ...
 
         rocksdb::Options & opts(p->db.opts), &shistOpts(p->db.shistOpts);
@@ -566,22 +1023,33 @@ void Storage::startup()
         opts.max_open_files = options->db.maxOpenFiles <= 0 ? -1 : options->db.maxOpenFiles; ///< this affects memory usage see: https://github.com/facebook/rocksdb/issues/4112
         opts.keep_log_file_num = options->db.keepLogFileNum;
         opts.compression = rocksdb::CompressionType::kNoCompression; // for now we test without compression. TODO: characterize what is fastest and best..
+        opts.avoid_flush_during_shutdown = false; // initial sync mode writes with the WAL off, so the memtables must be flushed on close
+        // One rate limiter for all of the db's, so that flushes and compactions (which may burst after a large block)
+        // don't starve query reads of disk bandwidth. It is tuned at runtime by monitorCompactions().
+        if (options->db.compactionRateLimit) {
+            const int64_t rate = int64_t(options->db.compactionRateLimit) * 1'000'000;
+            p->db.rateLimiter.reset(rocksdb::NewGenericRateLimiter(rate));
+            opts.rate_limiter = p->db.rateLimiter;
+            p->compactionMonitor.rate = rate;
+        }
         shistOpts = opts; // copy what we just did
         shistOpts.merge_operator = p->db.concatOperator = std::make_shared<ConcatOperator>(); // this set of options uses the concat merge operator (we use this to append to history entries in the db)
 
         using DBInfoTup = std::tuple<QString, std::unique_ptr<rocksdb::DB> &, const rocksdb::Options &>;
         const std::list<DBInfoTup> dbs2open = {
             { "meta", p->db.meta, opts },
-            { "blkinfo" , p->db.blkinfo , opts },
             { "utxoset", p->db.utxoset, opts },
             { "scripthash_history", p->db.shist, shistOpts },
             { "scripthash_unspent", p->db.shunspent, opts },
             { "undo", p->db.undo, opts },
         };
         const auto OpenDB = [this](const DBInfoTup &tup) {
-            auto & [name, uptr, opts] = tup;
+            auto & [name, uptr, sharedOpts] = tup;
             rocksdb::DB *db = nullptr;
             rocksdb::Status s;
+            rocksdb::Options opts = sharedOpts;
+            opts.statistics = rocksdb::CreateDBStatistics(); // for the write stall, compaction & read latency stats
+            SetupTablePaths(opts, *options, name); // may throw
             // try and open database
             const QString path = options->datadir + QDir::separator() + name;
             s = rocksdb::DB::Open( opts, path.toStdString(), &db);
@@ -589,40 +1057,21 @@ void Storage::startup()
                 throw DatabaseError(QString("Error opening %1 database: %2 (path: %3)")
                                     .arg(name).arg(StatusString(s)).arg(path));
             uptr.reset(db);
+            p->db.statistics[db] = opts.statistics;
         };
 
-        // open all db's defined above
-        for (auto & tup : dbs2open)
+        // open all db's defined above -- "meta" is opened and checked first since its version determines how
+        // the scripthash_history merge operator must behave (see ConcatOperator::legacyFixedWidth).
+        for (auto & tup : dbs2open) {
             OpenDB(tup);
+            if (&std::get<1>(tup) == &p->db.meta)
+                upgradeFromVersion = loadCheckMeta();
+        }
 
     }  // /open db's
 
-    // load/check meta
-    {
-        Meta m_db;
-        static const QString errMsg{"Incompatible database format -- delete the datadir and resynch. RocksDB error"};
-        if (auto opt = GenericDBGet<Meta>(p->db.meta.get(), kMeta, true, errMsg);
-                opt.has_value())
-        {
-            m_db = *opt;
-            if (m_db.magic != p->meta.magic || m_db.version != p->meta.version || m_db.platformBits != p->meta.platformBits) {
-                throw DatabaseFormatError(errMsg);
-            }
-            p->meta = m_db;
-            Debug () << "Read meta from db ok";
-            if (!p->meta.chain.isEmpty())
-                Log() << "Chain: " << p->meta.chain;
-        } else {
-            // ok, did not exist .. write a new one to db
-            saveMeta_impl();
-        }
-        if (isDirty()) {
-            throw DatabaseError("It appears that " APPNAME " was forcefully killed in the middle of committng a block to the db. "
-                                "We cannot figure out where exactly in the update process " APPNAME " was killed, so we "
-                                "cannot undo the inconsistent state caused by the unexpected shutdown. Sorry!"
-                                "\n\nThe database has been corrupted. Please delete the datadir and resynch to bitcoind.\n");
-        }
-    }
+    if (upgradeFromVersion.has_value())
+        upgradeDB(*upgradeFromVersion); // may throw
 
     // load headers -- may throw.. this must come first
     loadCheckHeadersInDB();
@@ -633,12 +1082,99 @@ void Storage::startup()
     // load check earliest undo to populate earliestUndoHeight
     loadCheckEarliestUndo();
 
+    if (restoredInitialSync) {
+        // the db's and RecordFiles are now all back at the checkpoint's height, so it's no longer needed
+        p->initialSync.restoredManifest.clear();
+        QDir(options->datadir + QDir::separator() + kInitialSyncCheckpointName).removeRecursively();
+        Log() << "Initial sync: resuming from the checkpoint at height " << latestTip().first;
+    }
+
+    // from here on out, the query paths read through this
+    p->publishReadView();
+
+    if (importedSnapshot.has_value())
+        checkImportedSnapshot(*importedSnapshot); // may throw
+    else if (const auto optHeight = GenericDBGet<uint32_t>(p->db.meta.get(), kSnapshotUnverified, true,
+                                                           "Error reading the snapshot flag from the meta db");
+             optHeight.has_value())
+        p->unverifiedSnapshotHeight = *optHeight;
+
     start(); // starts our thread
+
+    if (options->doSlowDbChecks && options->slowDbChecksInBackground)
+        startBackgroundUTXOCheck();
+
+    prefetchWarmCaches();
+    loadMempool();
+}
+
+void Storage::on_started()
+{
+    ThreadObjectMixin::on_started();
+    // sample the db's for write stalls & compaction backlog periodically (see monitorCompactions)
+    auto *timer = new QTimer(this);
+    connect(timer, &QTimer::timeout, this, &Storage::monitorCompactions);
+    timer->start(p->compactionMonitor.kIntervalMsec);
+}
+
+void Storage::monitorCompactions()
+{
+    auto & cm = p->compactionMonitor;
+    bool stopped = false, delayed = false;
+    uint64_t pending = 0;
+    for (auto *db : p->db.all()) {
+        if (!db) return; // not open (should never happen)
+        uint64_t val;
+        if (db->GetIntProperty(rocksdb::DB::Properties::kIsWriteStopped, &val) && val) stopped = true;
+        if (db->GetIntProperty(rocksdb::DB::Properties::kActualDelayedWriteRate, &val) && val) delayed = true;
+        if (db->GetIntProperty(rocksdb::DB::Properties::kEstimatePendingCompactionBytes, &val)) pending += val;
+    }
+    ++cm.nSamples;
+    if (stopped) ++cm.nStoppedSamples;
+    if (delayed) ++cm.nDelayedSamples;
+    cm.writeStopped = stopped;
+    const uint64_t prevPending = cm.pendingBytes.exchange(pending);
+
+    if (!p->db.rateLimiter) return;
+    // Tune the rate limiter: as long as compactions keep up, it stays at the configured base rate, which keeps the
+    // disk bandwidth left over for queries predictable. If compactions fall behind, the limit is doubled (up to
+    // kMaxBoost x base) on each sample, and it goes straight to the maximum if writes are being delayed or stopped
+    // (or during initial sync), since then addBlock is waiting on compactions. Once caught up, it decays back down.
+    const int64_t base = int64_t(options->db.compactionRateLimit) * 1'000'000, max = base * cm.kMaxBoost, cur = cm.rate;
+    int64_t target = cur;
+    if (stopped || delayed || p->initialSync.active)
+        target = max;
+    else if (pending > cm.kPendingHigh && pending >= prevPending)
+        target = std::min(max, cur * 2);
+    else if (pending < cm.kPendingLow)
+        target = std::max(base, cur / 2);
+    if (target != cur) {
+        p->db.rateLimiter->SetBytesPerSecond(target);
+        cm.rate = target;
+        if (target > cur) ++cm.nRaises;
+        DebugM("Compaction rate limit: ", target / 1'000'000, " MB/sec (pending compaction bytes: ", pending,
+               stopped ? ", writes stopped" : (delayed ? ", writes delayed" : ""), ")");
+    }
 }
 
 void Storage::cleanup()
 {
     stop(); // joins our thread
+    if (ExclusiveLockGuard g(p->blocksLock); p->initialSync.active) {
+        // Leave initial sync mode cleanly (flushes everything, clears the checkpoint). It is re-entered on the next
+        // run if we are still behind, and the deferred compaction then happens once the tip is reached.
+        try {
+            endInitialSync(false);
+        } catch (const std::exception &e) {
+            Warning() << "Initial sync: error leaving initial sync mode on shutdown: " << e.what();
+        }
+    }
+    for (auto *db : p->db.all())
+        if (db) db->DisableManualCompaction(); // abort any deferred compaction still running in the thread pool
+    if (p->txNumsFile) {
+        saveWarmCaches();
+        saveMempool();
+    }
     if (subsmgr) subsmgr->cleanup();
     // TODO: unsaved/"dirty state" detection here -- and forced save, if needed.
 }
@@ -672,14 +1208,29 @@ auto Storage::stats() const -> Stats
     }
     {
         const size_t nHashes = p->merkleCache->size(), bytes = nHashes * (HashLen + sizeof(HeaderHash));
+        caches["merkleHeaders_Length"] = qulonglong(p->merkleCache->length());
         caches["merkleHeaders_Size"] = qulonglong(nHashes);
         caches["merkleHeaders_SizeBytes"] = qulonglong(bytes);
     }
+    if (const auto arr = std::atomic_load(&p->headerArray); arr) {
+        QVariantMap m;
+        m["nHeaders"] = qulonglong(arr->count);
+        m["Size bytes"] = qulonglong(arr->buf ? arr->buf->capacity * arr->hdrSize : 0);
+        caches["Headers in RAM"] = m;
+    }
+    if (const auto & wc = p->warmCaches; wc.tStart > 0.) {
+        QVariantMap m;
+        m["TxNum -> TxHash keys"] = qulonglong(wc.nNum2Hash.load());
+        m["Height -> TxHashes keys"] = qulonglong(wc.nHeight2Hashes.load());
+        m["pending chunks"] = wc.pendingChunks.load();
+        m["secs"] = wc.tEnd > 0. ? QVariant(QString::number(wc.tEnd - wc.tStart, 'f', 1)) : QVariant();
+        caches["Warm restart prefetch"] = m;
+    }
     ret["caches"] = caches;
     {
         // db stats
         QVariantMap m;
-        for (const auto ptr : { &p->db.blkinfo, &p->db.meta, &p->db.shist, &p->db.shunspent, &p->db.undo, &p->db.utxoset, }) {
+        for (const auto ptr : { &p->db.meta, &p->db.shist, &p->db.shunspent, &p->db.undo, &p->db.utxoset, }) {
             QVariantMap m2;
             const auto & db = *ptr;
             const QString name = QFileInfo(QString::fromStdString(db->GetName())).fileName();
@@ -707,6 +1258,140 @@ auto Storage::stats() const -> Stats
         }
         ret["DB Stats"] = m;
     }
+    if (options->doSlowDbChecks && options->slowDbChecksInBackground) {
+        QVariantMap m;
+        const auto & bg = p->bgCheck;
+        m["state"] = bg.failed ? "failed" : (bg.ok ? "ok" : (bg.running ? "running" : "not started"));
+        m["utxos verified"] = qlonglong(bg.nChecked.load());
+        m["utxos expected"] = qlonglong(bg.nExpected.load());
+        if (const double t0 = bg.tStart; t0 > 0.)
+            m["elapsed secs"] = QString::number((bg.running ? Util::getTimeSecs() : bg.tEnd.load()) - t0, 'f', 1);
+        ret["CheckDB (background)"] = m;
+    }
+    {
+        // undo db storage and pruning costs
+        QVariantMap m;
+        const auto & ups = p->undoPruneStats;
+        m["depth"] = configuredUndoDepth();
+        const auto earliest = p->earliestUndoHeight.load();
+        m["earliest"] = earliest != UINT32_MAX ? QVariant(earliest) : QVariant();
+        for (const auto prop : { "rocksdb.estimate-num-keys", "rocksdb.total-sst-files-size", "rocksdb.estimate-live-data-size" }) {
+            if (uint64_t val; LIKELY(p->db.undo->GetIntProperty(prop, &val)))
+                m[prop] = qulonglong(val);
+        }
+        m["prunes"] = qulonglong(ups.nPrunes.load());
+        m["pruned"] = qulonglong(ups.nPruned.load());
+        m["prune msec"] = QString::number(ups.pruneNanos.load() / 1e6, 'f', 3);
+        m["compactions"] = qulonglong(ups.nCompactions.load());
+        m["compaction msec"] = QString::number(ups.compactNanos.load() / 1e6, 'f', 3);
+        m["compactions failed"] = qulonglong(ups.nCompactionsFailed.load());
+        m["last pruned height"] = ups.lastPruneHeight.load() ? QVariant(ups.lastPruneHeight.load()) : QVariant();
+        ret["Undo"] = m;
+    }
+    {
+        QVariantMap m;
+        const auto & is = p->initialSync;
+        m["enabled"] = options->db.initialSyncMode;
+        m["checkpoint interval"] = options->db.initialSyncCheckpointInterval;
+        if (const double t0 = is.tStart; t0 > 0.) {
+            const double tEnd = is.tEnd, secs = (tEnd > 0. ? tEnd : Util::getTimeSecs()) - t0;
+            const auto nBlocks = is.nBlocks.load();
+            const uint64_t sstStart = is.sstBytesStart, sstEnd = tEnd > 0. ? is.sstBytesEnd.load() : TotalSstBytes(p->db.all());
+            m["state"] = tEnd > 0. ? (is.compacting ? "compacting" : "done") : "active";
+            m["start height"] = is.startHeight.load();
+            m["end height"] = is.endHeight.load() >= 0 ? QVariant(is.endHeight.load()) : QVariant();
+            m["blocks"] = qulonglong(nBlocks);
+            m["elapsed secs"] = QString::number(secs, 'f', 1);
+            m["blocks/sec"] = QString::number(secs > 0. ? nBlocks / secs : 0., 'f', 1);
+            m["checkpoints"] = qulonglong(is.nCheckpoints.load());
+            m["checkpoint secs"] = QString::number(is.checkpointNanos.load() / 1e9, 'f', 1);
+            m["WAL bytes avoided (est.)"] = qulonglong(sstEnd > sstStart ? sstEnd - sstStart : 0);
+            m["compaction secs"] = is.compactNanos.load() ? QVariant(QString::number(is.compactNanos.load() / 1e9, 'f', 1)) : QVariant();
+            m["sst bytes before compaction"] = is.sstBytesEnd.load() ? QVariant(qulonglong(is.sstBytesEnd.load())) : QVariant();
+            m["sst bytes after compaction"] = is.sstBytesCompacted.load() ? QVariant(qulonglong(is.sstBytesCompacted.load())) : QVariant();
+        } else
+            m["state"] = "inactive";
+        ret["Initial sync"] = m;
+    }
+    {
+        QVariantMap m;
+        auto & cm = p->compactionMonitor;
+        m["rate limit MB/sec"] = p->db.rateLimiter ? QVariant(qlonglong(cm.rate.load() / 1'000'000)) : QVariant();
+        m["rate limit base MB/sec"] = p->db.rateLimiter ? QVariant(options->db.compactionRateLimit) : QVariant();
+        m["rate limit raises"] = qulonglong(cm.nRaises.load());
+        m["pending compaction bytes"] = qulonglong(cm.pendingBytes.load());
+        m["writes stopped"] = cm.writeStopped.load();
+        m["samples"] = qulonglong(cm.nSamples.load());
+        m["samples with writes stopped"] = qulonglong(cm.nStoppedSamples.load());
+        m["samples with writes delayed"] = qulonglong(cm.nDelayedSamples.load());
+        m["blocks"] = qulonglong(cm.nBlocks.load());
+        m["blocks stalled"] = qulonglong(cm.nStalledBlocks.load());
+        m["stall msec"] = QString::number(cm.stallMicros.load() / 1e3, 'f', 1);
+        m["stall msec (max per block)"] = QString::number(cm.maxStallMicros.load() / 1e3, 'f', 1);
+        m["compaction msec"] = QString::number(cm.compactMicros.load() / 1e3, 'f', 1);
+        QVariantList recent;
+        {
+            std::unique_lock g(cm.recentLock);
+            for (const auto & b : cm.recentBlocks)
+                recent.push_back(QVariantMap{
+                    { "height", b.height },
+                    { "commit msec", QString::number(b.commitMicros / 1e3, 'f', 1) },
+                    { "stall msec", QString::number(b.stallMicros / 1e3, 'f', 1) },
+                    { "compaction msec", QString::number(b.compactMicros / 1e3, 'f', 1) },
+                });
+        }
+        m["recent blocks"] = recent;
+        ret["Compaction"] = m;
+    }
+    {
+        // Per-table placement: for each directory a table's files live in, the table's usage and the free space,
+        // plus the table's .sst read latency (see config db_paths_<table>)
+        QVariantMap m;
+        for (auto *db : p->db.all()) {
+            if (!db) continue;
+            const QString name = DBName(db);
+            QVariantList paths;
+            QStringList dirs;
+            if (const auto & dbPaths = db->GetOptions().db_paths; dbPaths.empty())
+                dirs.push_back(QString::fromStdString(db->GetName()));
+            else
+                for (const auto & dbp : dbPaths)
+                    dirs.push_back(QString::fromStdString(dbp.path));
+            // the per-path usage comes from RocksDB's in-memory file metadata, rather than listing the directories
+            std::vector<rocksdb::LiveFileMetaData> files;
+            db->GetLiveFilesMetaData(&files);
+            QMap<QString, QPair<qint64, qint64>> usage; // path -> (nFiles, bytes)
+            for (const auto & f : files) {
+                auto & u = usage[QString::fromStdString(f.db_path)];
+                ++u.first;
+                u.second += qint64(f.size);
+            }
+            for (const auto & dir : dirs) {
+                const auto u = usage.value(dir);
+                const QStorageInfo si(dir);
+                paths.push_back(QVariantMap{
+                    { "path", dir },
+                    { "sst files", u.first },
+                    { "sst bytes", u.second },
+                    { "free bytes", si.isValid() ? QVariant(si.bytesAvailable()) : QVariant() },
+                    { "total bytes", si.isValid() ? QVariant(si.bytesTotal()) : QVariant() },
+                });
+            }
+            QVariantMap m2;
+            m2["paths"] = paths;
+            if (const auto stats = p->db.statistics.find(db); stats != p->db.statistics.end()) {
+                rocksdb::HistogramData h;
+                stats->second->histogramData(rocksdb::SST_READ_MICROS, &h);
+                m2["sst reads"] = qulonglong(h.count);
+                m2["sst read usec (avg)"] = QString::number(h.average, 'f', 1);
+                m2["sst read usec (p50)"] = QString::number(h.median, 'f', 1);
+                m2["sst read usec (p99)"] = QString::number(h.percentile99, 'f', 1);
+                m2["sst read usec (max)"] = QString::number(h.max, 'f', 1);
+            }
+            m[name] = m2;
+        }
+        ret["DB Paths"] = m;
+    }
     return ret;
 }
 
@@ -810,6 +1495,8 @@ void Storage::appendHeader(const Header &h, BlockHeight height)
         throw DatabaseError(QString("Failed to append header %1: %2").arg(height).arg(err));
     else if (UNLIKELY(!res.has_value() || *res != height))
         throw DatabaseError(QString("Failed to append header %1: returned count is bad").arg(height));
+    p->headerArrayUpdate(height, {h});
+    appendMerkleRoots(p->merkleCache->extendTo(height + 1)); // only does work every 2^SegmentDepth headers
 }
 
 void Storage::deleteHeadersPastHeight(BlockHeight height)
@@ -820,12 +1507,19 @@ void Storage::deleteHeadersPastHeight(BlockHeight height)
         throw DatabaseError(QString("Failed to truncate headers past height %1: %2").arg(height).arg(err));
     else if (res != height + 1)
         throw InternalError("header truncate returned an unexepected value");
+    p->headerArrayUpdate(height + 1, {});
+    p->merkleCache->truncate(height + 1); // this takes a length, not a height, which is always +1 the height
+    if (const auto nRoots = p->merkleCache->size(); p->merkleRootsFile->numRecords() > nRoots) {
+        if (QString err; p->merkleRootsFile->truncate(nRoots, &err) != nRoots || !err.isEmpty())
+            throw DatabaseError(QString("Failed to truncate header merkle roots file: %1").arg(err));
+    }
 }
 
 auto Storage::headerForHeight(BlockHeight height, QString *err) const -> std::optional<Header>
 {
     std::optional<Header> ret;
-    if (int(height) <= latestTip().first && int(height) >= 0) {
+    SharedLockGuard g(p->rewindLock); // the headers file may not be truncated from underneath us
+    if (int(height) <= p->readView()->tipHeight && int(height) >= 0) {
         ret = headerForHeight_nolock(height, err);
     } else if (err) { *err = QStringLiteral("Height %1 is out of range").arg(height); }
     return ret;
@@ -834,6 +1528,11 @@ auto Storage::headerForHeight(BlockHeight height, QString *err) const -> std::op
 auto Storage::headerForHeight_nolock(BlockHeight height, QString *err) const -> std::optional<Header>
 {
     std::optional<Header> ret;
+    if (const auto arr = std::atomic_load(&p->headerArray); arr && height < arr->count) {
+        // fast path: no I/O
+        ret.emplace(arr->header(height), int(arr->hdrSize));
+        return ret;
+    }
     try {
         QString err1;
         ret.emplace( p->headersFile->readRecord(height, &err1) );
@@ -850,7 +1549,15 @@ auto Storage::headerForHeight_nolock(BlockHeight height, QString *err) const ->
 auto Storage::headersFromHeight_nolock_nocheck(BlockHeight height, unsigned num, QString *err) const -> std::vector<Header>
 {
     if (err) err->clear();
-    std::vector<Header> ret = p->headersFile->readRecords(height, num, err);
+    std::vector<Header> ret;
+    if (const auto arr = std::atomic_load(&p->headerArray); arr && size_t(height) + num <= arr->count) {
+        // fast path: no I/O
+        ret.reserve(num);
+        for (size_t h = height; h < size_t(height) + num; ++h)
+            ret.emplace_back(arr->header(h), int(arr->hdrSize));
+        return ret;
+    }
+    ret = p->headersFile->readRecords(height, num, err);
 
     if (ret.size() != num && err && err->isEmpty())
         *err = "short header count returned from headers file";
@@ -864,23 +1571,193 @@ auto Storage::headersFromHeight_nolock_nocheck(BlockHeight height, unsigned num,
 auto Storage::headersFromHeight(BlockHeight height, unsigned count, QString *err) const -> std::vector<Header>
 {
     std::vector<Header> ret;
-    SharedLockGuard g(p->blocksLock); // to ensure clients get a consistent view
-    int num = std::min(1 + latestTip().first - int(height), int(count)); // note this also takes a lock briefly so we need to do this after the lockguard above
+    SharedLockGuard g(p->rewindLock); // the headers file may not be truncated from underneath us
+    // Clamp to the tip of the published view. addBlock appends to the headers file without blocking us, but it is
+    // never truncated while we hold the above lock, so everything up to the view's tip is there and consistent.
+    const int num = std::min(1 + p->readView()->tipHeight - int(height), int(count));
     if (num > 0) {
-        ret = headersFromHeight_nolock_nocheck(height, count, err);
+        ret = headersFromHeight_nolock_nocheck(height, unsigned(num), err);
     } else if (err) *err = "No headers in the specified range";
     return ret;
 }
 
+auto Storage::headersSliceFromHeight(BlockHeight height, unsigned count) const -> HeadersSlice
+{
+    HeadersSlice ret;
+    SharedLockGuard g(p->rewindLock); // so that the array and the view's tip agree (see headersFromHeight)
+    if (const auto arr = std::atomic_load(&p->headerArray); arr) {
+        const int64_t end = std::min<int64_t>({int64_t(height) + count, p->readView()->tipHeight + 1, int64_t(arr->count)});
+        if (end > int64_t(height)) {
+            ret.keepAlive = arr->buf;
+            ret.ptr = arr->header(height);
+            ret.n = unsigned(end - int64_t(height));
+            ret.hdrSize = arr->hdrSize;
+        }
+    }
+    return ret;
+}
+
+bool Storage::headersInRam() const { return bool(std::atomic_load(&p->headerArray)); }
+
+namespace {
+    /// The startup checks are split into shards of at least this many items, which are run concurrently on the
+    /// thread pool (up to 1 shard per pool thread).
+    constexpr size_t kMinItemsPerCheckShard = 10000;
+    /// The background utxo set check (checkdb_background) is done in this many shards, with at most
+    /// kBgCheckMaxShardsInFlight of them in the thread pool at once.
+    constexpr unsigned kBgCheckShards = 32, kBgCheckMaxShardsInFlight = 2;
+
+    unsigned CheckShardCount(size_t nItems, size_t minPerShard = kMinItemsPerCheckShard) {
+        const auto *pool = ::AppThreadPool();
+        const size_t nThreads = pool ? size_t(std::max(pool->maxThreadCount(), 1)) : 1;
+        return unsigned(std::clamp<size_t>(nItems / std::max<size_t>(minPerShard, 1), 1, nThreads));
+    }
+
+    std::pair<size_t, size_t> CheckShardRange(size_t nItems, unsigned shard, unsigned nShards) {
+        return { nItems * shard / nShards, nItems * (shard + 1) / nShards };
+    }
+
+    /// Shared by the shards of one of the (big) startup check passes: counts the items done and logs the progress of
+    /// the pass every 10%. Does nothing for passes of fewer than kMinItems items since those are quick anyway.
+    struct CheckProgress {
+        static constexpr size_t kMinItems = 100000;
+        const char * const what;
+        const size_t total, step;
+        std::atomic_size_t nDone{0};
+
+        CheckProgress(const char *what, size_t total) : what(what), total(total), step(total >= kMinItems ? total / 10 : 0) {}
+        void itemDone() {
+            if (const size_t n = ++nDone; step && 0 == n % step && n < total)
+                Log() << what << ": " << (n * 100 / total) << "% (" << n << " of " << total << ") ...";
+        }
+    };
+
+    /// Splits [0, nItems) into CheckShardCount() contiguous ranges and calls work(begin, end) for each of them,
+    /// concurrently on the app thread pool. Blocks until all are done. Throws if any of the shards threw (see
+    /// ThreadPool::runShardsBlocking).
+    void RunCheckShards(size_t nItems, const std::function<void(size_t, size_t)> &work,
+                        size_t minPerShard = kMinItemsPerCheckShard) {
+        const unsigned nShards = CheckShardCount(nItems, minPerShard);
+        const auto shardWork = [&work, nItems, nShards](unsigned shard) {
+            const auto [begin, end] = CheckShardRange(nItems, shard, nShards);
+            work(begin, end);
+        };
+        if (auto *pool = ::AppThreadPool(); pool && nShards > 1)
+            pool->runShardsBlocking(nShards, shardWork);
+        else
+            shardWork(0);
+    }
+
+    /// State for the (slow) utxo set consistency check. The snapshots and counts are all captured at the same time,
+    /// under the blocks lock, so that the check is consistent even if it runs in the background while new blocks are
+    /// being added.
+    struct UTXOCheck {
+        rocksdb::DB * const utxoset, * const shunspent;
+        const rocksdb::Snapshot * const utxoSnap, * const shuSnap;
+        const int currentHeight;
+        const TxNum txNumNext;
+        const int64_t expectedCount; ///< the utxo count from the meta db
+        std::atomic_int64_t nChecked{0};
+        std::atomic_int64_t *progress = nullptr; ///< if not null, this is periodically updated with nChecked
+
+        UTXOCheck(rocksdb::DB *utxoset, rocksdb::DB *shunspent, int currentHeight, TxNum txNumNext, int64_t expectedCount)
+            : utxoset(utxoset), shunspent(shunspent), utxoSnap(utxoset->GetSnapshot()), shuSnap(shunspent->GetSnapshot()),
+              currentHeight(currentHeight), txNumNext(txNumNext), expectedCount(expectedCount) {}
+        ~UTXOCheck() {
+            utxoset->ReleaseSnapshot(utxoSnap);
+            shunspent->ReleaseSnapshot(shuSnap);
+        }
+
+        /// Checks the utxos whose txid's first byte is in the range [byteBegin, byteEnd). Throws on failure.
+        void checkShard(unsigned byteBegin, unsigned byteEnd);
+        /// Call after all shards have been checked. Throws if the count of utxos is not what the meta db says.
+        void checkCount() const {
+            if (nChecked != expectedCount)
+                throw DatabaseError(QString("UTXO count in meta table (%1) does not match the actual number of UTXOs in the utxoset (%2)."
+                                            "\n\nThe database has been corrupted. Please delete the datadir and resynch to bitcoind.\n")
+                                    .arg(expectedCount).arg(nChecked.load()));
+        }
+    };
+
+    void UTXOCheck::checkShard(unsigned byteBegin, unsigned byteEnd)
+    {
+        const char lo = char(byteBegin), hi = char(byteEnd);
+        const rocksdb::Slice loKey(&lo, 1), hiKey(&hi, 1);
+        rocksdb::ReadOptions ropts, shuOpts;
+        ropts.snapshot = utxoSnap;
+        ropts.fill_cache = false; // this is a one-off full scan, don't evict useful blocks from the block cache
+        if (byteEnd <= 0xff)
+            ropts.iterate_upper_bound = &hiKey;
+        shuOpts.snapshot = shuSnap;
+        std::unique_ptr<rocksdb::Iterator> iter(utxoset->NewIterator(ropts));
+        if (!iter) throw DatabaseError("Unable to obtain an iterator to the utxo set db");
+        for (iter->Seek(loKey); iter->Valid(); iter->Next()) {
+            // TODO: the below checks may be too slow. See about removing them and just counting the iter.
+            const auto txo = Deserialize<TXO>(FromSlice(iter->key()));
+            if (!txo.isValid()) {
+                throw DatabaseSerializationError("Read an invalid txo from the utxo set database."
+                                                 " This may be due to a database format mismatch."
+                                                 "\n\nDelete the datadir and resynch to bitcoind.\n");
+            }
+            auto info = Deserialize<TXOInfo>(FromSlice(iter->value()));
+            if (!info.isValid())
+                throw DatabaseSerializationError(QString("Txo %1 has invalid metadata in the db."
+                                                        " This may be due to a database format mismatch."
+                                                        "\n\nDelete the datadir and resynch to bitcoind.\n")
+                                                 .arg(txo.toString()));
+            const CompactTXO ctxo = CompactTXO(info.txNum, txo.prevoutN);
+            const QByteArray shuKey = info.hashX + ctxo.toBytes();
+            static const QString errPrefix("Error reading scripthash_unspent");
+            QByteArray tmpBa;
+            if (bool fail1 = false, fail2 = false, fail3 = false, fail4 = false;
+                    (fail1 = (info.confirmedHeight.has_value() && int(*info.confirmedHeight) > currentHeight))
+                    || (fail2 = info.txNum >= txNumNext)
+                    || (fail3 = (tmpBa = GenericDBGet<QByteArray>(shunspent, shuKey, true, errPrefix, false, shuOpts).value_or("")).isEmpty())
+                    || (fail4 = (info.amount != Deserialize<bitcoin::Amount>(tmpBa)))) {
+                // TODO: reorg? Inconsisent db?  FIXME
+                QString msg;
+                {
+                    QTextStream ts(&msg);
+                    ts << "Inconsistent database: txo " << txo.toString() << " at height: "
+                       << info.confirmedHeight.value();
+                    if (fail1) {
+                        ts << " > current height: " << currentHeight << ".";
+                    } else if (fail2) {
+                        ts << ". TxNum: " << info.txNum << " >= " << txNumNext << ".";
+                    } else if (fail3) {
+                        ts << ". Failed to find ctxo " << ctxo.toString() << " in the scripthash_unspent db.";
+                    } else if (fail4) {
+                        ts << ". Utxo amount does not match the ctxo amount in the scripthash_unspent db.";
+                    }
+                    ts << "\n\nThe database has been corrupted. Please delete the datadir and resynch to bitcoind.\n";
+                }
+                throw DatabaseError(msg);
+            }
+            if (const auto n = ++nChecked; 0 == n % 100000) {
+                if (progress) *progress = n;
+                *(0 == n % 2500000 ? std::make_unique<Log>() : std::make_unique<Debug>()) << "CheckDB: Verified " << n << " utxos ...";
+            }
+        }
+        if (!iter->status().ok())
+            throw DatabaseError(QString("Error iterating over the utxo set db: %1").arg(StatusString(iter->status())));
+    }
+} // namespace
 
 void Storage::loadCheckHeadersInDB()
 {
     assert(p->blockHeaderSize() > 0);
     p->headersFile = std::make_unique<RecordFile>(options->datadir + QDir::separator() + "headers", size_t(p->blockHeaderSize()), 0x00f026a1); // may throw
+    if (const auto & m = p->initialSync.restoredManifest; !m.isEmpty())
+        TruncateToCheckpoint(*p->headersFile, m.value("headers").toULongLong()); // may throw
 
     Log() << "Verifying headers ...";
     uint32_t num = unsigned(p->headersFile->numRecords());
     std::vector<QByteArray> hVec;
+    if (options->db.headersInRam) {
+        auto arr = std::make_shared<Pvt::HeaderArray>();
+        arr->hdrSize = size_t(p->blockHeaderSize());
+        std::atomic_store(&p->headerArray, std::shared_ptr<const Pvt::HeaderArray>(std::move(arr)));
+    }
     const auto t0 = Util::getTimeNS();
     {
         if (num > MAX_HEADERS)
@@ -899,15 +1776,24 @@ void Storage::loadCheckHeadersInDB()
             // set genesis hash
             p->genesisHash = BTC::HashRev(hVec.front());
 
-            const QString errMsg("Error retrieving header from db");
-            err.clear();
-            // read db
-            for (uint32_t i = 0; i < num; ++i) {
-                auto & bytes = hVec[i];
-                if (!verif(bytes, &err))
-                    throw DatabaseFormatError(QString("%1. Possible databaase corruption. Delete the datadir and resynch.").arg(err));
-                bytes = BTC::Hash(bytes); // replace the header in the vector with its hash because it will be needed below...
-            }
+            // Verify the headers in shards concurrently. Each shard checks that its headers link up, starting from the
+            // last header of the previous shard, and computes their hashes (which are needed below).
+            std::vector<QByteArray> hashes(num);
+            CheckProgress progress("Verifying headers", num);
+            RunCheckShards(num, [&hVec, &hashes, &progress](size_t begin, size_t end) {
+                BTC::HeaderVerifier shardVerif;
+                shardVerif.reset(unsigned(begin), begin ? hVec[begin-1] : QByteArray());
+                QString err;
+                for (size_t i = begin; i < end; ++i) {
+                    if (!shardVerif(hVec[i], &err))
+                        throw DatabaseFormatError(QString("%1. Possible databaase corruption. Delete the datadir and resynch.").arg(err));
+                    hashes[i] = BTC::Hash(hVec[i]);
+                    progress.itemDone();
+                }
+            });
+            verif.reset(num, hVec.back()); // leave the verifier in the same state as if it had seen every header
+            p->headerArrayUpdate(0, hVec); // no-op if db_headers_in_ram is off
+            hVec.swap(hashes); // replace the headers in the vector with their hashes because they will be needed below...
         }
     }
     if (num) {
@@ -916,33 +1802,144 @@ void Storage::loadCheckHeadersInDB()
         Debug() << "Read & verified " << num << " " << Util::Pluralize("header", num) << " from db in " << QString::number((elapsed-t0)/1e6, 'f', 3) << " msec";
     }
 
-    if (!p->merkleCache->isInitialized() && !hVec.empty())
-        p->merkleCache->initialize(hVec); // this may take a few seconds, and it may also throw
+    loadMerkleCache(hVec);
+}
+
+void Storage::loadMerkleCache(const std::vector<QByteArray> &hashes)
+{
+    p->merkleRootsFile = std::make_unique<RecordFile>(options->datadir + QDir::separator() + "headers_merkle", HashLen, 0x3e4c1e00); // may throw
+    constexpr auto segLen = 1u << Merkle::Cache::SegmentDepth;
+    const unsigned nComplete = unsigned(hashes.size()) / segLen;
+    QString err;
+    uint64_t nRoots = p->merkleRootsFile->numRecords();
+    if (nRoots > nComplete) {
+        // can happen if we crashed in the middle of a rewind -- just drop the excess
+        if (p->merkleRootsFile->truncate(nComplete, &err) != nComplete || !err.isEmpty())
+            throw DatabaseError(QString("Failed to truncate header merkle roots file: %1").arg(err));
+        nRoots = nComplete;
+    }
+    Merkle::HashVec roots;
+    if (nRoots) {
+        roots = p->merkleRootsFile->readRecords(0, nRoots, &err);
+        // We trust the persisted roots, but we do check the last one against the header hashes we just computed, in
+        // case the file is somehow stale. If it doesn't match, we throw them all away and rebuild them.
+        if (const auto start = hashes.begin() + (nRoots - 1) * segLen;
+                roots.size() != nRoots || !err.isEmpty()
+                || roots.back() != Merkle::root(Merkle::HashVec(start, start + segLen), Merkle::Cache::SegmentDepth)) {
+            Warning() << "Header merkle roots file is inconsistent with the headers, rebuilding it ...";
+            roots.clear();
+            if (p->merkleRootsFile->truncate(0, &err) != 0 || !err.isEmpty())
+                throw DatabaseError(QString("Failed to truncate header merkle roots file: %1").arg(err));
+        }
+    }
+    const auto t0 = Util::getTimeNS();
+    appendMerkleRoots(p->merkleCache->initialize(hashes, roots)); // may throw
+    Debug() << "Header merkle cache: " << roots.size() << " segment roots loaded, " << (nComplete - roots.size())
+            << " computed, in " << QString::number((Util::getTimeNS() - t0)/1e6, 'f', 3) << " msec";
+}
+
+void Storage::appendMerkleRoots(const Merkle::HashVec &roots)
+{
+    if (roots.empty()) return;
+    auto batch = p->merkleRootsFile->beginBatchAppend(); // may throw
+    QString err;
+    for (const auto & r : roots)
+        if (!batch.append(r, &err))
+            throw DatabaseError(QString("Failed to append to the header merkle roots file: %1").arg(err));
+}
 
+void Storage::migrateLegacyBlkInfoDB(const QString &path, size_t nBlocks)
+{
+    Log() << "Moving the block info from the blkinfo db to the blkinfos file ...";
+    const auto t0 = Util::getTimeNS();
+    std::unique_ptr<rocksdb::DB> db;
+    // same options as the other tables, including its placement (config db_paths_blkinfo), if any
+    rocksdb::Options opts = p->db.opts;
+    opts.create_if_missing = false;
+    SetupTablePaths(opts, *options, "blkinfo"); // may throw
+    {
+        rocksdb::DB *dbp = nullptr;
+        if (auto st = rocksdb::DB::Open(opts, path.toStdString(), &dbp); !st.ok() || !dbp)
+            throw DatabaseError(QString("Error opening the legacy blkinfo database: %1 (path: %2)").arg(StatusString(st), path));
+        db.reset(dbp);
+    }
+    // read them all concurrently, in shards
+    std::vector<BlkInfo> blkInfos(nBlocks);
+    CheckProgress progress("Reading block infos", blkInfos.size());
+    RunCheckShards(blkInfos.size(), [&db, &blkInfos, &progress, this](size_t begin, size_t end) {
+        static const QString errMsg("Failed to read a blkInfo from db, the database may be corrupted");
+        for (size_t i = begin; i < end; ++i) {
+            blkInfos[i] = GenericDBGetFailIfMissing<BlkInfo>(db.get(), uint32_t(i), errMsg, false, p->db.defReadOpts);
+            progress.itemDone();
+        }
+    });
+    db.reset();
+    // an earlier, interrupted migration may have left a partial file behind
+    if (QString err; p->blkInfosFile->truncate(0, &err) != 0 || !err.isEmpty())
+        throw DatabaseError(QString("Failed to truncate the blkinfos file: %1").arg(err));
+    {
+        auto batch = p->blkInfosFile->beginBatchAppend(); // may throw
+        QString err;
+        for (const auto & bi : blkInfos)
+            if (!batch.append(Serialize(bi), &err))
+                throw DatabaseError(QString("Failed to append to the blkinfos file: %1").arg(err));
+    }
+    if (!p->blkInfosFile->flush())
+        throw DatabaseError("Failed to flush the blkinfos file");
+    // only now that the file is complete is the old db removed (DestroyDB also removes its files in any db_paths)
+    if (auto st = rocksdb::DestroyDB(path.toStdString(), opts); !st.ok())
+        throw DatabaseError(QString("Failed to remove the legacy blkinfo database at %1: %2").arg(path, StatusString(st)));
+    for (const auto & dbp : opts.db_paths)
+        QDir(QString::fromStdString(dbp.path)).removeRecursively();
+    if (!QDir(path).removeRecursively())
+        throw DatabaseError(QString("Failed to remove the legacy blkinfo database at %1").arg(path));
+    Log() << "Moved " << nBlocks << " block infos in " << QString::number((Util::getTimeNS() - t0) / 1e9, 'f', 1) << " secs";
 }
 
 void Storage::loadCheckTxNumsFileAndBlkInfo()
 {
     // may throw.
     p->txNumsFile = std::make_unique<RecordFile>(options->datadir + QDir::separator() + "txnum2txhash", HashLen, 0x000012e2);
+    if (const auto & m = p->initialSync.restoredManifest; !m.isEmpty())
+        TruncateToCheckpoint(*p->txNumsFile, m.value("tx_num_next").toULongLong()); // may throw
     p->txNumNext = p->txNumsFile->numRecords();
     Debug() << "Read TxNumNext from file: " << p->txNumNext.load();
+
+    static_assert(std::is_trivially_copyable_v<BlkInfo>);
+    p->blkInfosFile = std::make_unique<RecordFile>(options->datadir + QDir::separator() + "blkinfos", sizeof(BlkInfo), 0xb1c1f000); // may throw
+    const int height = latestTip().first;
+    const size_t nBlocks = size_t(height + 1);
+    if (const QString legacyPath = options->datadir + QDir::separator() + "blkinfo"; QFileInfo(legacyPath).isDir())
+        migrateLegacyBlkInfoDB(legacyPath, nBlocks); // may throw
+    if (const auto & m = p->initialSync.restoredManifest; m.contains("blkinfos"))
+        TruncateToCheckpoint(*p->blkInfosFile, m.value("blkinfos").toULongLong()); // may throw
+    if (p->blkInfosFile->numRecords() != nBlocks)
+        throw DatabaseFormatError(QString("The blkinfos file has %1 records, expected %2."
+                                          "\n\nThe database may be corrupted. Delete the datadir and resynch it.\n")
+                                  .arg(p->blkInfosFile->numRecords()).arg(nBlocks));
     TxNum ct = 0;
-    if (const int height = latestTip().first; height >= 0)
-    {
-        p->blkInfos.reserve(std::min(size_t(height+1), MAX_HEADERS));
-        Log() << "Checking tx counts ...";
-        for (int i = 0; i <= height; ++i) {
-            static const QString errMsg("Failed to read a blkInfo from db, the database may be corrupted");
-            const auto blkInfo = GenericDBGetFailIfMissing<BlkInfo>(p->db.blkinfo.get(), uint32_t(i), errMsg, false, p->db.defReadOpts);
-            if (blkInfo.txNum0 != ct)
-                throw DatabaseFormatError(QString("BlkInfo for height %1 does not match computed txNum of %2."
-                                                  "\n\nThe database may be corrupted. Delete the datadir and resynch it.\n")
-                                          .arg(i).arg(ct));
-            ct += blkInfo.nTx;
-            p->blkInfos.emplace_back(blkInfo);
-            p->blkInfosByTxNum[blkInfo.txNum0] = unsigned(p->blkInfos.size()-1);
-        }
+    if (nBlocks) {
+        // The whole file is read with one sequential read straight into the vector. Then, rather than walking the
+        // chain of txNums (which only checkdb does), we check the tail: the last block must end at txNumNext.
+        std::vector<BlkInfo> blkInfos(std::min(nBlocks, MAX_HEADERS));
+        if (QString err; p->blkInfosFile->readRecordsRaw(0, blkInfos.size(), blkInfos.data(), &err) != blkInfos.size())
+            throw DatabaseError(QString("Failed to read the blkinfos file: %1").arg(err));
+        if (options->doSlowDbChecks) {
+            Log() << "Checking tx counts ...";
+            CheckProgress progress("Checking tx counts", blkInfos.size());
+            for (size_t i = 0; i < blkInfos.size(); ++i) {
+                const auto & blkInfo = blkInfos[i];
+                progress.itemDone();
+                if (blkInfo.txNum0 != ct)
+                    throw DatabaseFormatError(QString("BlkInfo for height %1 does not match computed txNum of %2."
+                                                      "\n\nThe database may be corrupted. Delete the datadir and resynch it.\n")
+                                              .arg(i).arg(ct));
+                ct += blkInfo.nTx;
+            }
+        } else
+            ct = blkInfos.back().txNum0 + blkInfos.back().nTx;
+        p->blkInfos = std::move(blkInfos);
+        p->txNum0IndexRebuild();
         Log() << ct << " total transactions";
     }
     if (ct != p->txNumNext) {
@@ -957,69 +1954,16 @@ void Storage::loadCheckUTXOsInDB()
 {
     FatalAssert(!!p->db.utxoset, __func__, ": Utxo set db is not open");
 
-    if (options->doSlowDbChecks) {
+    if (options->doSlowDbChecks && !options->slowDbChecksInBackground) {
         Log() << "CheckDB: Verifying utxo set (this may take some time) ...";
 
         const auto t0 = Util::getTimeNS();
         {
-            const int currentHeight = latestTip().first;
-
-            std::unique_ptr<rocksdb::Iterator> iter(p->db.utxoset->NewIterator(p->db.defReadOpts));
-            if (!iter) throw DatabaseError("Unable to obtain an iterator to the utxo set db");
-            p->utxoCt = 0;
-            for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
-                // TODO: the below checks may be too slow. See about removing them and just counting the iter.
-                const auto txo = Deserialize<TXO>(FromSlice(iter->key()));
-                if (!txo.isValid()) {
-                    throw DatabaseSerializationError("Read an invalid txo from the utxo set database."
-                                                     " This may be due to a database format mismatch."
-                                                     "\n\nDelete the datadir and resynch to bitcoind.\n");
-                }
-                auto info = Deserialize<TXOInfo>(FromSlice(iter->value()));
-                if (!info.isValid())
-                    throw DatabaseSerializationError(QString("Txo %1 has invalid metadata in the db."
-                                                            " This may be due to a database format mismatch."
-                                                            "\n\nDelete the datadir and resynch to bitcoind.\n")
-                                                     .arg(txo.toString()));
-                // uncomment this to do a deep test: TODO: Make this configurable from the CLI -- this last check is very slow.
-                const CompactTXO ctxo = CompactTXO(info.txNum, txo.prevoutN);
-                const QByteArray shuKey = info.hashX + ctxo.toBytes();
-                static const QString errPrefix("Error reading scripthash_unspent");
-                QByteArray tmpBa;
-                if (bool fail1 = false, fail2 = false, fail3 = false, fail4 = false;
-                        (fail1 = (info.confirmedHeight.has_value() && int(*info.confirmedHeight) > currentHeight))
-                        || (fail2 = info.txNum >= p->txNumNext)
-                        || (fail3 = (tmpBa = GenericDBGet<QByteArray>(p->db.shunspent.get(), shuKey, true, errPrefix, false, p->db.defReadOpts).value_or("")).isEmpty())
-                        || (fail4 = (info.amount != Deserialize<bitcoin::Amount>(tmpBa)))) {
-                    // TODO: reorg? Inconsisent db?  FIXME
-                    QString msg;
-                    {
-                        QTextStream ts(&msg);
-                        ts << "Inconsistent database: txo " << txo.toString() << " at height: "
-                           << info.confirmedHeight.value();
-                        if (fail1) {
-                            ts << " > current height: " << currentHeight << ".";
-                        } else if (fail2) {
-                            ts << ". TxNum: " << info.txNum << " >= " << p->txNumNext << ".";
-                        } else if (fail3) {
-                            ts << ". Failed to find ctxo " << ctxo.toString() << " in the scripthash_unspent db.";
-                        } else if (fail4) {
-                            ts << ". Utxo amount does not match the ctxo amount in the scripthash_unspent db.";
-                        }
-                        ts << "\n\nThe database has been corrupted. Please delete the datadir and resynch to bitcoind.\n";
-                    }
-                    throw DatabaseError(msg);
-                }
-                if (0 == ++p->utxoCt % 100000) {
-                    *(0 == p->utxoCt % 2500000 ? std::make_unique<Log>() : std::make_unique<Debug>()) << "CheckDB: Verified " << p->utxoCt << " utxos ...";
-                }
-            }
-
-            if (const auto metact = readUtxoCtFromDB(); p->utxoCt != metact)
-                    throw DatabaseError(QString("UTXO count in meta table (%1) does not match the actual number of UTXOs in the utxoset (%2)."
-                                                "\n\nThe database has been corrupted. Please delete the datadir and resynch to bitcoind.\n")
-                                        .arg(metact).arg(p->utxoCt.load()));
-
+            UTXOCheck check(p->db.utxoset.get(), p->db.shunspent.get(), latestTip().first, p->txNumNext, readUtxoCtFromDB());
+            // the utxoset is keyed by txid, so the first byte of the key is uniformly distributed: shard on it
+            RunCheckShards(256, [&check](size_t begin, size_t end) { check.checkShard(unsigned(begin), unsigned(end)); }, 1);
+            check.checkCount();
+            p->utxoCt = check.nChecked.load();
         }
         const auto elapsed = Util::getTimeNS();
         Debug() << "CheckDB: Verified utxos in " << QString::number((elapsed-t0)/1e6, 'f', 3) << " msec";
@@ -1033,6 +1977,65 @@ void Storage::loadCheckUTXOsInDB()
               << ", " << QString::number(utxoSetSizeMiB(), 'f', 3) << " MiB";
 }
 
+void Storage::startBackgroundUTXOCheck()
+{
+    auto *pool = ::AppThreadPool();
+    if (!pool) throw InternalError("startBackgroundUTXOCheck: no thread pool");
+    std::shared_ptr<UTXOCheck> check;
+    {
+        // capture the snapshots & counts atomically with respect to addBlock and undoLatestBlocks
+        std::shared_lock g(p->blocksLock);
+        check = std::make_shared<UTXOCheck>(p->db.utxoset.get(), p->db.shunspent.get(), latestTip().first, p->txNumNext,
+                                            readUtxoCtFromDB());
+    }
+    auto & bg = p->bgCheck;
+    check->progress = &bg.nChecked;
+    bg.nExpected = check->expectedCount;
+    bg.tStart = Util::getTimeSecs();
+    bg.running = true;
+    Log() << "CheckDB: Verifying utxo set in the background ...";
+    // Each shard is a long scan, so only a couple of them are in the pool at any one time (each one submits the next
+    // one when it's done), and at low priority, so as to leave the pool's threads to client work.
+    struct State {
+        std::shared_ptr<UTXOCheck> check;
+        std::atomic_uint next{0}, remaining{kBgCheckShards};
+        std::function<void()> submitNext;
+    };
+    auto st = std::make_shared<State>();
+    st->check = std::move(check);
+    st->submitNext = [this, pool, wst = std::weak_ptr<State>(st)] {
+        auto st = wst.lock();
+        if (!st || p->bgCheck.failed) return;
+        const unsigned shard = st->next++;
+        if (shard >= kBgCheckShards) return;
+        const auto [begin, end] = CheckShardRange(256, shard, kBgCheckShards);
+        pool->submitWork(this, [this, st, begin=begin, end=end] {
+            const auto & check = st->check;
+            check->checkShard(unsigned(begin), unsigned(end));
+            if (--st->remaining == 0) {
+                check->checkCount(); // throws on mismatch
+                auto & bg = p->bgCheck;
+                bg.nChecked = check->nChecked.load();
+                bg.tEnd = Util::getTimeSecs();
+                bg.ok = true;
+                bg.running = false;
+                Log() << "CheckDB: Verified " << bg.nChecked.load() << " utxos in the background in "
+                      << QString::number(bg.tEnd - bg.tStart, 'f', 1) << " secs";
+            } else
+                st->submitNext();
+        }, {}, [this](const QString &err) {
+            auto & bg = p->bgCheck;
+            if (bg.failed.exchange(true)) return; // only report the first failing shard
+            bg.running = false;
+            bg.tEnd = Util::getTimeSecs();
+            Fatal() << "CheckDB: " << err;
+        }, ThreadPool::LowPriority);
+    };
+    const unsigned nInFlight = unsigned(std::clamp(pool->maxThreadCount() / 2, 1, int(kBgCheckMaxShardsInFlight)));
+    for (unsigned i = 0; i < nInFlight; ++i)
+        st->submitNext();
+}
+
 void Storage::loadCheckEarliestUndo()
 {
     FatalAssert(!!p->db.undo,  __func__, ": Undo db is not open");
@@ -1043,11 +2046,10 @@ void Storage::loadCheckEarliestUndo()
         std::unique_ptr<rocksdb::Iterator> iter(p->db.undo->NewIterator(p->db.defReadOpts));
         if (!iter) throw DatabaseError("Unable to obtain an iterator to the undo db");
         for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
-            const auto keySlice = iter->key();
-            if (keySlice.size() != sizeof(uint32_t))
+            const auto optHeight = UndoKeyToHeight(iter->key());
+            if (!optHeight.has_value())
                 throw DatabaseFormatError("Unexpected key in undo database. We expect only 32-bit unsigned ints!");
-            const uint32_t height = DeserializeScalar<uint32_t>(FromSlice(keySlice));
-            if (height < p->earliestUndoHeight) p->earliestUndoHeight = height;
+            if (*optHeight < p->earliestUndoHeight) p->earliestUndoHeight = *optHeight;
             ++ctr;
         }
     }
@@ -1057,6 +2059,160 @@ void Storage::loadCheckEarliestUndo()
     }
 }
 
+std::optional<BlockHeight> Storage::earliestUndoHeight() const
+{
+    if (const auto h = p->earliestUndoHeight.load(); h != UINT32_MAX)
+        return h;
+    return std::nullopt;
+}
+
+std::optional<uint32_t> Storage::loadCheckMeta()
+{
+    std::optional<uint32_t> ret;
+    Meta m_db;
+    static const QString errMsg{"Incompatible database format -- delete the datadir and resynch. RocksDB error"};
+    if (auto opt = GenericDBGet<Meta>(p->db.meta.get(), kMeta, true, errMsg);
+            opt.has_value())
+    {
+        m_db = *opt;
+        if (m_db.magic != p->meta.magic || m_db.platformBits != p->meta.platformBits
+                || m_db.version > Meta::kCurrentVersion || m_db.version < Meta::kMinUpgradeableVersion) {
+            throw DatabaseFormatError(errMsg);
+        }
+        if (m_db.version != Meta::kCurrentVersion) {
+            ret = m_db.version;
+            if (m_db.version < 0x2)
+                p->db.concatOperator->legacyFixedWidth = true; // until upgradeDB() rewrites the history table
+        }
+        p->meta = m_db;
+        Debug () << "Read meta from db ok";
+        if (!p->meta.chain.isEmpty())
+            Log() << "Chain: " << p->meta.chain;
+    } else {
+        // ok, did not exist .. write a new one to db
+        saveMeta_impl();
+    }
+    if (isDirty()) {
+        throw DatabaseError("It appears that " APPNAME " was forcefully killed in the middle of committng a block to the db. "
+                            "We cannot figure out where exactly in the update process " APPNAME " was killed, so we "
+                            "cannot undo the inconsistent state caused by the unexpected shutdown. Sorry!"
+                            "\n\nThe database has been corrupted. Please delete the datadir and resynch to bitcoind.\n");
+    }
+    return ret;
+}
+
+namespace {
+    constexpr size_t kUpgradeBatchSize = 10000; ///< number of keys to rewrite per WriteBatch when upgrading the db
+    constexpr size_t kUpgradeLogInterval = 1000000; ///< log upgrade progress every this many keys
+
+    /// Rewrites every value in `db` with `xform`, kUpgradeBatchSize keys at a time. `xform` receives the existing value
+    /// and returns the new value, or throws on error. Returns a pair of (total bytes before, total bytes after).
+    template <typename Func>
+    std::pair<size_t, size_t> UpgradeRewriteAll(rocksdb::DB *db, const QString &what, const Func &xform)
+    {
+        std::pair<size_t, size_t> ret{0, 0};
+        std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(rocksdb::ReadOptions()));
+        if (!it) throw DatabaseError(QString("Unable to obtain an iterator to the %1 db").arg(DBName(db)));
+        rocksdb::WriteBatch batch;
+        size_t ctr = 0;
+        for (it->SeekToFirst(); it->Valid(); it->Next()) {
+            const auto oldVal = FromSlice(it->value());
+            const QByteArray newVal = xform(oldVal);
+            ret.first += size_t(oldVal.size());
+            ret.second += size_t(newVal.size());
+            GenericBatchPut(batch, it->key(), newVal);
+            if (batch.Count() >= int(kUpgradeBatchSize)) {
+                GenericBatchWrite(db, batch);
+                batch.Clear();
+            }
+            if (!(++ctr % kUpgradeLogInterval))
+                Log() << "Upgraded " << ctr << " " << what << " ...";
+        }
+        if (!it->status().ok())
+            throw DatabaseError(QString("Error iterating over the %1 db: %2").arg(DBName(db)).arg(StatusString(it->status())));
+        if (batch.Count())
+            GenericBatchWrite(db, batch);
+        return ret;
+    }
+}
+
+void Storage::upgradeDB(uint32_t fromVersion)
+{
+    Log() << "Upgrading database from format version " << fromVersion << " to " << Meta::kCurrentVersion
+          << ", this may take a while ...";
+    const auto t0 = Util::getTimeNS();
+    setDirty(true); // if we are killed while the upgrade is in progress the db is a mix of formats and is unusable
+
+    for (auto version = fromVersion; version < Meta::kCurrentVersion; ++version) {
+        switch (version) {
+        case 0x1: {
+            // v1 -> v2: scripthash_history values go from fixed 6-byte txNums to delta-varints, and undo infos go
+            // from fixed-size records with full hashes to varints with a deduplicated hashX table.
+            const auto [shBefore, shAfter] = UpgradeRewriteAll(p->db.shist.get(), "scripthash histories", [](const QByteArray &v) {
+                bool ok;
+                const QByteArray ret = Serialize(DeserializeTxNumVecV1(v, &ok));
+                if (!ok || ret.isEmpty())
+                    throw DatabaseFormatError("Unable to upgrade a scripthash history entry: the existing data is corrupt");
+                return ret;
+            });
+            // every value has now been rewritten with a Put, so no v1 merge operands can be merged from here on
+            p->db.concatOperator->legacyFixedWidth = false;
+            const auto [undoBefore, undoAfter] = UpgradeRewriteAll(p->db.undo.get(), "undo infos", [](const QByteArray &v) {
+                bool ok;
+                const QByteArray ret = Serialize(Deserialize<UndoInfo>(v, &ok)); // Deserialize accepts the v1 format
+                if (!ok || ret.isEmpty())
+                    throw DatabaseFormatError("Unable to upgrade an undo info entry: the existing data is corrupt");
+                return ret;
+            });
+            Log() << "Upgraded scripthash_history: " << QString::number(shBefore / 1e6, 'f', 1) << " MB -> "
+                  << QString::number(shAfter / 1e6, 'f', 1) << " MB, undo: " << QString::number(undoBefore / 1e6, 'f', 1)
+                  << " MB -> " << QString::number(undoAfter / 1e6, 'f', 1) << " MB; compacting ...";
+            // reclaim the space taken by the old values now, rather than at some point in the future
+            for (auto *db : { p->db.shist.get(), p->db.undo.get() })
+                if (auto st = db->CompactRange(rocksdb::CompactRangeOptions(), nullptr, nullptr); !st.ok())
+                    throw DatabaseError(QString("Error compacting %1 db: %2").arg(DBName(db)).arg(StatusString(st)));
+            break;
+        }
+        case 0x2: {
+            // v2 -> v3: undo db keys go from native-endian to big-endian heights (see UndoKey). The undo db only ever
+            // holds ~configuredUndoDepth() entries, so we just read them all in and rewrite them in 1 batch.
+            rocksdb::DB *db = p->db.undo.get();
+            std::vector<std::pair<QByteArray, QByteArray>> kvs;
+            {
+                std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(p->db.defReadOpts));
+                if (!it) throw DatabaseError("Unable to obtain an iterator to the undo db");
+                for (it->SeekToFirst(); it->Valid(); it->Next()) {
+                    if (it->key().size() != sizeof(uint32_t))
+                        throw DatabaseFormatError("Unexpected key in undo database. We expect only 32-bit unsigned ints!");
+                    kvs.emplace_back(DeepCpy(it->key().data(), it->key().size()), DeepCpy(it->value().data(), it->value().size()));
+                }
+                if (!it->status().ok())
+                    throw DatabaseError(QString("Error iterating over the undo db: %1").arg(StatusString(it->status())));
+            }
+            // deletes come first in the batch so that an old key that happens to equal some new key is not lost
+            rocksdb::WriteBatch batch;
+            for (const auto & [k, v] : kvs)
+                GenericBatchDelete(batch, k);
+            for (const auto & [k, v] : kvs)
+                GenericBatchPut(batch, UndoKey(DeserializeScalar<uint32_t>(k)), v);
+            GenericBatchWrite(db, batch, "Error rewriting the undo db keys");
+            Log() << "Upgraded " << kvs.size() << " undo " << Util::Pluralize("key", kvs.size());
+            break;
+        }
+        default:
+            throw InternalError(QString("Don't know how to upgrade the database from version %1. FIXME!").arg(version));
+        }
+    }
+
+    {
+        LockGuard l(p->metaLock);
+        p->meta.version = Meta::kCurrentVersion;
+        saveMeta_impl();
+    }
+    setDirty(false);
+    Log() << "Database upgrade completed in " << QString::number((Util::getTimeNS() - t0) / 1e9, 'f', 1) << " secs";
+}
+
 struct Storage::UTXOBatch::P {
     rocksdb::WriteBatch utxosetBatch; ///< batch writes/deletes end up in the utxoset db (keyed off TXO)
     rocksdb::WriteBatch shunspentBatch; ///< batch writes/deletes end up in the shunspent db (keyed off HashX+CompactTXO)
@@ -1074,8 +2230,8 @@ void Storage::issueUpdates(UTXOBatch &b)
     if (UNLIKELY(b.p->defunct))
         throw InternalError("Misuse of Storage::issueUpdates. Cannot issue the same updates using the same context more than once. FIXME!");
     assert(bool(p->db.utxoset) && bool(p->db.shunspent));
-    GenericBatchWrite(p->db.utxoset.get(), b.p->utxosetBatch, errMsg1, p->db.defWriteOpts); // may throw
-    GenericBatchWrite(p->db.shunspent.get(), b.p->shunspentBatch, errMsg2, p->db.defWriteOpts); // may throw
+    GenericBatchWrite(p->db.utxoset.get(), b.p->utxosetBatch, errMsg1, p->db.blockWriteOpts); // may throw
+    GenericBatchWrite(p->db.shunspent.get(), b.p->shunspentBatch, errMsg2, p->db.blockWriteOpts); // may throw
     p->utxoCt += b.p->addCt - b.p->rmCt; // tally up adds and deletes
     b.p->defunct = true;
 }
@@ -1138,6 +2294,35 @@ std::optional<TXOInfo> Storage::utxoGetFromDB(const TXO &txo, bool throwIfMissin
     return GenericDBGet<TXOInfo>(p->db.utxoset.get(), txo, !throwIfMissing, errMsgPrefix, false, p->db.defReadOpts);
 }
 
+std::vector<std::optional<TXOInfo>> Storage::utxosGetFromDB(const std::vector<TXO> &txos)
+{
+    assert(bool(p->db.utxoset));
+    std::vector<std::optional<TXOInfo>> ret(txos.size());
+    if (txos.empty()) return ret;
+    std::vector<QByteArray> keyBytes;
+    std::vector<rocksdb::Slice> keys;
+    keyBytes.reserve(txos.size());
+    keys.reserve(txos.size());
+    for (const auto & txo : txos) {
+        keyBytes.push_back(Serialize(txo));
+        keys.push_back(ToSlice(keyBytes.back()));
+    }
+    std::vector<std::string> values;
+    const auto statuses = p->db.utxoset->MultiGet(p->db.defReadOpts, keys, &values);
+    for (size_t i = 0; i < txos.size(); ++i) {
+        const auto & status = statuses[i];
+        if (status.IsNotFound())
+            continue;
+        if (UNLIKELY(!status.ok()))
+            throw DatabaseError(QString("Failed to read a utxo from the utxo db: %1").arg(StatusString(status)));
+        bool ok;
+        ret[i] = Deserialize<TXOInfo>(FromSlice(values[i]), &ok);
+        if (UNLIKELY(!ok))
+            throw DatabaseSerializationError(QString("Failed to deserialize a utxo from the utxo db for %1").arg(txos[i].toString()));
+    }
+    return ret;
+}
+
 int64_t Storage::utxoSetSize() const { return p->utxoCt; }
 double Storage::utxoSetSizeMiB() const {
     constexpr int64_t elemSize = TXO::serSize() + TXOInfo::serSize();
@@ -1163,13 +2348,11 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
         // note we don't reserve here -- we will reserve at the end when we run through the hashXAggregated set one final time...
 
     // take all locks now.. since this is a Big Deal. TODO: add more locks here?
-    std::scoped_lock guard(p->blocksLock, p->headerVerifierLock, p->blkInfoLock, p->mempoolLock);
-
-    if (notify)
-        // mark ALL of mempool for notify so we can properly detect drops that weren't in block but also disappeared from mempool
-        notify->merge(Util::keySet<NotifySet>(p->mempool.hashXTxs));
-
-    p->mempool.clear(); // just make sure the mempool is clean
+    // Note: mempoolLock is only taken at the end, when the mempool is cleared and the new ReadView is published, so
+    // that queries (which take it) aren't stalled for the whole commit.
+    std::scoped_lock guard(p->blocksLock, p->headerVerifierLock, p->blkInfoLock);
+    const auto tCommit0 = Util::getTimeNS();
+    const auto [stall0, compact0] = p->stallAndCompactMicros();
 
     const auto verifUndo = p->headerVerifier; // keep a copy of verifier state for undo purposes in case this fails
     // This object ensures that if an exception is thrown while we are in the below code, we undo the header verifier
@@ -1178,6 +2361,12 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
 
     // code in the below block may throw -- exceptions are propagated out to caller.
     {
+        // Blocks that are too far from the tip to get undo info are written in initial sync mode (if enabled).
+        if (!saveUndo && options->db.initialSyncMode && !p->initialSync.active)
+            beginInitialSync(); // may throw
+        else if (saveUndo && p->initialSync.active)
+            endInitialSync(true); // may throw
+
         const auto blockTxNum0 = p->txNumNext.load();
 
         // Verify header chain makes sense (by checking hashes, using the shared header verifier)
@@ -1193,7 +2382,8 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
             rawHeader = p->headerVerifier.lastHeaderProcessed().second;
         }
 
-        setDirty(true); // <--  no turning back. if the app crashes unexpectedly while this is set, on next restart it will refuse to run and insist on a clean resynch.
+        if (!p->initialSync.active) // (in initial sync mode it is already set, see checkpointInitialSync)
+            setDirty(true); // <--  no turning back. if the app crashes unexpectedly while this is set, on next restart it will refuse to run and insist on a clean resynch.
 
         {  // add txnum -> txhash association to the TxNumsFile...
             auto batch = p->txNumsFile->beginBatchAppend(); // may throw if io error in c'tor here.
@@ -1326,7 +2516,7 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
 
         {
             // now.. update the txNumsInvolvingHashX to be offset from txNum0 for this block, and save history to db table
-            // history is hashX -> TxNumVec (serialized) as a serities of 6-bytes txNums in blockchain order as they appeared.
+            // history is hashX -> TxNumVec (serialized) as a series of delta-varint txNums in blockchain order as they appeared.
             if (notify)
                 // first, reserve space for notifications
                 notify->reserve(notify->size() + ppb->hashXAggregated.size());
@@ -1342,7 +2532,7 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                     throw DatabaseError(QString("batch merge fail for hashX %1, block height %2: %3")
                                         .arg(QString(hashX.toHex())).arg(ppb->height).arg(StatusString(st)));
             }
-            if (auto st = p->db.shist->Write(p->db.defWriteOpts, &batch) ; !st.ok())
+            if (auto st = p->db.shist->Write(p->db.blockWriteOpts, &batch) ; !st.ok())
                 throw DatabaseError(QString("batch merge fail for block height %1: %2")
                                     .arg(ppb->height).arg(StatusString(st)));
         }
@@ -1362,11 +2552,11 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
 
             const auto & blkInfo = p->blkInfos.back();
 
-            p->blkInfosByTxNum[blkInfo.txNum0] = unsigned(p->blkInfos.size()-1);
+            p->txNum0IndexAppend(blkInfo.txNum0, blkInfo.nTx);
 
-            // save BlkInfo to db
-            static const QString blkInfoErrMsg("Error writing BlkInfo to db");
-            GenericDBPut(p->db.blkinfo.get(), uint32_t(ppb->height), blkInfo, blkInfoErrMsg, p->db.defWriteOpts);
+            // save BlkInfo to the blkinfos file
+            if (QString err; !p->blkInfosFile->appendRecord(Serialize(blkInfo), true, &err))
+                throw DatabaseError(QString("Error writing BlkInfo to the blkinfos file: %1").arg(err));
 
             if (undo) {
                 // save blkInfo to undo information, if in saveUndo mode
@@ -1381,7 +2571,7 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
             undo->scriptHashes = Util::keySet<decltype (undo->scriptHashes)>(ppb->hashXAggregated);
             static const QString errPrefix("Error saving undo info to undo db");
 
-            GenericDBPut(p->db.undo.get(), uint32_t(ppb->height), *undo, errPrefix, p->db.defWriteOpts); // save undo to db
+            GenericDBPut(p->db.undo.get(), UndoKey(ppb->height), *undo, errPrefix, p->db.defWriteOpts); // save undo to db
             if (ppb->height < p->earliestUndoHeight) {
                 // remember earliest for delete clause below...
                 p->earliestUndoHeight = ppb->height;
@@ -1396,6 +2586,7 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                 auto undo2 = Deserialize<UndoInfo>(ba, &ok);
                 ba.fill('z'); // ensure no shallow copies of buffer exist in deserialized object. if they do below tests will fail
                 FatalAssert(ok && undo2.isValid(), "Deser of undo info failed!");
+                ResolveUndoTxHashes(undo2, *p->txNumsFile); // txhashes for this block were already appended above
                 Debug() << "Undo info 2: " << undo2.toDebugString();
                 Debug() << "Undo info 1 == undo info 2: " << (*undo == undo2);
             } else {
@@ -1407,18 +2598,11 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                         << ", in " << QString::number(elapsedms, 'f', 2) << " msec.";
             }
         }
-        // Expire old undos >10 blocks ago to keep the db tidy.  We only do this if we know there is an old
-        // undo for said height in db.
-        if (const auto expireUndoHeight = int(ppb->height) - int(configuredUndoDepth());
-                expireUndoHeight >= 0 && unsigned(expireUndoHeight) >= p->earliestUndoHeight) {
-            // FIXME -- this runs for every block in between the last undo save and current tip.
-            // If the node was off for a while then restarted this just hits the db with useless deletes for non-existant
-            // keys as we catch up.  It's not the end of the world, as each call here is on the order of microseconds..
-            // but perhaps we need to see about fixing this to not do that.
-            static const QString errPrefix("Error deleting old/stale undo info from undo db");
-            GenericDBDelete(p->db.undo.get(), uint32_t(expireUndoHeight), errPrefix, p->db.defWriteOpts);
-            p->earliestUndoHeight = unsigned(expireUndoHeight + 1);
-            if constexpr (debugPrt) Debug() << "Deleted undo for block " << expireUndoHeight << ", earliest now " << p->earliestUndoHeight.load();
+        // Expire old undos more than configuredUndoDepth() blocks ago to keep the db tidy. We only do this if we know
+        // there are at least kUndoPruneInterval expired undos in the db, and we delete them all in one go.
+        if (const auto expireUndoHeight = int64_t(ppb->height) - int64_t(configuredUndoDepth());
+                expireUndoHeight >= 0 && expireUndoHeight + 1 >= int64_t(p->earliestUndoHeight) + p->kUndoPruneInterval) {
+            pruneUndos(unsigned(expireUndoHeight));
         }
 
         appendHeader(rawHeader, ppb->height);
@@ -1429,30 +2613,705 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
         }
 
         saveUtxoCt();
-        setDirty(false);
+        if (auto & is = p->initialSync; is.active) {
+            // the dirty flag stays set until the next checkpoint
+            ++is.nBlocks;
+            if (++is.blocksSinceCheckpoint >= options->db.initialSyncCheckpointInterval)
+                checkpointInitialSync(); // may throw
+        } else
+            setDirty(false);
 
-        undoVerifierOnScopeEnd.disable(); // indicate to the "Defer" object declared at the top of this function that it shouldn't undo anything anymore as we are happy now with the db state now.
-    } /// release locks
+        {
+            // Record how long this block took to commit, and how much of that was spent stalled on (or concurrent
+            // with) compactions.
+            auto & cm = p->compactionMonitor;
+            const auto [stall1, compact1] = p->stallAndCompactMicros();
+            const Pvt::CompactionMonitor::Block b{ ppb->height, uint64_t(Util::getTimeNS() - tCommit0) / 1000,
+                                              stall1 - stall0, compact1 - compact0 };
+            ++cm.nBlocks;
+            if (b.stallMicros) {
+                ++cm.nStalledBlocks;
+                cm.stallMicros += b.stallMicros;
+                if (b.stallMicros > cm.maxStallMicros) cm.maxStallMicros = b.stallMicros;
+                DebugM("Block ", b.height, ": writes stalled for ", QString::number(b.stallMicros / 1e3, 'f', 1), " msec");
+            }
+            cm.compactMicros += b.compactMicros;
+            std::unique_lock g(cm.recentLock);
+            cm.recentBlocks.push_back(b);
+            while (cm.recentBlocks.size() > cm.kMaxRecentBlocks)
+                cm.recentBlocks.pop_front();
+        }
 
-    // now, do notifications
+        {
+            // Clear the mempool and publish the view of the new block together, so that queries (which grab the
+            // view while holding the mempool lock) always see a mempool that goes with their view.
+            ExclusiveLockGuard g(p->mempoolLock);
+            if (notify)
+                // mark ALL of mempool for notify so we can properly detect drops that weren't in block but also disappeared from mempool
+                notify->merge(p->mempool.hashXSet<NotifySet>());
+            p->mempool.clear(); // just make sure the mempool is clean
+            p->publishReadView();
+        }
+
+        undoVerifierOnScopeEnd.disable(); // indicate to the "Defer" object declared at the top of this function that it shouldn't undo anything anymore as we are happy now with the db state now.
+    } /// release locks
+
+    // now, do notifications
     if (notify && subsmgr && !notify->empty())
         subsmgr->enqueueNotifications(std::move(*notify));
 }
 
-BlockHeight Storage::undoLatestBlock(bool notifySubs)
+namespace {
+    const QString kWarmCachesFileName = "warm_caches";
+}
+
+void Storage::saveWarmCaches()
+{
+    QVector<quint64> txNums;
+    QVector<quint32> heights;
+    for (const auto n : p->lruNum2Hash.keys())
+        txNums.push_back(n);
+    for (const auto h : p->lruHeight2Hashes_BitcoindMemOrder.keys())
+        heights.push_back(h);
+    QFile f(options->datadir + QDir::separator() + kWarmCachesFileName);
+    if (!f.open(QIODevice::WriteOnly|QIODevice::Truncate)) {
+        Warning() << "Unable to save the cache keys to " << f.fileName() << ": " << f.errorString();
+        return;
+    }
+    QDataStream ds(&f);
+    ds << p->warmCaches.kMagic << p->warmCaches.kVersion << txNums << heights;
+    if (ds.status() != QDataStream::Status::Ok) {
+        Warning() << "Unable to save the cache keys to " << f.fileName();
+        f.remove();
+        return;
+    }
+    Debug() << "Saved the cache keys for a warm restart (" << txNums.size() << " tx hashes, " << heights.size() << " blocks)";
+}
+
+namespace {
+    const QString kMempoolFileName = "mempool.dat";
+    constexpr quint32 kMempoolFileMagic = 0x3e3b01a0, kMempoolFileVersion = 1;
+}
+
+void Storage::saveMempool()
+{
+    QFile f(options->datadir + QDir::separator() + kMempoolFileName);
+    const auto [tipHeight, tipHash] = latestTip();
+    auto [mempool, lock] = this->mempool(); // shared lock
+    if (mempool.txs.empty() || tipHeight < 0) {
+        if (f.exists()) f.remove();
+        return;
+    }
+    if (!f.open(QIODevice::WriteOnly|QIODevice::Truncate)) {
+        Warning() << "Unable to save the mempool to " << f.fileName() << ": " << f.errorString();
+        return;
+    }
+    QDataStream ds(&f);
+    ds << kMempoolFileMagic << kMempoolFileVersion << qint32(tipHeight) << tipHash;
+    ds << quint32(mempool.hashXTable.size());
+    for (const auto & hx : mempool.hashXTable)
+        ds << hx;
+    ds << quint32(mempool.txs.size());
+    for (const auto & [txid, tx] : mempool.txs) {
+        ds << tx->hash << quint32(tx->sizeBytes) << qint64(tx->fee / bitcoin::Amount::satoshi()) << tx->hasUnconfirmedParentTx;
+        ds << quint32(tx->txos.size());
+        for (const auto & out : tx->txos)
+            ds << qint64(out.amount / bitcoin::Amount::satoshi()) << quint32(out.hashXIdx) << out.spentInMempool;
+        ds << quint32(tx->spends.size());
+        for (const auto & spend : tx->spends)
+            ds << quint32(spend.hashXIdx) << spend.confirmed << spend.txo.prevoutHash << quint16(spend.txo.prevoutN)
+               << qint64(spend.amount / bitcoin::Amount::satoshi());
+    }
+    if (ds.status() != QDataStream::Status::Ok) {
+        Warning() << "Unable to save the mempool to " << f.fileName();
+        f.remove();
+        return;
+    }
+    Debug() << "Saved " << mempool.txs.size() << Util::Pluralize(" mempool tx", mempool.txs.size()) << " for the next startup";
+}
+
+void Storage::loadMempool()
+{
+    QFile f(options->datadir + QDir::separator() + kMempoolFileName);
+    if (!f.exists())
+        return;
+    Defer removeFile([&f]{ f.remove(); }); // it is only valid for the run right after the one that saved it
+    if (!f.open(QIODevice::ReadOnly))
+        return;
+    const auto t0 = Util::getTimeSecs();
+    QDataStream ds(&f);
+    quint32 magic{}, version{};
+    qint32 height{};
+    QByteArray tipHash;
+    ds >> magic >> version >> height >> tipHash;
+    if (ds.status() != QDataStream::Status::Ok || magic != kMempoolFileMagic || version != kMempoolFileVersion)
+        return;
+    if (const auto tip = latestTip(); tip.first != height || tip.second != tipHash) {
+        Debug() << "Saved mempool is for block " << height << ", but the tip is now " << tip.first << ", ignoring it";
+        return;
+    }
+    Mempool mp;
+    try {
+        // The counts below come from the file, so we check them against the bytes left in it before allocating
+        // anything (each item takes at least `minItemBytes` bytes on disk), lest a corrupt file make us try to
+        // allocate some absurd amount.
+        const auto checkCount = [&f](quint32 n, qint64 minItemBytes) {
+            if (qint64(n) * minItemBytes > f.bytesAvailable())
+                throw Exception(QString("item count %1 exceeds the size of the file").arg(n));
+        };
+        constexpr qint64 kMinHashXBytes = 4 + HashLen, kMinTxBytes = (4 + HashLen) + 4 + 8 + 1 + 4 + 4,
+                         kMinTxoBytes = 8 + 4 + 1, kMinSpendBytes = 4 + 1 + (4 + HashLen) + 2 + 8;
+        quint32 n{};
+        ds >> n;
+        checkCount(n, kMinHashXBytes);
+        mp.hashXTable.reserve(n);
+        for (quint32 i = 0; i < n && ds.status() == QDataStream::Status::Ok; ++i) {
+            HashX hx;
+            ds >> hx;
+            mp.hashXTable.push_back(hx);
+        }
+        ds >> n;
+        checkCount(n, kMinTxBytes);
+        mp.txs.reserve(n);
+        for (quint32 i = 0; i < n && ds.status() == QDataStream::Status::Ok; ++i) {
+            auto tx = std::make_shared<Mempool::Tx>();
+            quint32 sizeBytes{}, nItems{};
+            qint64 fee{};
+            ds >> tx->hash >> sizeBytes >> fee >> tx->hasUnconfirmedParentTx;
+            tx->sizeBytes = sizeBytes;
+            tx->fee = fee * bitcoin::Amount::satoshi();
+            ds >> nItems;
+            checkCount(nItems, kMinTxoBytes);
+            tx->txos.resize(nItems);
+            for (auto & out : tx->txos) {
+                qint64 amt{};
+                quint32 idx{};
+                ds >> amt >> idx >> out.spentInMempool;
+                out.amount = amt * bitcoin::Amount::satoshi();
+                out.hashXIdx = idx;
+            }
+            ds >> nItems;
+            checkCount(nItems, kMinSpendBytes);
+            tx->spends.resize(nItems);
+            for (auto & spend : tx->spends) {
+                qint64 amt{};
+                quint32 idx{};
+                quint16 prevN{};
+                ds >> idx >> spend.confirmed >> spend.txo.prevoutHash >> prevN >> amt;
+                spend.hashXIdx = idx;
+                spend.txo.prevoutN = prevN;
+                spend.amount = amt * bitcoin::Amount::satoshi();
+            }
+            if (tx->hash.length() != HashLen)
+                break;
+            mp.txs.emplace(tx->hash, std::move(tx));
+        }
+        if (ds.status() != QDataStream::Status::Ok || mp.txs.size() != n || !mp.rebuildIndexes())
+            throw Exception("unexpected data");
+    } catch (const std::exception &e) {
+        Warning() << "Saved mempool in " << f.fileName() << " is corrupt (" << e.what() << "), ignoring it";
+        return;
+    }
+    const auto nTxs = mp.txs.size(), nHashXs = mp.numHashXs();
+    {
+        auto [mempool, lock] = mutableMempool();
+        mp.generation = mempool.generation + 1;
+        mempool = std::move(mp);
+    }
+    refreshMempoolHistogram();
+    Log() << "Restored " << nTxs << Util::Pluralize(" mempool tx", nTxs) << " involving " << nHashXs
+          << Util::Pluralize(" address", nHashXs) << " from the last run in "
+          << QString::number((Util::getTimeSecs() - t0) * 1e3, 'f', 1) << " msec";
+}
+
+void Storage::prefetchWarmCaches()
 {
-    BlockHeight prevHeight{0};
+    QVector<quint64> txNums;
+    QVector<quint32> heights;
+    {
+        QFile f(options->datadir + QDir::separator() + kWarmCachesFileName);
+        if (!f.exists())
+            return;
+        if (f.open(QIODevice::ReadOnly)) {
+            QDataStream ds(&f);
+            quint32 magic{}, version{};
+            ds >> magic >> version;
+            if (magic == p->warmCaches.kMagic && version == p->warmCaches.kVersion)
+                ds >> txNums >> heights;
+            if (ds.status() != QDataStream::Status::Ok) {
+                txNums.clear();
+                heights.clear();
+            }
+            f.close();
+        }
+        f.remove(); // it is only valid for the run right after the one that saved it
+    }
+    // Sort the keys so that each chunk below reads the txnum2txhash file sequentially, and drop any that are no
+    // longer valid (e.g. if the datadir was rewound while we were down).
+    const TxNum txNumNext = p->txNumNext;
+    const auto nBlocks = p->readView()->txNum0Index->size;
+    std::sort(txNums.begin(), txNums.end());
+    txNums.erase(std::lower_bound(txNums.begin(), txNums.end(), txNumNext), txNums.end());
+    std::sort(heights.begin(), heights.end());
+    heights.erase(std::lower_bound(heights.begin(), heights.end(), nBlocks), heights.end());
+    if (txNums.isEmpty() && heights.isEmpty())
+        return;
+
+    auto & wc = p->warmCaches;
+    wc.tStart = Util::getTimeSecs();
+    wc.nNum2Hash = txNums.size();
+    wc.nHeight2Hashes = heights.size();
+    const int chunk = wc.kChunkSize;
+    wc.pendingChunks = (txNums.size() + chunk - 1) / chunk + (heights.size() + chunk - 1) / chunk;
+    const auto chunkDone = [this] {
+        if (auto & wc = p->warmCaches; --wc.pendingChunks == 0) {
+            wc.tEnd = Util::getTimeSecs();
+            Log() << "Warm restart: prefetched " << wc.nNum2Hash.load() << " tx hashes and " << wc.nHeight2Hashes.load()
+                  << " blocks into the caches in " << QString::number(wc.tEnd - wc.tStart, 'f', 1) << " secs";
+        }
+    };
+    for (int i = 0; i < txNums.size(); i += chunk) {
+        ::AppThreadPool()->submitWork(this, [this, keys = txNums.mid(i, chunk), chunkDone] {
+            SharedLockGuard g(p->rewindLock); // so that a rewind can't truncate txnum2txhash from underneath us
+            // read each run of consecutive txNums with a single read
+            for (int j = 0; j < keys.size(); ) {
+                int k = j + 1;
+                while (k < keys.size() && keys[k] == keys[k-1] + 1) ++k;
+                QString err;
+                const auto hashes = p->txNumsFile->readRecords(keys[j], size_t(k - j), &err);
+                for (size_t n = 0; n < hashes.size(); ++n)
+                    p->lruNum2Hash.insert(keys[j] + n, hashes[n], p->lruNum2HashSizeCalc());
+                j = k;
+            }
+            chunkDone();
+        }, {}, [chunkDone](const QString &) { chunkDone(); }, -1);
+    }
+    for (int i = 0; i < heights.size(); i += chunk) {
+        ::AppThreadPool()->submitWork(this, [this, keys = heights.mid(i, chunk), chunkDone] {
+            for (const auto h : keys)
+                txHashesForBlockInBitcoindMemoryOrder(h); // fills the cache
+            chunkDone();
+        }, {}, [chunkDone](const QString &) { chunkDone(); }, -1);
+    }
+}
+
+namespace {
+    /// The tables that make up a snapshot: the db directories and RecordFiles, by their name in the datadir.
+    const QStringList kSnapshotTables = { "meta", "utxoset", "scripthash_history", "scripthash_unspent", "undo",
+                                          "headers", "txnum2txhash", "blkinfos" };
+    const QString kSnapshotManifestName = "manifest.json";
+    constexpr int kSnapshotFormat = 2; ///< bump this if the snapshot layout or manifest changes incompatibly
+
+    /// Returns the files making up snapshot table `path`: the file itself if it is a file, or all of the files in it
+    /// (sorted by name) if it is a directory.
+    QFileInfoList SnapshotTableFiles(const QString &path) {
+        const QFileInfo fi(path);
+        if (fi.isDir())
+            return QDir(path).entryInfoList(QDir::Files|QDir::Hidden, QDir::Name);
+        else if (fi.isFile())
+            return { fi };
+        return {};
+    }
+
+    /// Returns the hex-encoded SHA256 of snapshot table `path` (hashing each file's name, size, and contents, in name
+    /// order) and its total size in bytes. Throws on error.
+    std::pair<QString, qint64> SnapshotHashTable(const QString &path) {
+        const auto files = SnapshotTableFiles(path);
+        if (files.isEmpty())
+            throw DatabaseError(QString("Snapshot: \"%1\" is missing or empty").arg(path));
+        QCryptographicHash hasher(QCryptographicHash::Sha256);
+        qint64 bytes = 0;
+        for (const auto & fi : files) {
+            QFile f(fi.filePath());
+            if (!f.open(QIODevice::ReadOnly))
+                throw DatabaseError(QString("Snapshot: unable to open \"%1\": %2").arg(fi.filePath(), f.errorString()));
+            hasher.addData(fi.fileName().toUtf8());
+            hasher.addData(QByteArray::number(f.size()));
+            if (!hasher.addData(&f))
+                throw DatabaseError(QString("Snapshot: error reading \"%1\": %2").arg(fi.filePath(), f.errorString()));
+            bytes += f.size();
+        }
+        return { QString::fromLatin1(hasher.result().toHex()), bytes };
+    }
+
+    /// Copies snapshot table `src` (a file, or a directory of files) to `dest`, which must not exist. Throws on error.
+    void SnapshotCopyTable(const QString &src, const QString &dest) {
+        if (const QFileInfo fi(src); fi.isDir()) {
+            if (!QDir().mkpath(dest))
+                throw DatabaseError(QString("Snapshot: unable to create directory \"%1\"").arg(dest));
+            for (const auto & f : SnapshotTableFiles(src))
+                if (!QFile::copy(f.filePath(), dest + QDir::separator() + f.fileName()))
+                    throw DatabaseError(QString("Snapshot: unable to copy \"%1\" to \"%2\"").arg(f.filePath(), dest));
+        } else if (!QFile::copy(src, dest))
+            throw DatabaseError(QString("Snapshot: unable to copy \"%1\" to \"%2\"").arg(src, dest));
+    }
+}
+
+QVariantMap Storage::exportSnapshot(const QString &dirName) const
+{
+    const auto t0 = Util::getTimeNS();
+    if (const QDir dir(dirName); dir.exists() && !dir.isEmpty())
+        throw BadArgs(QString("Snapshot: directory \"%1\" already exists and is not empty").arg(dirName));
+    if (!QDir().mkpath(dirName))
+        throw BadArgs(QString("Snapshot: unable to create directory \"%1\"").arg(dirName));
+    const QString prefix = dirName + QDir::separator();
+    Log() << "Snapshot: exporting to \"" << dirName << "\" ...";
+
+    QVariantMap manifest;
+    manifest["format"] = kSnapshotFormat;
+    manifest["db_version"] = Meta::kCurrentVersion;
+    manifest["chain"] = getChain(); // must be called before we take blocksLock below (metaLock comes first)
+    {
+        // Hold the blocks lock for the duration so that every table and RecordFile is at the same height.
+        std::shared_lock g(p->blocksLock);
+        const auto [height, hash] = latestTip();
+        if (height < 0)
+            throw Exception("Snapshot: the database is empty, there is nothing to export");
+        for (const auto ptr : { &p->db.meta, &p->db.utxoset, &p->db.shist, &p->db.shunspent, &p->db.undo, }) {
+            rocksdb::DB *db = ptr->get();
+            rocksdb::Checkpoint *cp = nullptr;
+            auto st = rocksdb::Checkpoint::Create(db, &cp);
+            const std::unique_ptr<rocksdb::Checkpoint> cpGuard(cp);
+            if (st.ok())
+                st = cp->CreateCheckpoint((prefix + DBName(db)).toStdString()); // flushes memtables, hard-links if possible
+            if (!st.ok())
+                throw DatabaseError(QString("Snapshot: error creating a checkpoint of the %1 db: %2").arg(DBName(db), StatusString(st)));
+        }
+        for (auto *rf : { p->headersFile.get(), p->txNumsFile.get(), p->blkInfosFile.get() }) {
+            const QFileInfo fi(rf->fileName());
+            if (!rf->flush() || !QFile::copy(fi.filePath(), prefix + fi.fileName()))
+                throw DatabaseError(QString("Snapshot: unable to copy \"%1\"").arg(fi.filePath()));
+        }
+        manifest["height"] = height;
+        manifest["hash"] = QString::fromLatin1(Util::ToHexFast(hash));
+        manifest["tx_num_next"] = qulonglong(p->txNumNext.load());
+        manifest["utxo_count"] = qlonglong(p->utxoCt.load());
+    }
+    // the files are now private copies, so we hash them with no locks held
+    QVariantMap tables;
+    qint64 total = 0;
+    for (const auto & name : kSnapshotTables) {
+        const auto [hash, bytes] = SnapshotHashTable(prefix + name);
+        tables[name] = QVariantMap{ { "sha256", hash }, { "bytes", bytes } };
+        total += bytes;
+    }
+    manifest["tables"] = tables;
+    QFile f(prefix + kSnapshotManifestName);
+    if (!f.open(QIODevice::WriteOnly|QIODevice::Truncate|QIODevice::Text) || f.write(Util::Json::toString(manifest).toUtf8()) < 0)
+        throw DatabaseError(QString("Snapshot: unable to write \"%1\": %2").arg(f.fileName(), f.errorString()));
+    Log() << "Snapshot: exported height " << manifest["height"].toInt() << " (" << QString::number(total / 1e6, 'f', 1)
+          << " MB) in " << QString::number((Util::getTimeNS() - t0) / 1e9, 'f', 1) << " secs";
+    return manifest;
+}
+
+QVariantMap Storage::importSnapshot(const QString &dirName)
+{
+    const auto t0 = Util::getTimeNS();
+    const QString prefix = dirName + QDir::separator(), dataPrefix = options->datadir + QDir::separator();
+    Log() << "Snapshot: importing from \"" << dirName << "\" ...";
+    QVariantMap manifest;
+    try {
+        manifest = Util::Json::parseFile(prefix + kSnapshotManifestName).toMap();
+    } catch (const std::exception &e) {
+        throw BadArgs(QString("Snapshot: unable to read %1: %2").arg(prefix + kSnapshotManifestName, e.what()));
+    }
+    if (manifest.value("format").toInt() != kSnapshotFormat)
+        throw BadArgs(QString("Snapshot: unsupported snapshot format: %1").arg(manifest.value("format").toString()));
+    if (const auto v = manifest.value("db_version").toUInt(); v < Meta::kMinUpgradeableVersion || v > Meta::kCurrentVersion)
+        throw BadArgs(QString("Snapshot: incompatible database version: %1").arg(v));
+    for (const auto & name : kSnapshotTables)
+        if (QFileInfo::exists(dataPrefix + name))
+            throw BadArgs(QString("Snapshot: the datadir already contains \"%1\". A snapshot may only be imported into an"
+                                  " empty datadir.").arg(name));
+
+    // verify every table against the manifest before we copy anything
+    const auto tables = manifest.value("tables").toMap();
+    for (const auto & name : kSnapshotTables) {
+        const auto expected = tables.value(name).toMap().value("sha256").toString();
+        const auto [hash, bytes] = SnapshotHashTable(prefix + name);
+        if (expected.isEmpty() || hash != expected)
+            throw DatabaseFormatError(QString("Snapshot: \"%1\" does not match the manifest. The snapshot is corrupt or"
+                                              " incomplete.").arg(name));
+        DebugM("Snapshot: verified ", name, " (", bytes, " bytes)");
+    }
+
+    // Copy to a staging directory in the datadir first, and only move the tables into place once they have all been
+    // copied, so that an interrupted import doesn't leave a partial database behind.
+    const QString staging = dataPrefix + "snapshot_import.tmp", stagingPrefix = staging + QDir::separator();
+    QDir(staging).removeRecursively(); // in case a previous import was interrupted
+    if (!QDir().mkpath(staging))
+        throw DatabaseError(QString("Snapshot: unable to create directory \"%1\"").arg(staging));
+    for (const auto & name : kSnapshotTables)
+        SnapshotCopyTable(prefix + name, stagingPrefix + name);
+    for (const auto & name : kSnapshotTables)
+        if (!QDir().rename(stagingPrefix + name, dataPrefix + name))
+            throw DatabaseError(QString("Snapshot: unable to move \"%1\" into the datadir").arg(name));
+    QDir(staging).removeRecursively();
+    Log() << "Snapshot: copied into the datadir in " << QString::number((Util::getTimeNS() - t0) / 1e9, 'f', 1) << " secs";
+    return manifest;
+}
+
+void Storage::checkImportedSnapshot(const QVariantMap &manifest)
+{
+    bool ok;
+    const unsigned height = manifest.value("height").toUInt(&ok);
+    const auto [tip, tipHash] = latestTip();
+    if (!ok || tip != int(height) || QString::fromLatin1(Util::ToHexFast(tipHash)) != manifest.value("hash").toString())
+        throw DatabaseFormatError(QString("Snapshot: the imported header chain ends at height %1 (%2), which does not match"
+                                          " the manifest. Delete the datadir and try again.")
+                                  .arg(tip).arg(QString::fromLatin1(Util::ToHexFast(tipHash))));
+    if (p->txNumNext != manifest.value("tx_num_next").toULongLong() || p->utxoCt != manifest.value("utxo_count").toLongLong()
+            || getChain() != manifest.value("chain").toString())
+        throw DatabaseFormatError("Snapshot: the imported database does not match the manifest. Delete the datadir and"
+                                  " try again.");
+    GenericDBPut(p->db.meta.get(), kSnapshotUnverified, uint32_t(height), "Error writing the snapshot flag to the meta db",
+                 p->db.defWriteOpts);
+    p->unverifiedSnapshotHeight = height;
+    Log() << "Snapshot: imported height " << height << ", it will be checked against bitcoind before synching";
+}
+
+std::optional<BlockHeight> Storage::unverifiedSnapshotHeight() const
+{
+    std::optional<BlockHeight> ret;
+    if (const auto height = p->unverifiedSnapshotHeight.load(); height != UINT32_MAX)
+        ret = height;
+    return ret;
+}
+
+void Storage::setSnapshotVerified()
+{
+    GenericDBDelete(p->db.meta.get(), kSnapshotUnverified, "Error clearing the snapshot flag in the meta db", p->db.defWriteOpts);
+    p->unverifiedSnapshotHeight = UINT32_MAX;
+}
+
+void Storage::pruneUndos(BlockHeight expireHeight)
+{
+    // NB: called from addBlock with all locks held
+    const BlockHeight earliest = p->earliestUndoHeight;
+    if (expireHeight < earliest) return;
+    const auto t0 = Util::getTimeNS();
+    const QByteArray begin = UndoKey(earliest), end = UndoKey(expireHeight + 1); // end is exclusive
+    rocksdb::DB *db = p->db.undo.get();
+    if (auto st = db->DeleteRange(p->db.defWriteOpts, db->DefaultColumnFamily(), ToSlice(begin), ToSlice(end)); !st.ok())
+        throw DatabaseError(QString("Error deleting old/stale undo info from undo db: %1").arg(StatusString(st)));
+    p->earliestUndoHeight = expireHeight + 1;
+    const auto nPruned = expireHeight - earliest + 1;
+    auto & stats = p->undoPruneStats;
+    ++stats.nPrunes;
+    stats.nPruned += nPruned;
+    stats.pruneNanos += uint64_t(Util::getTimeNS() - t0);
+    stats.lastPruneHeight = expireHeight;
+    DebugM("Pruned ", nPruned, " expired undo ", Util::Pluralize("info", nPruned), ", earliest undo is now ",
+           expireHeight + 1);
+
+    // Compact the deleted range in the thread pool, so that the range tombstone and the data it covers are dropped
+    // from disk now, rather than whenever RocksDB gets around to compacting that part of the undo db.
+    ::AppThreadPool()->submitWork(this, [db, begin, end, this]{
+        const auto t0 = Util::getTimeNS();
+        const rocksdb::Slice b = ToSlice(begin), e = ToSlice(end);
+        if (auto st = db->CompactRange(rocksdb::CompactRangeOptions(), &b, &e); !st.ok())
+            throw DatabaseError(QString("Error compacting the undo db: %1").arg(StatusString(st)));
+        ++p->undoPruneStats.nCompactions;
+        p->undoPruneStats.compactNanos += uint64_t(Util::getTimeNS() - t0);
+    }, {}, [this](const QString &err) {
+        // not fatal: the deleted range will just be compacted later by RocksDB itself
+        ++p->undoPruneStats.nCompactionsFailed;
+        Warning() << "Undo db compaction after pruning failed: " << err;
+    }, ThreadPool::LowPriority);
+}
+
+void Storage::beginInitialSync()
+{
+    // NB: called from addBlock with all locks held
+    auto & is = p->initialSync;
+    const int height = int(p->headersFile->numRecords()) - 1;
+    Log() << "Initial sync: entering fast write mode at height " << height + 1 << " (WAL off, compactions deferred,"
+          << " checkpoint every " << options->db.initialSyncCheckpointInterval << " blocks)";
+    for (auto *db : p->db.blockData()) {
+        if (auto st = db->SetOptions({ { "disable_auto_compactions", "true" },
+                                       { "write_buffer_size", std::to_string(is.kWriteBufferSize) } }); !st.ok())
+            throw DatabaseError(QString("Initial sync: unable to set options on the %1 db: %2").arg(DBName(db), StatusString(st)));
+    }
+    p->db.blockWriteOpts.disableWAL = true;
+    is.active = true;
+    is.tStart = Util::getTimeSecs();
+    is.tEnd = 0.;
+    is.startHeight = height + 1;
+    is.endHeight = -1;
+    is.nBlocks = 0;
+    is.sstBytesStart = TotalSstBytes(p->db.all());
+    is.sstBytesEnd = is.sstBytesCompacted = is.compactNanos = 0;
+    // Checkpoint right away. From here on the dirty flag stays set between checkpoints, since what the db's hold
+    // (as opposed to what the checkpoint holds) is no longer guaranteed to be consistent after a crash.
+    checkpointInitialSync(); // may throw
+}
+
+void Storage::flushAllForInitialSync()
+{
+    rocksdb::FlushOptions fo;
+    fo.allow_write_stall = true;
+    for (auto *db : p->db.all())
+        if (auto st = db->Flush(fo); !st.ok())
+            throw DatabaseError(QString("Initial sync: error flushing the %1 db: %2").arg(DBName(db), StatusString(st)));
+    for (auto *rf : { p->headersFile.get(), p->txNumsFile.get(), p->blkInfosFile.get(), p->merkleRootsFile.get() })
+        if (rf && !rf->flush())
+            throw DatabaseError(QString("Initial sync: error flushing \"%1\"").arg(rf->fileName()));
+}
+
+void Storage::checkpointInitialSync()
+{
+    // NB: called from addBlock with all locks held
+    auto & is = p->initialSync;
+    const auto t0 = Util::getTimeNS();
+    // Everything written so far is now made durable, after which the db's are consistent as of the current tip.
+    flushAllForInitialSync(); // may throw
+    setDirty(false);
+
+    // Hard-link the db's into a fresh checkpoint directory, then swap it in place of the previous one. If we crash
+    // before the rename, the previous checkpoint is still intact (and the .tmp dir is ignored on restart).
+    const QString dir = options->datadir + QDir::separator() + kInitialSyncCheckpointName, tmp = dir + ".tmp",
+                  prefix = tmp + QDir::separator();
+    if (!QDir(tmp).removeRecursively() || !QDir().mkpath(tmp))
+        throw DatabaseError(QString("Initial sync: unable to create directory \"%1\"").arg(tmp));
+    for (auto *db : p->db.all()) {
+        rocksdb::Checkpoint *cp = nullptr;
+        auto st = rocksdb::Checkpoint::Create(db, &cp);
+        const std::unique_ptr<rocksdb::Checkpoint> cpGuard(cp);
+        if (st.ok())
+            st = cp->CreateCheckpoint((prefix + DBName(db)).toStdString());
+        if (!st.ok())
+            throw DatabaseError(QString("Initial sync: error creating a checkpoint of the %1 db: %2").arg(DBName(db), StatusString(st)));
+    }
+    const QVariantMap manifest = {
+        { "height", int(p->headersFile->numRecords()) - 1 },
+        { "headers", qulonglong(p->headersFile->numRecords()) },
+        { "tx_num_next", qulonglong(p->txNumNext.load()) },
+        { "blkinfos", qulonglong(p->blkInfosFile->numRecords()) },
+    };
+    if (QFile f(prefix + kSnapshotManifestName); !f.open(QIODevice::WriteOnly|QIODevice::Truncate|QIODevice::Text)
+            || f.write(Util::Json::toString(manifest).toUtf8()) < 0 || !f.flush())
+        throw DatabaseError(QString("Initial sync: unable to write \"%1\": %2").arg(f.fileName(), f.errorString()));
+    if (!QDir(dir).removeRecursively() || !QDir().rename(tmp, dir))
+        throw DatabaseError(QString("Initial sync: unable to move \"%1\" to \"%2\"").arg(tmp, dir));
+
+    // Compactions stay deferred, except for any db whose L0 has grown too large -- it may compact in the background
+    // until the next checkpoint.
+    for (auto *db : p->db.blockData()) {
+        std::string l0;
+        const bool tooMany = db->GetProperty(rocksdb::DB::Properties::kNumFilesAtLevelPrefix + "0", &l0)
+                             && QByteArray::fromStdString(l0).trimmed().toULongLong() > is.kMaxL0Files;
+        if (auto st = db->SetOptions({ { "disable_auto_compactions", tooMany ? "false" : "true" } }); !st.ok())
+            throw DatabaseError(QString("Initial sync: unable to set options on the %1 db: %2").arg(DBName(db), StatusString(st)));
+    }
+
+    setDirty(true);
+    is.blocksSinceCheckpoint = 0;
+    ++is.nCheckpoints;
+    const auto nanos = uint64_t(Util::getTimeNS() - t0);
+    is.checkpointNanos += nanos;
+    DebugM("Initial sync: checkpoint at height ", manifest.value("height").toInt(), " took ",
+           QString::number(nanos / 1e6, 'f', 1), " msec");
+}
+
+void Storage::endInitialSync(bool compact)
+{
+    // NB: called with blocksLock held (from addBlock with all locks held, or from cleanup)
+    auto & is = p->initialSync;
+    // flush first so that nothing written with the WAL off is only in memory once the WAL is back on
+    flushAllForInitialSync(); // may throw
+    p->db.blockWriteOpts.disableWAL = false;
+    for (auto *db : p->db.blockData()) {
+        if (auto st = db->SetOptions({ { "write_buffer_size", std::to_string(p->db.opts.write_buffer_size) } }); !st.ok())
+            throw DatabaseError(QString("Initial sync: unable to set options on the %1 db: %2").arg(DBName(db), StatusString(st)));
+        if (auto st = db->EnableAutoCompaction({ db->DefaultColumnFamily() }); !st.ok())
+            throw DatabaseError(QString("Initial sync: unable to re-enable compactions on the %1 db: %2").arg(DBName(db), StatusString(st)));
+    }
+    setDirty(false);
+    is.active = false;
+    is.blocksSinceCheckpoint = 0;
+    const QString dir = options->datadir + QDir::separator() + kInitialSyncCheckpointName;
+    QDir(dir).removeRecursively();
+    QDir(dir + ".tmp").removeRecursively();
+
+    is.tEnd = Util::getTimeSecs();
+    is.endHeight = int(p->headersFile->numRecords()) - 1;
+    const uint64_t sstEnd = TotalSstBytes(p->db.all()), sstStart = is.sstBytesStart;
+    is.sstBytesEnd = sstEnd;
+    const double secs = is.tEnd - is.tStart;
+    const auto nBlocks = is.nBlocks.load();
+    // Every byte that went into the tables during initial sync skipped the WAL, so the growth of the tables is a
+    // (conservative) estimate of the WAL bytes that were not written.
+    Log() << "Initial sync: left fast write mode at height " << is.endHeight.load() << " after " << nBlocks << " "
+          << Util::Pluralize("block", nBlocks) << " in " << QString::number(secs, 'f', 1) << " secs ("
+          << QString::number(secs > 0. ? nBlocks / secs : 0., 'f', 1) << " blocks/sec), " << is.nCheckpoints.load()
+          << " checkpoints (" << QString::number(is.checkpointNanos.load() / 1e9, 'f', 1) << " secs), ~"
+          << QString::number((sstEnd > sstStart ? sstEnd - sstStart : 0) / 1e6, 'f', 1) << " MB of WAL writes avoided";
+
+    if (!compact) return;
+    // The single compaction that was deferred for the whole of the initial sync. We run it in the thread pool so as
+    // to not hold up block processing; RocksDB also runs it concurrently with normal writes.
+    is.compacting = true;
+    ::AppThreadPool()->submitWork(this, [this]{
+        auto & is = p->initialSync;
+        const auto t0 = Util::getTimeNS();
+        for (auto *db : p->db.blockData()) {
+            if (auto st = db->CompactRange(rocksdb::CompactRangeOptions(), nullptr, nullptr); !st.ok()) {
+                Warning() << "Initial sync: compaction of the " << DBName(db) << " db did not complete: " << StatusString(st);
+                break;
+            }
+        }
+        is.compactNanos = uint64_t(Util::getTimeNS() - t0);
+        is.sstBytesCompacted = TotalSstBytes(p->db.all());
+        is.compacting = false;
+        Log() << "Initial sync: deferred compaction finished in " << QString::number(is.compactNanos.load() / 1e9, 'f', 1)
+              << " secs, tables went from " << QString::number(is.sstBytesEnd.load() / 1e6, 'f', 1) << " MB to "
+              << QString::number(is.sstBytesCompacted.load() / 1e6, 'f', 1) << " MB";
+    });
+}
+
+bool Storage::restoreInitialSyncCheckpoint()
+{
+    const QString dir = options->datadir + QDir::separator() + kInitialSyncCheckpointName,
+                  prefix = dir + QDir::separator(), dataPrefix = options->datadir + QDir::separator();
+    QDir(dir + ".tmp").removeRecursively(); // an incomplete checkpoint is of no use
+    if (!QFileInfo::exists(prefix + kSnapshotManifestName))
+        return false;
+    QVariantMap manifest;
+    try {
+        manifest = Util::Json::parseFile(prefix + kSnapshotManifestName).toMap();
+    } catch (const std::exception &e) {
+        throw DatabaseError(QString("Initial sync: unable to read %1: %2").arg(prefix + kSnapshotManifestName, e.what()));
+    }
+    Warning() << "Initial sync: the previous run did not shut down cleanly, restoring the checkpoint at height "
+              << manifest.value("height").toInt() << " ...";
+    for (const char *name : { "meta", "utxoset", "scripthash_history", "scripthash_unspent", "undo" }) {
+        if (!QFileInfo::exists(prefix + name))
+            continue; // already moved into place by a previous attempt that was itself interrupted
+        if (!QDir(dataPrefix + name).removeRecursively() || !QDir().rename(prefix + name, dataPrefix + name))
+            throw DatabaseError(QString("Initial sync: unable to restore the %1 db from \"%2\"").arg(name, dir));
+    }
+    p->initialSync.restoredManifest = manifest;
+    return true;
+}
+
+BlockHeight Storage::undoLatestBlock(bool notifySubs) { return undoLatestBlocks(1, notifySubs); }
+
+BlockHeight Storage::undoLatestBlocks(unsigned nBlocks, bool notifySubs)
+{
+    if (UNLIKELY(!nBlocks))
+        throw BadArgs("undoLatestBlocks called with nBlocks = 0. FIXME!");
+    BlockHeight newHeight{0};
     std::unique_ptr<UndoInfo::ScriptHashSet> notify;
     if (notifySubs)
         notify = std::make_unique<UndoInfo::ScriptHashSet>();
 
     {
         // take all locks now.. since this is a Big Deal. TODO: add more locks here?
-        std::scoped_lock guard(p->blocksLock, p->headerVerifierLock, p->blkInfoLock, p->mempoolLock);
+        std::scoped_lock guard(p->rewindLock, p->blocksLock, p->headerVerifierLock, p->blkInfoLock, p->mempoolLock);
 
         if (notify)
             // mark ALL of mempool for notify so we can detect drops that weren't in block but also disappeared from mempool properly
-            notify->merge(Util::keySet<UndoInfo::ScriptHashSet>(p->mempool.hashXTxs));
+            notify->merge(p->mempool.hashXSet<UndoInfo::ScriptHashSet>());
 
         p->mempool.clear(); // make sure mempool is clean
 
@@ -1460,132 +3319,171 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
 
         const auto [tip, header] = p->headerVerifier.lastHeaderProcessed();
         if (tip <= 0 || header.length() != p->blockHeaderSize()) throw UndoInfoMissing("No header to undo");
-        prevHeight = unsigned(tip-1);
-        Header prevHeader;
+        if (unsigned(tip) < nBlocks)
+            throw UndoInfoMissing(QString("Cannot undo %1 blocks, tip is at height %2").arg(nBlocks).arg(tip));
+        newHeight = unsigned(tip) - nBlocks;
+        Header newTipHeader;
+        std::vector<Header> undoneHeaders; // the headers for heights newHeight+1 ... tip
         {
-            // grab previous header now
+            // grab the new tip header, plus the headers we are about to undo, now
             QString err;
-            auto opt = headerForHeight_nolock(prevHeight, &err);
+            auto opt = headerForHeight_nolock(newHeight, &err);
             if (!opt.has_value()) throw UndoInfoMissing(err);
-            prevHeader = *opt;
-        }
-        const QString errMsg1 = QStringLiteral("Unable to retrieve undo info for %1").arg(tip);
-        auto undoOpt = GenericDBGet<UndoInfo>(p->db.undo.get(), uint32_t(tip), true, errMsg1, false, p->db.defReadOpts);
-        if (!undoOpt.has_value())
-            throw UndoInfoMissing(errMsg1);
-        auto & undo = *undoOpt; // non-const because we swap out its scripthashes potentially below if notifySubs == true
-
-        // ensure undo info sanity
-        if (!undo.isValid() || undo.height != unsigned(tip) || undo.hash != BTC::HashRev(header)
-            || prevHeight+1 >= p->blkInfos.size() || p->blkInfos.empty() || p->blkInfos.back() != undo.blkInfo)
-            throw DatabaseFormatError(QString("The undo information for height %1 was successfully retrieved from the "
-                                              "database, but it failed an internal consistency check.").arg(tip));
+            newTipHeader = *opt;
+            undoneHeaders = headersFromHeight_nolock_nocheck(newHeight + 1, nBlocks, &err);
+            if (undoneHeaders.size() != nBlocks) throw UndoInfoMissing(err);
+        }
+
+        // Load all the undo infos up-front (newest first) and check them, before we modify anything.
+        std::vector<UndoInfo> undos;
+        undos.reserve(nBlocks);
+        for (unsigned height = unsigned(tip); height > newHeight; --height) {
+            const QString errMsg1 = QStringLiteral("Unable to retrieve undo info for %1").arg(height);
+            auto undoOpt = GenericDBGet<UndoInfo>(p->db.undo.get(), UndoKey(height), true, errMsg1, false, p->db.defReadOpts);
+            if (!undoOpt.has_value())
+                throw UndoInfoMissing(errMsg1);
+            auto & undo = undos.emplace_back(std::move(*undoOpt));
+            // ensure undo info sanity
+            if (!undo.isValid() || undo.height != height || undo.hash != BTC::HashRev(undoneHeaders[height - newHeight - 1])
+                || height >= p->blkInfos.size() || p->blkInfos[height] != undo.blkInfo)
+                throw DatabaseFormatError(QString("The undo information for height %1 was successfully retrieved from the "
+                                                  "database, but it failed an internal consistency check.").arg(height));
+            ResolveUndoTxHashes(undo, *p->txNumsFile); // may throw; must be done before the txNumsFile is truncated below
+        }
+        // everything at or after the oldest undone block's txNum0 goes away
+        const auto txNum0 = undos.back().blkInfo.txNum0;
+        size_t nTx = 0;
+        UndoInfo::ScriptHashSet scriptHashes; // the union of all the scripthashes touched by the undone blocks
+        for (auto & undo : undos) {
+            nTx += undo.blkInfo.nTx;
+            if (scriptHashes.empty())
+                scriptHashes.swap(undo.scriptHashes);
+            else
+                scriptHashes.merge(undo.scriptHashes);
+        }
+        const size_t nSH = scriptHashes.size();
         {
             // all sanity check passed. Now, undo things in reverse order of what we did in addBlock above, rougly speaking
 
-            // first, undo the header
-            p->headerVerifier.reset(prevHeight+1, prevHeader);
+            // first, undo the headers
+            p->headerVerifier.reset(newHeight+1, newTipHeader);
             setDirty(true); // <-- no turning back. we clear this flag at the end
-            deleteHeadersPastHeight(prevHeight); // commit change to db
-            p->merkleCache->truncate(prevHeight+1); // this takes a length, not a height, which is always +1 the height
-
-            // undo the blkInfo from the back
-            p->blkInfos.pop_back();
-            p->blkInfosByTxNum.erase(undo.blkInfo.txNum0);
-            GenericDBDelete(p->db.blkinfo.get(), uint32_t(undo.height), "Failed to delete blkInfo in undoLatestBlock");
+            deleteHeadersPastHeight(newHeight); // commit change to db (also truncates the merkle cache)
+
+            // undo the blkInfos from the back, and delete the undo infos (in a batch, committed below)
+            rocksdb::WriteBatch undoBatch;
+            for (const auto & undo : undos) {
+                p->blkInfos.pop_back();
+                GenericBatchDelete(undoBatch, UndoKey(undo.height));
+                // remove block from txHashes cache
+                p->lruHeight2Hashes_BitcoindMemOrder.remove(undo.height);
+            }
+            if (QString err; p->blkInfosFile->truncate(newHeight + 1, &err) != newHeight + 1 || !err.isEmpty())
+                throw InternalError(QString("Failed to truncate the blkinfos file to %1: %2").arg(newHeight + 1).arg(err));
+            p->txNum0IndexRebuild(); // shrinking: must not reuse the old buffer since readers may still be looking at it
             // clear num2hash cache
             p->lruNum2Hash.clear();
-            // remove block from txHashes cache
-            p->lruHeight2Hashes_BitcoindMemOrder.remove(undo.height);
-
-            const auto txNum0 = undo.blkInfo.txNum0;
-
-            // undo the scripthash histories
-            for (const auto & sh : undo.scriptHashes) {
-                const QString shHex = Util::ToHexFast(sh);
-                const auto vec = GenericDBGetFailIfMissing<TxNumVec>(p->db.shist.get(), sh, QStringLiteral("Undo failed because we failed to retrieve the scripthash history for %1").arg(shHex), false, p->db.defReadOpts);
-                TxNumVec newVec;
-                newVec.reserve(vec.size());
-                for (const auto txNum : vec) {
-                    if (txNum < txNum0) {
-                        // accept only stuff in history that's before txNum0 for this block, filter out everything else
-                        newVec.push_back(txNum);
+
+            {
+                // undo the scripthash histories, each scripthash once for all blocks
+                rocksdb::WriteBatch shistBatch;
+                for (const auto & sh : scriptHashes) {
+                    const QString shHex = Util::ToHexFast(sh);
+                    const auto vec = GenericDBGetFailIfMissing<TxNumVec>(p->db.shist.get(), sh, QStringLiteral("Undo failed because we failed to retrieve the scripthash history for %1").arg(shHex), false, p->db.defReadOpts);
+                    TxNumVec newVec;
+                    newVec.reserve(vec.size());
+                    for (const auto txNum : vec) {
+                        if (txNum < txNum0) {
+                            // accept only stuff in history that's before txNum0 for the oldest undone block, filter out everything else
+                            newVec.push_back(txNum);
+                        }
+                    }
+                    const QString errMsg = QStringLiteral("Undo failed because we failed to write the new scripthash history for %1").arg(shHex);
+                    if (!newVec.empty()) {
+                        // The below is entirely unnecessary as the txnums should be already sorted and unique in the db data.
+                        // We are doing this here to illustrate that this invariant in the data is very important.
+                        // Block undo is intended to be an infrequent process (and thus not especially performance-critical),
+                        // so this does no harm.
+                        std::sort(newVec.begin(), newVec.end());
+                        auto last = std::unique(newVec.begin(), newVec.end());
+                        newVec.erase(last, newVec.end());
+                    }
+                    if (!newVec.empty()) {
+                        // the sh still has some history, write it to db
+                        GenericBatchPut(shistBatch, sh, newVec, errMsg);
+                    } else {
+                        // the sh in question lost all its history as a result of undo, just delete it from db to save space
+                        GenericBatchDelete(shistBatch, sh, errMsg);
                     }
                 }
-                const QString errMsg = QStringLiteral("Undo failed because we failed to write the new scripthash history for %1").arg(shHex);
-                if (!newVec.empty()) {
-                    // The below is entirely unnecessary as the txnums should be already sorted and unique in the db data.
-                    // We are doing this here to illustrate that this invariant in the data is very important.
-                    // Block undo is intended to be an infrequent process (and thus not especially performance-critical),
-                    // so this does no harm.
-                    std::sort(newVec.begin(), newVec.end());
-                    auto last = std::unique(newVec.begin(), newVec.end());
-                    newVec.erase(last, newVec.end());
-                }
-                if (!newVec.empty()) {
-                    // the sh still has some history, write it to db
-                    GenericDBPut(p->db.shist.get(), sh, newVec, errMsg, p->db.defWriteOpts);
-                } else {
-                    // the sh in question lost all its history as a result of undo, just delete it from db to save space
-                    GenericDBDelete(p->db.shist.get(), sh, errMsg, p->db.defWriteOpts);
-                }
+                GenericBatchWrite(p->db.shist.get(), shistBatch, "Undo failed because we failed to write the new scripthash histories", p->db.defWriteOpts);
             }
 
             {
-                // UTXO set update
+                // UTXO set update. Blocks are processed newest-first so that a txo created in an older undone block
+                // and spent in a newer one is first re-added and then removed (the batch preserves this order).
                 UTXOBatch utxoBatch;
 
-                // now, undo the utxo deletions by re-adding them
-                for (const auto & [txo, info] : undo.delUndos) {
-                    // note that deletions may have an info with a txnum before this block, for obvious reasons
-                    utxoBatch.add(txo, info, CompactTXO(info.txNum, txo.prevoutN)); // may throw
-                }
+                for (const auto & undo : undos) {
+                    // now, undo the utxo deletions by re-adding them
+                    for (const auto & [txo, info] : undo.delUndos) {
+                        // note that deletions may have an info with a txnum before this block, for obvious reasons
+                        utxoBatch.add(txo, info, CompactTXO(info.txNum, txo.prevoutN)); // may throw
+                    }
 
-                // now, undo the utxo additions by deleting them
-                for (const auto & [txo, hashx, ctxo] : undo.addUndos) {
-                    assert(ctxo.txNum() >= txNum0); // all of the additions must have been in this block or newer
-                    utxoBatch.remove(txo, hashx, ctxo); // may throw
+                    // now, undo the utxo additions by deleting them
+                    for (const auto & [txo, hashx, ctxo] : undo.addUndos) {
+                        assert(ctxo.txNum() >= undo.blkInfo.txNum0); // all of the additions must have been in this block or newer
+                        utxoBatch.remove(txo, hashx, ctxo); // may throw
+                    }
                 }
 
                 issueUpdates(utxoBatch); // may throw, updates p->utxoCt and issues write to db.
             }
 
-            if (p->earliestUndoHeight >= undo.height)
+            if (p->earliestUndoHeight > newHeight)
                 // oops, we're out of undos now!
                 p->earliestUndoHeight = UINT_MAX;
-            GenericDBDelete(p->db.undo.get(), uint32_t(undo.height)); // make sure to delete this undo info since it was just applied.
+            // make sure to delete these undo infos since they were just applied.
+            GenericBatchWrite(p->db.undo.get(), undoBatch, "Failed to delete undo infos in undoLatestBlocks", p->db.defWriteOpts);
 
-            // lastly, truncate the tx num file and re-set txNumNext to point to this block's txNum0 (thereby recycling it)
-            assert(long(p->txNumNext) - long(txNum0) == long(undo.blkInfo.nTx));
+            // lastly, truncate the tx num file and re-set txNumNext to point to the oldest undone block's txNum0 (thereby recycling it)
+            assert(long(p->txNumNext) - long(txNum0) == long(nTx));
             p->txNumNext = txNum0;
             if (QString err; p->txNumsFile->truncate(txNum0, &err) != txNum0 || !err.isEmpty()) {
                 throw InternalError(QString("Failed to truncate txNumsFile to %1: %2").arg(txNum0).arg(err));
             }
 
             saveUtxoCt();
+            p->publishReadView();
             setDirty(false); // phew. done.
 
             if (notify) {
                 if (notify->empty())
-                    notify->swap(undo.scriptHashes);
+                    notify->swap(scriptHashes);
                 else
-                    notify->merge(undo.scriptHashes);
+                    notify->merge(scriptHashes);
             }
         }
 
-        const size_t nTx = undo.blkInfo.nTx, nSH = undo.scriptHashes.size();
         const auto elapsedms = (Util::getTimeNS() - t0) / 1e6;
-        Log() << "Applied undo for block " << undo.height << " hash " << Util::ToHexFast(undo.hash) << ", "
-              << nTx << " " << Util::Pluralize("transaction", nTx)
-              << " involving " << nSH << " " << Util::Pluralize("scripthash", nSH)
-              << ", in " << QString::number(elapsedms, 'f', 2) << " msec, new height now: " << prevHeight;
+        if (nBlocks == 1)
+            Log() << "Applied undo for block " << undos.front().height << " hash " << Util::ToHexFast(undos.front().hash) << ", "
+                  << nTx << " " << Util::Pluralize("transaction", nTx)
+                  << " involving " << nSH << " " << Util::Pluralize("scripthash", nSH)
+                  << ", in " << QString::number(elapsedms, 'f', 2) << " msec, new height now: " << newHeight;
+        else
+            Log() << "Applied undo for " << nBlocks << " blocks (" << undos.back().height << " - " << undos.front().height << "), "
+                  << nTx << " " << Util::Pluralize("transaction", nTx)
+                  << " involving " << nSH << " " << Util::Pluralize("scripthash", nSH)
+                  << ", in " << QString::number(elapsedms, 'f', 2) << " msec, new height now: " << newHeight;
     } // release locks
 
     // now, do notifications
     if (notify && subsmgr && !notify->empty())
         subsmgr->enqueueNotifications(std::move(*notify));
 
-    return prevHeight;
+    return newHeight;
 }
 
 
@@ -1646,33 +3544,48 @@ std::optional<TxHash> Storage::hashForTxNum(TxNum n, bool throwIfMissing, bool *
 
 std::optional<unsigned> Storage::heightForTxNum(TxNum n) const
 {
-    SharedLockGuard g(p->blkInfoLock);
-    std::optional<unsigned> ret;
-    auto it = p->blkInfosByTxNum.upper_bound(n);  // O(logN) search; find the block *AFTER* n, then go backw on to find the block in range
-    if (it != p->blkInfosByTxNum.begin()) {
-        --it;
-        const auto & bi = p->blkInfos[it->second];
-        if (n >= bi.txNum0 && n < bi.txNum0+bi.nTx)
-            ret = it->second;
+    // No lock: the published index is immutable, so we just grab a reference to the current one and search it.
+    return std::atomic_load(&p->txNum0Index)->heightForTxNum(n);
+}
+
+std::vector<TxHash> Storage::hashesForTxNums(const std::vector<TxNum> &txNums) const
+{
+    std::vector<TxHash> ret(txNums.size());
+    // first, the cache
+    std::vector<uint64_t> misses;
+    for (size_t i = 0; i < txNums.size(); ++i) {
+        if (auto opt = p->lruNum2Hash.object(txNums[i]); opt.has_value()) {
+            ret[i] = std::move(*opt);
+            ++p->lruCacheStats.num2HashHits;
+        } else
+            misses.push_back(txNums[i]);
     }
+    if (misses.empty())
+        return ret;
+    p->lruCacheStats.num2HashMisses += misses.size();
+    // then, the misses with one pass over the file, in file order
+    std::sort(misses.begin(), misses.end());
+    misses.erase(std::unique(misses.begin(), misses.end()), misses.end());
+    QString err;
+    const auto hashes = p->txNumsFile->readRandomRecords(misses, &err);
+    if (hashes.size() != misses.size())
+        throw DatabaseError(QString("Error reading %1 TxHashes: %2").arg(misses.size()).arg(err));
+    for (size_t i = 0; i < misses.size(); ++i)
+        p->lruNum2Hash.insert(misses[i], hashes[i], p->lruNum2HashSizeCalc());
+    for (size_t i = 0; i < txNums.size(); ++i)
+        if (ret[i].isEmpty())
+            ret[i] = hashes[size_t(std::lower_bound(misses.begin(), misses.end(), txNums[i]) - misses.begin())];
     return ret;
 }
 
 std::optional<TxHash> Storage::hashForHeightAndPos(BlockHeight height, unsigned posInBlock) const
 {
     std::optional<TxHash> ret;
-    TxNum txNum = 0;
-    SharedLockGuard(p->blocksLock); // guarantee a consistent view (so that data doesn't mutate from underneath us)
-    {
-        SharedLockGuard g(p->blkInfoLock);
-        if (height >= p->blkInfos.size())
-            return ret;
-        const BlkInfo & bi = p->blkInfos[height];
-        if (posInBlock >= bi.nTx)
-            return ret;
-        txNum = bi.txNum0 + posInBlock;
-    }
-    ret = hashForTxNum(txNum);
+    SharedLockGuard g(p->rewindLock); // guarantee a consistent view (so that data doesn't mutate from underneath us)
+    const auto bi = p->readView()->txNum0Index->blkInfo(height);
+    if (!bi || posInBlock >= bi->nTx)
+        return ret;
+    ret = hashForTxNum(bi->txNum0 + posInBlock);
     return ret;
 }
 
@@ -1681,7 +3594,7 @@ std::vector<TxHash> Storage::txHashesForBlockInBitcoindMemoryOrder(BlockHeight h
 {
     std::vector<TxHash> ret;
     std::pair<TxNum, size_t> startCount{0,0};
-    SharedLockGuard(p->blocksLock); // guarantee a consistent view (so that data doesn't mutate from underneath us)
+    SharedLockGuard g(p->rewindLock); // guarantee a consistent view (so that data doesn't mutate from underneath us)
     {
         // check cache
         auto opt = p->lruHeight2Hashes_BitcoindMemOrder.object(height);
@@ -1697,13 +3610,10 @@ std::vector<TxHash> Storage::txHashesForBlockInBitcoindMemoryOrder(BlockHeight h
         }
     }
     ++p->lruCacheStats.height2HashesMisses;
-    {
-        SharedLockGuard g(p->blkInfoLock);
-        if (height >= p->blkInfos.size())
-            return ret;
-        const BlkInfo & bi = p->blkInfos[height];
-        startCount = { bi.txNum0, bi.nTx };
-    }
+    if (const auto bi = p->readView()->txNum0Index->blkInfo(height); bi.has_value())
+        startCount = { bi->txNum0, bi->nTx };
+    else
+        return ret;
     QString err;
     auto vec = p->txNumsFile->readRecords(startCount.first, startCount.second, &err);
     if (vec.size() != startCount.second || !err.isEmpty()) {
@@ -1732,50 +3642,133 @@ auto Storage::getHistory(const HashX & hashX, bool conf, bool unconf) const -> H
     if (hashX.length() != HashLen)
         return ret;
     try {
-        SharedLockGuard g(p->blocksLock);  // makes sure history doesn't mutate from underneath our feet
+        SharedLockGuard g(p->rewindLock);  // makes sure the txnums file doesn't get truncated from underneath our feet
+        std::shared_ptr<const Pvt::ReadView> view;
+        History unconfItems;
+        if (unconf) {
+            // Grab the view while holding the mempool lock, so that the two go together (addBlock clears the mempool
+            // and publishes the new view under this lock).
+            auto [mempool, lock] = mempoolForHashX(hashX);
+            view = p->readView();
+            if (const auto *txvecp = mempool.txsForHashX(hashX)) {
+                const auto & txvec = *txvecp;
+                unconfItems.reserve(txvec.size()); // the overall size is checked below
+                for (const auto & tx : txvec)
+                    unconfItems.emplace_back(HistoryItem{tx->hash, tx->hasUnconfirmedParentTx ? -1 : 0, tx->fee});
+            }
+        } else
+            view = p->readView();
         if (conf) {
             static const QString err("Error retrieving history for a script hash");
-            auto nums_opt = GenericDBGet<TxNumVec>(p->db.shist.get(), hashX, true, err, false, p->db.defReadOpts);
+            auto nums_opt = GenericDBGet<TxNumVec>(p->db.shist.get(), hashX, true, err, false, view->shist.readOpts);
             if (nums_opt.has_value()) {
                 auto & nums = *nums_opt;
                 if (UNLIKELY(nums.size() > maxHistory)) {
                     throw HistoryTooLarge(QString("History for scripthash %1 exceeds MaxHistory %2 with %3 items!")
                                           .arg(QString(hashX.toHex())).arg(maxHistory).arg(nums.size()));
                 }
-                ret.reserve(nums.size());
-                // TODO: The below could use some optimization.  A batched version of both hashForTxNum and
-                // heightForTxNum are low-hanging fruit for optimization.  Each call to the below takes a shared lock
-                // then releases it, for each item.  I imagine batched versions would have significantly less overhead
-                // per item, which could add up to huge performance savings on large histories.  This is a very
-                // low hanging fruit for optimization -- thus I am leaving this comment here so I can remember to come
-                // back and optmize the below.  /TODO
-                for (auto num : nums) {
-                    auto hash = hashForTxNum(num).value(); // may throw, but that indicates some database inconsistency. we catch below
-                    auto height = heightForTxNum(num).value(); // may throw, same deal
-                    ret.emplace_back(HistoryItem{hash, int(height), {}});
+                ret.reserve(nums.size() + unconfItems.size());
+                // resolve the hashes in one go, and the heights from the same view we read the history from
+                const auto hashes = hashesForTxNums(nums); // may throw, but that indicates some database inconsistency. we catch below
+                for (size_t i = 0; i < nums.size(); ++i) {
+                    const auto height = view->txNum0Index->heightForTxNum(nums[i]).value(); // may throw, same deal
+                    ret.emplace_back(HistoryItem{hashes[i], int(height), {}});
                 }
             }
         }
-        if (unconf) {
-            auto [mempool, lock] = this->mempool();
-            if (auto it = mempool.hashXTxs.find(hashX); it != mempool.hashXTxs.end()) {
-                const auto & txvec = it->second;
-                const size_t total = ret.size() + txvec.size();
-                if (UNLIKELY(total > maxHistory)) {
-                    throw HistoryTooLarge(QString("History for scripthash %1 exceeds MaxHistory %2 with %3 items!")
-                                          .arg(QString(hashX.toHex())).arg(maxHistory).arg(total));
-                }
-                ret.reserve(total);
-                for (const auto & tx : txvec)
-                    ret.emplace_back(HistoryItem{tx->hash, tx->hasUnconfirmedParentTx ? -1 : 0, tx->fee});
-            }
+        // mempool items go at the end
+        if (const size_t total = ret.size() + unconfItems.size(); UNLIKELY(total > maxHistory)) {
+            throw HistoryTooLarge(QString("History for scripthash %1 exceeds MaxHistory %2 with %3 items!")
+                                  .arg(QString(hashX.toHex())).arg(maxHistory).arg(total));
         }
+        if (ret.empty())
+            ret.swap(unconfItems);
+        else
+            ret.insert(ret.end(), unconfItems.begin(), unconfItems.end());
     } catch (const std::exception &e) {
         Warning(Log::Magenta) << __func__ << ": " << e.what();
     }
     return ret;
 }
 
+auto Storage::getHistories(const std::vector<HashX> & hashXs) const -> std::vector<History>
+{
+    std::vector<History> ret(hashXs.size());
+    const size_t maxHistory = size_t(options->maxHistory);
+    const auto warnTooLarge = [&](size_t i, size_t total) {
+        Warning(Log::Magenta) << __func__ << ": " << QString("History for scripthash %1 exceeds MaxHistory %2 with %3 items!")
+                                                    .arg(QString(hashXs[i].toHex())).arg(maxHistory).arg(total);
+    };
+    SharedLockGuard g(p->rewindLock);  // makes sure the txnums file doesn't get truncated from underneath our feet
+    std::shared_ptr<const Pvt::ReadView> view;
+    std::vector<History> unconfItems(hashXs.size());
+    {
+        // Grab the view while holding the mempool lock, so that the two go together (see getHistory).
+        auto [mempool, lock] = this->mempool();
+        view = p->readView();
+        for (size_t i = 0; i < hashXs.size(); ++i) {
+            if (const auto *txvecp = mempool.txsForHashX(hashXs[i])) {
+                unconfItems[i].reserve(txvecp->size());
+                for (const auto & tx : *txvecp)
+                    unconfItems[i].emplace_back(HistoryItem{tx->hash, tx->hasUnconfirmedParentTx ? -1 : 0, tx->fee});
+            }
+        }
+    }
+    // confirmed: one MultiGet over scripthash_history, with the keys in sorted order
+    std::vector<size_t> order;
+    order.reserve(hashXs.size());
+    for (size_t i = 0; i < hashXs.size(); ++i)
+        if (hashXs[i].length() == HashLen)
+            order.push_back(i);
+    std::sort(order.begin(), order.end(), [&hashXs](size_t a, size_t b) { return hashXs[a] < hashXs[b]; });
+    std::vector<rocksdb::Slice> keys;
+    keys.reserve(order.size());
+    for (const auto i : order)
+        keys.push_back(ToSlice(hashXs[i]));
+    std::vector<std::string> values;
+    const auto statuses = p->db.shist->MultiGet(view->shist.readOpts, keys, &values);
+    std::vector<TxNumVec> numVecs(hashXs.size());
+    std::vector<TxNum> allNums;
+    for (size_t k = 0; k < order.size(); ++k) {
+        const auto i = order[k];
+        const auto & status = statuses[k];
+        if (status.IsNotFound())
+            continue;
+        if (UNLIKELY(!status.ok()))
+            throw DatabaseError(QString("Error retrieving history for a script hash: %1").arg(StatusString(status)));
+        bool ok;
+        auto nums = Deserialize<TxNumVec>(FromSlice(values[k]), &ok);
+        if (UNLIKELY(!ok))
+            throw DatabaseSerializationError(QString("Failed to deserialize the history for scripthash %1")
+                                             .arg(QString(hashXs[i].toHex())));
+        if (const size_t total = nums.size() + unconfItems[i].size(); UNLIKELY(total > maxHistory)) {
+            warnTooLarge(i, total);
+            unconfItems[i].clear();
+            continue;
+        }
+        allNums.insert(allNums.end(), nums.begin(), nums.end());
+        numVecs[i] = std::move(nums);
+    }
+    // resolve all of the TxNums -> hashes in one go
+    const auto hashes = hashesForTxNums(allNums); // may throw, but that indicates some database inconsistency
+    size_t h = 0;
+    for (size_t i = 0; i < hashXs.size(); ++i) {
+        auto & hist = ret[i];
+        if (const size_t total = numVecs[i].size() + unconfItems[i].size(); UNLIKELY(total > maxHistory)) {
+            warnTooLarge(i, total); // mempool-only history that is too large
+            continue;
+        }
+        hist.reserve(numVecs[i].size() + unconfItems[i].size());
+        for (const auto num : numVecs[i]) {
+            const auto height = view->txNum0Index->heightForTxNum(num).value(); // may throw, same deal
+            hist.emplace_back(HistoryItem{hashes[h++], int(height), {}});
+        }
+        // mempool items go at the end
+        hist.insert(hist.end(), unconfItems[i].begin(), unconfItems[i].end());
+    }
+    return ret;
+}
+
 auto Storage::listUnspent(const HashX & hashX) const -> UnspentItems
 {
     UnspentItems ret;
@@ -1788,65 +3781,59 @@ auto Storage::listUnspent(const HashX & hashX) const -> UnspentItems
         mempoolConfirmedSpends.reserve(iota);
         ret.reserve(iota);
         {
-            // take shared lock (ensure history doesn't mutate from underneath our feet)
-            SharedLockGuard g(p->blocksLock);
+            // take shared lock (ensure the txnums file doesn't get truncated from underneath our feet)
+            SharedLockGuard g(p->rewindLock);
             const TxNum veryHighTxNum = getTxNum() + 100000000;  // pick an absurdly high TxNum that is 100 million past current. This is a fudge so sorting works ok for unconfirmed tx's so that they appear at the end.
+            std::shared_ptr<const Pvt::ReadView> view;
             {
                 // grab mempool utxos for scripthash -- we do mempool first so as to build the "mempoolConfirmedSpends" set as we iterate.
-                auto [mempool, lock] = this->mempool(); // shared lock
-                if (auto it = mempool.hashXTxs.find(hashX); it != mempool.hashXTxs.end()) {
-                    const auto & txvec = it->second;
+                Mempool::HashXIdx hxIdx;
+                auto [mempool, lock] = mempoolForHashX(hashX, &hxIdx); // shared locks (global + this scripthash's shard)
+                view = p->readView(); // grabbed under the mempool lock so that the view and the mempool go together
+                if (const auto *txvecp = mempool.txsForHashX(hashX)) {
+                    const auto & txvec = *txvecp;
                     for (const auto & tx : txvec) {
                         if (!tx) {
                             // defensive programming. should never happen
                             Warning() << "Cannot find tx for sh " << hashX.toHex() << ". FIXME!!";
                             continue;
                         }
-                        if (auto it2 = tx->hashXs.find(hashX); LIKELY(it2 != tx->hashXs.end())) {
-                            const auto & ioinfo = it2->second;
-                            // make sure to put any confirmed spends we see now in the "mempool confirmed spends" set
-                            // so we know not to include them in the list of utxos from the DB later in this function!
-                            for (const auto & [txo, txoinfo] : ioinfo.confirmedSpends) {
-                                mempoolConfirmedSpends.insert(txo);
-                            }
-                            for (const auto ionum : ioinfo.utxo) {
-                                if (decltype(tx->txos.cbegin()) it3;
-                                        LIKELY( ionum < tx->txos.size() && (it3 = tx->txos.cbegin() + ionum)->isValid() ))
-                                {
-                                    ret.emplace_back(UnspentItem{
-                                        { tx->hash, 0 /* always put 0 for height here */, tx->fee }, // base HistoryItem
-                                        ionum, // .tx_pos
-                                        it3->amount,  // .value
-                                        TxNum(1) + veryHighTxNum + TxNum(tx->hasUnconfirmedParentTx ? 1 : 0), // .txNum (this is fudged for sorting at the end properly)
-                                    });
-                                    if (UNLIKELY(ret.size() > maxHistory)) {
-                                        throw HistoryTooLarge(QString("Unspent history too large for %1, exceeds MaxHistory of %2")
-                                                              .arg(QString(hashX.toHex())).arg(maxHistory));
-                                    }
-                                } else {
-                                    // this should never happen!
-                                    Warning() << "Cannot find txo " << ionum << " for sh " << hashX.toHex() << " in tx " << tx->hash.toHex();
-                                    continue;
-                                }
+                        // make sure to put any confirmed spends we see now in the "mempool confirmed spends" set
+                        // so we know not to include them in the list of utxos from the DB later in this function!
+                        for (auto [sit, send] = tx->spendsFor(hxIdx); sit != send; ++sit)
+                            if (sit->confirmed)
+                                mempoolConfirmedSpends.insert(sit->txo);
+                        for (IONum ionum = 0; ionum < tx->txos.size(); ++ionum) {
+                            const auto & out = tx->txos[ionum];
+                            if (out.hashXIdx != hxIdx || out.spentInMempool)
+                                continue;
+                            ret.emplace_back(UnspentItem{
+                                { tx->hash, 0 /* always put 0 for height here */, tx->fee }, // base HistoryItem
+                                ionum, // .tx_pos
+                                out.amount,  // .value
+                                TxNum(1) + veryHighTxNum + TxNum(tx->hasUnconfirmedParentTx ? 1 : 0), // .txNum (this is fudged for sorting at the end properly)
+                            });
+                            if (UNLIKELY(ret.size() > maxHistory)) {
+                                throw HistoryTooLarge(QString("Unspent history too large for %1, exceeds MaxHistory of %2")
+                                                      .arg(QString(hashX.toHex())).arg(maxHistory));
                             }
-                        } else {
-                            // defensive programming. should never happen
-                            Warning() << "Cannot find scripthash " << hashX.toHex() << " in tx 'hashX -> IOInfo' map for tx " << tx->hash.toHex() << ". FIXME!";
                         }
                     }
                 }
             } // release mempool lock
             { // begin confirmed/db search
-                std::unique_ptr<rocksdb::Iterator> iter(p->db.shunspent->NewIterator(p->db.defReadOpts));
+                std::unique_ptr<rocksdb::Iterator> iter(p->db.shunspent->NewIterator(view->shunspent.readOpts));
                 const rocksdb::Slice prefix = ToSlice(hashX); // points to data in hashX
 
                 // Search table for all keys that start with hashx's bytes. Note: the loop end-condition is strange.
                 // See: https://github.com/facebook/rocksdb/wiki/Prefix-Seek-API-Changes#transition-to-the-new-usage
+                //
+                // This is a single pass over the scripthash's key range: each key holds the CompactTXO (txNum and
+                // output index) and each value the amount, while the height comes from the view's in-RAM TxNum index.
+                // So, no utxoset lookups are needed. The only other reads are of the tx hashes, batched below.
                 rocksdb::Slice key;
-                std::list<CompactTXO> ctxoList;
-                size_t ctxoListSize = 0;
-                // we do it this way as two separate loops in order to avoid the expensive heightForTxNum lookups below in
-                // the case where the history is huge.
+                std::vector<std::pair<CompactTXO, bitcoin::Amount>> ctxos;
+                std::vector<TxNum> txNums;
                 for (iter->Seek(prefix); iter->Valid() && (key = iter->key()).starts_with(prefix); iter->Next()) {
                     if (key.size() != HashLen + CompactTXO::serSize())
                         // should never happen, indicates db corruption
@@ -1855,31 +3842,36 @@ auto Storage::listUnspent(const HashX & hashX) const -> UnspentItems
                     if (!ctxo.isValid())
                         // should never happen, indicates db corruption
                         throw InternalError("Deserialized CompactTXO is invalid");
-                    ctxoList.emplace_back(ctxo);
-                    if (UNLIKELY(++ctxoListSize + ret.size() > maxHistory)) {
+                    bool ok;
+                    const bitcoin::Amount amount = Deserialize<bitcoin::Amount>(FromSlice(iter->value()), &ok);
+                    if (UNLIKELY(!ok))
+                        // should never happen, indicates db corruption
+                        throw InternalError(QString("Bad amount in db for ctxo %1").arg(ctxo.toString()));
+                    ctxos.emplace_back(ctxo, amount);
+                    txNums.push_back(ctxo.txNum());
+                    if (UNLIKELY(ctxos.size() + ret.size() > maxHistory)) {
                         throw HistoryTooLarge(QString("Unspent history too large for %1, exceeds MaxHistory of %2")
                                               .arg(QString(hashX.toHex())).arg(maxHistory));
                     }
                 }
-                for (const auto & ctxo : ctxoList) {
-                    static const QString err("Error retrieving the utxo for an unspent item");
-                    const auto hash = hashForTxNum(ctxo.txNum()).value(); // may throw, but that indicates some database inconsistency. we catch below
-                    const auto height = heightForTxNum(ctxo.txNum()).value(); // may throw, same deal
-                    const TXO txo{ hash, ctxo.N() };
+                const auto hashes = hashesForTxNums(txNums); // may throw, but that indicates some database inconsistency. we catch below
+                for (size_t i = 0; i < ctxos.size(); ++i) {
+                    const auto & [ctxo, amount] = ctxos[i];
+                    const auto height = view->txNum0Index->heightForTxNum(ctxo.txNum()).value(); // may throw, same deal
+                    const TXO txo{ hashes[i], ctxo.N() };
                     if (mempoolConfirmedSpends.count(txo))
                         // Skip items that are spent in mempool. This fixes a bug in Fulcrum 1.0.2 or earlier where the
                         // confirmed spends in the mempool were still appearing in the listunspent utxos.
                         continue;
-                    auto info = GenericDBGetFailIfMissing<TXOInfo>(p->db.utxoset.get(), txo, err, false, p->db.defReadOpts); // may throw -- indicates db inconsistency
                     ret.emplace_back(UnspentItem{
-                        { hash, int(height), {} }, // base HistoryItem
+                        { txo.prevoutHash, int(height), {} }, // base HistoryItem
                         txo.prevoutN,  // .tx_pos
-                        info.amount, // .value
-                        info.txNum, // .txNum
+                        amount, // .value
+                        ctxo.txNum(), // .txNum
                     });
                 }
             } // end confirmed/db search
-        } // release blocks lock
+        } // release rewind lock
         std::sort(ret.begin(), ret.end());
         if (const auto sz = ret.size(), cap = ret.capacity(); cap - sz > iota && sz > 0 && double(cap)/double(sz) > 1.20)
             // we only do this if we're wasting enough space (at least iota, and at least 20% space wasted),
@@ -1898,11 +3890,33 @@ auto Storage::getBalance(const HashX &hashX) const -> std::pair<bitcoin::Amount,
     if (hashX.length() != HashLen)
         return ret;
     try {
-        // take shared lock (ensure history doesn't mutate from underneath our feet)
-        SharedLockGuard g(p->blocksLock);
+        // unconfirmed first, since that's where we grab the view that the confirmed part reads from
+        std::shared_ptr<const Pvt::ReadView> view;
+        {
+            // unconfirmed -- check mempool
+            Mempool::HashXIdx hxIdx;
+            auto [mempool, lock] = mempoolForHashX(hashX, &hxIdx); // shared (read only) locks are held until scope end
+            view = p->readView(); // grabbed under the mempool lock so that the view and the mempool go together
+            if (const auto *txvec = mempool.txsForHashX(hashX)) {
+                // for all tx's involving scripthash
+                bitcoin::Amount utxos, spends;
+                if (UNLIKELY(hxIdx == Mempool::NoHashXIdx))
+                    throw InternalError(QString("scripthash %1 is in the mempool but was not interned! FIXME!").arg(QString(hashX.toHex())));
+                for (const auto & tx : *txvec) {
+                    assert(bool(tx));
+                    for (auto [sit, send] = tx->spendsFor(hxIdx); sit != send; ++sit)
+                        if (sit->confirmed)
+                            spends += sit->amount;
+                    for (const auto & out : tx->txos)
+                        if (out.hashXIdx == hxIdx && !out.spentInMempool)
+                            utxos += out.amount;
+                }
+                ret.second = utxos - spends; // note this may not be MoneyRange (may be negative), which is ok.
+            }
+        }
         {
-            // confirmed -- read from db using an iterator
-            std::unique_ptr<rocksdb::Iterator> iter(p->db.shunspent->NewIterator(p->db.defReadOpts));
+            // confirmed -- read from the view's db snapshot using an iterator
+            std::unique_ptr<rocksdb::Iterator> iter(p->db.shunspent->NewIterator(view->shunspent.readOpts));
             const rocksdb::Slice prefix = ToSlice(hashX); // points to data in hashX
 
             // Search table for all keys that start with hashx's bytes. Note: the loop end-condition is strange.
@@ -1929,36 +3943,6 @@ auto Storage::getBalance(const HashX &hashX) const -> std::pair<bitcoin::Amount,
                 throw InternalError(QString("Out-of-range total in db for getBalance on scripthash: %1").arg(QString(hashX.toHex())));
             }
         }
-        {
-            // unconfirmed -- check mempool
-            auto [mempool, lock] = this->mempool(); // shared (read only) lock is held until scope end
-            if (auto it = mempool.hashXTxs.find(hashX); it != mempool.hashXTxs.end()) {
-                // for all tx's involving scripthash
-                bitcoin::Amount utxos, spends;
-                for (const auto & tx : it->second) {
-                    assert(bool(tx));
-                    auto it2 = tx->hashXs.find(hashX);
-                    if (UNLIKELY(it2 == tx->hashXs.end())) {
-                        throw InternalError(QString("scripthash %1 lists tx %2, which then lacks the IOInfo for said hashX! FIXM!")
-                                            .arg(QString(hashX.toHex())).arg(QString(tx->hash.toHex())));
-                    }
-                    auto & info = it2->second;
-                    for (const auto & [txo, txoinfo] : info.confirmedSpends)
-                        spends += txoinfo.amount;
-                    for (const auto ionum : info.utxo) {
-                        if (decltype(tx->txos.cbegin()) it3; UNLIKELY( ionum >= tx->txos.size()
-                                                                       || !(it3 = tx->txos.cbegin() + ionum)->isValid()) )
-                        {
-                            throw InternalError(QString("scripthash %1 lists tx %2, which then lacks a valid TXO IONum %3 for said hashX! FIXME!")
-                                                .arg(QString(hashX.toHex())).arg(QString(tx->hash.toHex())).arg(ionum));
-                        } else {
-                            utxos += it3->amount;
-                        }
-                    }
-                }
-                ret.second = utxos - spends; // note this may not be MoneyRange (may be negative), which is ok.
-            }
-        }
     } catch (const std::exception &e) {
         Warning(Log::Magenta) << __func__ << ": " << e.what();
     }
@@ -1975,12 +3959,16 @@ std::vector<QByteArray> Storage::merkleCacheHelperFunc(unsigned int start, unsig
 
 void Storage::updateMerkleCache(unsigned int height)
 {
-    if (!p->merkleCache->isInitialized() && height) {
-        try {
+    // The cache is loaded at startup and kept up-to-date by addBlock, so normally this does nothing.
+    try {
+        if (!p->merkleCache->isInitialized())
             p->merkleCache->initialize(height+1); // this may take a few seconds
-        } catch (const std::exception & e) {
-            Error() << e.what();
+        else if (p->merkleCache->length() < height+1) {
+            ExclusiveLockGuard g(p->headerVerifierLock); // appendHeader also extends the cache with this lock held
+            appendMerkleRoots(p->merkleCache->extendTo(height+1));
         }
+    } catch (const std::exception & e) {
+        Error() << e.what();
     }
 }
 
@@ -2026,32 +4014,231 @@ bool Storage::UnspentItem::operator==(const UnspentItem &o) const noexcept {
     return txNum == o.txNum && tx_pos == o.tx_pos && value == o.value && HistoryItem::operator==(o);
 }
 
-auto Storage::mempool() const -> std::pair<const Mempool &, SharedLockGuard>
+auto Storage::mempool() const -> std::pair<const Mempool &, MempoolReadLock>
 {
-    return {p->mempool, SharedLockGuard{p->mempoolLock}};
+    MempoolReadLock g;
+    g.global = SharedLockGuard{p->mempoolLock};
+    g.txs = SharedLockGuard{p->mempoolTxsLock};
+    for (unsigned i = 0; i < Mempool::kNumHashXShards; ++i)
+        g.shards[i] = SharedLockGuard{p->mempoolShardLocks[i]};
+    return {p->mempool, std::move(g)};
+}
+auto Storage::mempoolForHashX(const HashX &hashX, Mempool::HashXIdx *idx) const -> std::pair<const Mempool &, MempoolHashXReadLock>
+{
+    MempoolHashXReadLock g;
+    g.global = SharedLockGuard{p->mempoolLock};
+    auto & shardLock = p->mempoolShardLocks[Mempool::hashXShard(hashX)];
+    if (!idx) {
+        g.shard = SharedLockGuard{shardLock};
+        return {p->mempool, std::move(g)};
+    }
+    for (;;) {
+        // Resolve the index under the tx map lock *before* taking the shard lock, as per the lock order.
+        {
+            SharedLockGuard g2{p->mempoolTxsLock};
+            *idx = p->mempool.findHashXIdx(hashX);
+        }
+        g.shard = SharedLockGuard{shardLock};
+        // The writer interns a HashX before it publishes it to its shard, and an interned index doesn't change while
+        // we hold the global lock. So unless the writer published this HashX in between the two steps above (in which
+        // case we try again), the index is consistent with what the shard has.
+        if (*idx != Mempool::NoHashXIdx || !p->mempool.txsForHashX(hashX))
+            break;
+        g.shard = SharedLockGuard{};
+    }
+    return {p->mempool, std::move(g)};
+}
+auto Storage::mempoolWriter() -> MempoolWriter
+{
+    return MempoolWriter(p->mempool, p->mempoolWriterLock, p->mempoolLock, p->mempoolTxsLock, p->mempoolShardLocks.data());
 }
 auto Storage::mutableMempool() -> std::pair<Mempool &, ExclusiveLockGuard>
 {
     return {p->mempool, ExclusiveLockGuard{p->mempoolLock}};
 }
+auto Storage::addMempoolTxs(Mempool::NewTxsMap &txs, std::unordered_set<HashX, HashHasher> &scriptHashesAffected,
+                            bool trace) -> MempoolAddResult
+{
+    MempoolAddResult ret;
+    {
+        // We are the mempool's writer: graph-wide operations and other writers are held off while we work, but readers
+        // of scripthashes proceed. Since only the writer modifies `txs` and the shards, we may read them here without
+        // taking the tx map lock or the shard locks.
+        auto writer = mempoolWriter();
+        Mempool & mempool = writer.mempool;
+        // A tx may be added by more than one path (e.g. it was broadcast by one of our clients while a refresh was
+        // downloading it). The first one wins.
+        for (auto it = txs.begin(); it != txs.end(); )
+            if (mempool.txs.count(it->first)) it = txs.erase(it);
+            else ++it;
+        if (txs.empty())
+            return ret;
+
+        // Resolve all of the confirmed prevouts up-front with a single MultiGet, and validate the mempool ones, before
+        // modifying anything.
+        std::unordered_map<TXO, TXOInfo> confirmedPrevouts;
+        {
+            std::vector<TXO> dbTxos;
+            std::vector<const TxHash *> dbTxosSpenders; // parallel to dbTxos, for the error message below
+            for (const auto & [hash, ntx] : txs) {
+                for (const auto & prevTXO : ntx.prevouts) {
+                    if (txs.count(prevTXO.prevoutHash))
+                        continue;
+                    if (auto it = mempool.txs.find(prevTXO.prevoutHash); it != mempool.txs.end()) {
+                        const auto & prevTxRef = it->second;
+                        if (prevTXO.prevoutN >= prevTxRef->txos.size() || !prevTxRef->txos[prevTXO.prevoutN].isValid())
+                            // defensive programming paranoia
+                            throw InternalError(QString("FAILED TO FIND A VALID PREVIOUS TXOUTN %1 IN MEMPOOL for TxHash: %2")
+                                                .arg(prevTXO.prevoutN).arg(QString(prevTXO.prevoutHash.toHex())));
+                        continue;
+                    }
+                    dbTxos.push_back(prevTXO);
+                    dbTxosSpenders.push_back(&hash);
+                }
+            }
+            const auto infos = utxosGetFromDB(dbTxos); // this may throw on low-level db error
+            confirmedPrevouts.reserve(dbTxos.size());
+            for (size_t i = 0; i < dbTxos.size(); ++i) {
+                if (UNLIKELY(!infos[i].has_value()))
+                    // If it wasn't in the mempool or in the db.. either something is very wrong with our code, or the
+                    // tx's parent is not (yet) in our mempool. We throw and the caller deals with it.
+                    throw InternalError(QString("FAILED TO FIND PREVIOUS TX %1 IN EITHER MEMPOOL OR DB for TxHash: %2")
+                                        .arg(dbTxos[i].toString()).arg(QString(dbTxosSpenders[i]->toHex())));
+                confirmedPrevouts.emplace(std::move(dbTxos[i]), *infos[i]);
+            }
+        }
+
+        /// per-shard work for phase 2: the (hashX, tx) links to add, and the parent outputs to mark as spent
+        struct ShardWork {
+            std::vector<std::pair<HashX, Mempool::TxRef>> links;
+            std::vector<Mempool::Tx::Out *> spentOuts;
+        };
+        std::array<ShardWork, Mempool::kNumHashXShards> shardWork;
+        const auto addLink = [&shardWork](const HashX &sh, const Mempool::TxRef &tx) {
+            shardWork[Mempool::hashXShard(sh)].links.emplace_back(sh, tx);
+        };
+        ret.oldNumHashXs = mempool.numHashXs();
+        // Phase 1: build the new tx's and put them in the tx map.
+        auto txsLock = writer.lockTxs();
+        double tLock = Util::getTimeSecs();
+        ret.oldSize = mempool.txs.size();
+        ++mempool.generation;
+        // first, do new outputs for all tx's, and put the new tx's in the mempool struct
+        for (auto & [hash, ntx] : txs) {
+            auto & [tx, ctx, outHashXs, prevouts] = ntx;
+            assert(hash == tx->hash);
+            mempool.txs[tx->hash] = tx; // save tx right now to map, since we need to find it later for possible spends, etc if subsequent tx's refer to this tx.
+            tx->generation = mempool.generation;
+            IONum n = 0;
+            const auto numTxo = ctx->vout.size();
+            if (LIKELY(tx->txos.size() != numTxo)) {
+                // we do it this way (reserve then resize) to avoid the automatic 2^N prealloc of normal vector .resize()
+                tx->txos.reserve(numTxo);
+                tx->txos.resize(numTxo);
+            }
+            assert(outHashXs.size() == numTxo);
+            for (const auto & out : ctx->vout) {
+                auto & txo = tx->txos[n];
+                txo.amount = out.nValue;
+                if (!outHashXs[n].isEmpty()) {
+                    // UTXO only if it's not OP_RETURN -- can't do 'continue' here as that would throw off the 'n' counter
+                    txo.hashXIdx = mempool.internHashX(outHashXs[n]); // outHashXs was computed by Mempool::decodeNewTx()
+                    const HashX & sh = mempool.hashXForIdx(txo.hashXIdx); // the interned copy; keys below share its data
+                    addLink(sh, tx); // save tx to hashx -> tx vector in phase 2 below
+                    scriptHashesAffected.insert(sh);
+                }
+                tx->fee -= out.nValue; // update fee (fee = ins - outs, so we "add" the outs as a negative)
+                ++n;
+            }
+            assert(n == numTxo);
+            // . <-- at this point the .txos vec is built, with everything isValid() except for the OP_RETURN outs, which are all !isValid()
+        }
+        // next, do new inputs for all tx's, debiting/crediting either a mempool tx or the confirmed utxo we looked up above
+        for (auto & [hash, ntx] : txs) {
+            auto & [tx, ctx, outHashXs, prevouts] = ntx;
+            assert(hash == tx->hash);
+            tx->spends.reserve(prevouts.size());
+            for (const auto & prevTXO : prevouts) {
+                const IONum prevN = prevTXO.prevoutN;
+                const TxHash & prevTxId = prevTXO.prevoutHash;
+                Mempool::Tx::Spend spend;
+                spend.txo = prevTXO;
+                if (auto it = mempool.txs.find(prevTxId); it != mempool.txs.end()) {
+                    // prev is a mempool tx (validated above)
+                    tx->hasUnconfirmedParentTx = true; ///< mark the current tx we are processing as having an unconfirmed parent (this is used for sorting later and by the get_mempool & listUnspent code)
+                    auto & prevOut = it->second->txos[prevN];
+                    spend.hashXIdx = prevOut.hashXIdx;
+                    spend.amount = prevOut.amount;
+                    // remove this spend from the utxos of prevTx in mempool (in phase 2, under the lock of its shard)
+                    shardWork[Mempool::hashXShard(mempool.hashXForIdx(prevOut.hashXIdx))].spentOuts.push_back(&prevOut);
+                    if (trace) Debug() << hash.toHex() << " unconfirmed spend: " << prevTXO.toString() << " " << spend.amount.ToString().c_str();
+                } else {
+                    // prev is a confirmed tx, which we looked up above
+                    const auto & info = confirmedPrevouts.at(prevTXO);
+                    spend.confirmed = true;
+                    spend.hashXIdx = mempool.internHashX(info.hashX);
+                    spend.amount = info.amount;
+                    if (trace) Debug() << hash.toHex() << " confirmed spend: " << prevTXO.toString() << " " << spend.amount.ToString().c_str();
+                }
+                tx->fee += spend.amount;
+                const HashX & sh = mempool.hashXForIdx(spend.hashXIdx);
+                addLink(sh, tx); // mark this hashX as having been "touched" because of this input (note we push dupes here out of order but sort and uniqueify in phase 2)
+                scriptHashesAffected.insert(sh);
+                tx->spends.push_back(std::move(spend));
+            }
+            // Tx::spendsFor() relies on this ordering
+            std::sort(tx->spends.begin(), tx->spends.end(), [](const auto &a, const auto &b) { return a.hashXIdx < b.hashXIdx; });
+            mempool.feeHistogramAdd(*tx); // the fee is final now
+        }
+
+        ret.nAdded = txs.size();
+        ret.newSize = mempool.txs.size();
+        txsLock.unlock();
+        ret.lockHeldSecs += Util::getTimeSecs() - tLock;
+
+        // Phase 2: publish to the shards, then sort and uniqueify the data structures made temporarily inconsistent
+        // (have dupes, are out-of-order)
+        for (unsigned i = 0; i < Mempool::kNumHashXShards; ++i) {
+            auto & work = shardWork[i];
+            if (work.links.empty() && work.spentOuts.empty())
+                continue;
+            std::unordered_set<HashX, HashHasher> touched;
+            const auto shardLock = writer.lockShard(i);
+            tLock = Util::getTimeSecs();
+            auto & shard = mempool.hashXTxShards[i];
+            for (auto & [sh, tx] : work.links) {
+                shard[sh].push_back(std::move(tx)); // amortized constant time insert at end
+                touched.insert(sh);
+            }
+            for (auto * out : work.spentOuts)
+                out->spentInMempool = true;
+            for (const auto & sh : touched)
+                Util::sortAndUniqueify<Mempool::TxRefOrdering>(shard[sh]);
+            ret.lockHeldSecs += Util::getTimeSecs() - tLock;
+        }
+
+        ret.newNumHashXs = mempool.numHashXs();
+    } // release mempool locks
+    refreshMempoolHistogram(); // this is O(fee rate buckets) so it's cheap to keep it current after each add
+    return ret;
+}
 
 void Storage::refreshMempoolHistogram()
 {
     Mempool::FeeHistogramVec hist;
     {
-        // shared lock
-        auto [mempool, lock] = this->mempool();
-        auto histTmp = mempool.calcCompactFeeHistogram();
+        // feeRateBuckets only needs the tx map lock (shared), plus the global lock so that it isn't cleared under us
+        SharedLockGuard g(p->mempoolLock), g2(p->mempoolTxsLock);
+        auto histTmp = p->mempool.calcCompactFeeHistogram();
         hist.swap(histTmp);
     }
-    // lock exclusively to do the final swap
-    ExclusiveLockGuard g(p->mempoolLock);
+    LockGuard g(p->mempoolFeeHistogramLock);
     p->mempoolFeeHistogram.swap(hist);
 }
 
 auto Storage::mempoolHistogram() const -> Mempool::FeeHistogramVec
 {
-    SharedLockGuard g(p->mempoolLock);
+    LockGuard g(p->mempoolFeeHistogramLock);
     return p->mempoolFeeHistogram;
 }
 
@@ -2172,76 +4359,109 @@ namespace {
     }
 
     struct UndoInfoSerHeader {
-        static constexpr uint16_t defMagic = 0xf12c, defVer = 0x1;
+        static constexpr uint16_t defMagic = 0xf12c, defVer = 0x2, legacyVer = 0x1;
         uint16_t magic = defMagic; ///< sanity check
         uint16_t ver = defVer; ///< sanity check
         uint32_t len = 0; ///< the length of the entire buffer, including this struct and all data to follow. A sanity check.
         uint32_t nScriptHashes = 0, nAddUndos = 0, nDelUndos = 0; ///< the number of elements in each of the 3 arrays in question.
 
-        static constexpr size_t addUndoItemSerSize = TXO::serSize() + HashLen + CompactTXO::serSize();
-        static constexpr size_t delUndoItemSerSize = TXO::serSize() + TXOInfo::serSize();
+        // the below are only used for legacyVer (version 1) undo infos, which used fixed-size items
+        static constexpr size_t addUndoItemSerSizeV1 = TXO::serSize() + HashLen + CompactTXO::serSize();
+        static constexpr size_t delUndoItemSerSizeV1 = TXO::serSize() + TXOInfo::serSize();
 
-        /// computes the total size given the ser size of the blkInfo struct. Requires that nScriptHashes, nAddUndos, and nDelUndos be already filled-in.
-        size_t computeTotalSize() const {
+        /// computes the fixed-size prefix common to all versions: this struct, height, hash, and blkInfo
+        static constexpr size_t prefixSize() { return sizeof(UndoInfoSerHeader) + sizeof(UndoInfo::height) + HashLen + sizeof(BlkInfo); }
+        /// (legacyVer only) computes the total size. Requires that nScriptHashes, nAddUndos, and nDelUndos be already filled-in.
+        size_t computeTotalSizeV1() const {
             const auto shSize = nScriptHashes * HashLen;
-            const auto addsSize = nAddUndos * addUndoItemSerSize;
-            const auto delsSize = nDelUndos * delUndoItemSerSize;
-            return sizeof(*this) + sizeof(UndoInfo::height) + HashLen + sizeof(BlkInfo) + shSize + addsSize + delsSize;
+            const auto addsSize = nAddUndos * addUndoItemSerSizeV1;
+            const auto delsSize = nDelUndos * delUndoItemSerSizeV1;
+            return prefixSize() + shSize + addsSize + delsSize;
         }
-        bool isLenSane() const { return size_t(len) == computeTotalSize(); }
+        bool isLenSane() const { return ver == legacyVer ? size_t(len) == computeTotalSizeV1() : size_t(len) > prefixSize(); }
     };
 
     // UndoInfo
+    //
+    // Version 2 layout (all varints are as per AppendVarInt):
+    //   header | height | hash (32) | blkInfo | varint nExtraHashXs | hashX table: (nScriptHashes + nExtraHashXs) * 32
+    //   addUndos: varint hashXIdx, varint txNum - blkInfo.txNum0, varint N
+    //   delUndos: varint N, varint hashXIdx, varint amount, varint txNum, varint (height - confirmedHeight + 1) or 0
+    // The first nScriptHashes entries in the table are the UndoInfo::scriptHashes set. The TXO prevoutHashes are not
+    // stored; they are recovered from the txNum2txHash file (see ResolveUndoTxHashes).
     template <> QByteArray Serialize(const UndoInfo &u) {
         UndoInfoSerHeader hdr;
-        // fill these in now so that hdr.computeTotalSize works
         hdr.nScriptHashes = uint32_t(u.scriptHashes.size());
         hdr.nAddUndos = uint32_t(u.addUndos.size());
         hdr.nDelUndos = uint32_t(u.delUndos.size());
-        hdr.len = uint32_t(hdr.computeTotalSize());
         QByteArray ret;
-        ret.reserve(int(hdr.len));
-        // 1. header
+        const auto fail = [&ret](const char *why) {
+            Warning() << "Serialize UndoInfo fail: " << why << ". FIXME!";
+            ret.clear();
+            return ret;
+        };
+        if (u.hash.length() != HashLen)
+            return fail("hash is not 32 bytes");
+
+        // build the deduplicated hashX table, starting with the scriptHashes set
+        std::vector<const HashX *> table;
+        std::unordered_map<HashX, uint32_t, HashHasher> tableIdx;
+        table.reserve(u.scriptHashes.size());
+        tableIdx.reserve(u.scriptHashes.size());
+        for (const auto & sh : u.scriptHashes) {
+            if (UNLIKELY(sh.length() != HashLen)) return fail("scripthash is not 32 bytes");
+            tableIdx.emplace(sh, uint32_t(table.size()));
+            table.push_back(&sh);
+        }
+        const auto IdxOf = [&table, &tableIdx](const HashX &hashX) {
+            // normally every hashX is in the scriptHashes set, but we tolerate ones that aren't as "extras"
+            const auto [it, inserted] = tableIdx.try_emplace(hashX, uint32_t(table.size()));
+            if (inserted) table.push_back(&it->first);
+            return it->second;
+        };
+
+        // encode the add/del undos first since they may append "extras" to the table
+        QByteArray body;
+        body.reserve(int(u.addUndos.size() * 6 + u.delUndos.size() * 14)); // heuristic
+        for (const auto & [txo, hashX, ctxo] : u.addUndos) {
+            if (UNLIKELY(hashX.length() != HashLen)) return fail("hashX is not 32 bytes");
+            if (UNLIKELY(ctxo.txNum() < u.blkInfo.txNum0)) return fail("addUndo txNum is before this block");
+            AppendVarInt(body, IdxOf(hashX));
+            AppendVarInt(body, ctxo.txNum() - u.blkInfo.txNum0);
+            AppendVarInt(body, ctxo.N());
+        }
+        for (const auto & [txo, info] : u.delUndos) {
+            if (UNLIKELY(!info.isValid())) return fail("delUndo TXOInfo is invalid");
+            if (UNLIKELY(info.confirmedHeight.value_or(0) > u.height)) return fail("delUndo height is after this block");
+            AppendVarInt(body, txo.prevoutN);
+            AppendVarInt(body, IdxOf(info.hashX));
+            AppendVarInt(body, uint64_t(info.amount / bitcoin::Amount::satoshi()));
+            AppendVarInt(body, info.txNum);
+            AppendVarInt(body, info.confirmedHeight.has_value() ? uint64_t(u.height - *info.confirmedHeight) + 1 : 0);
+        }
+        const uint64_t nExtras = table.size() - u.scriptHashes.size();
+
+        ret.reserve(int(hdr.prefixSize() + kMaxVarIntSize + table.size() * HashLen) + body.size());
+        // 1. header (len is filled-in at the end)
         ret.append(ShallowTmp(&hdr));
         // 2. .height
         ret.append(SerializeScalarNoCopy(u.height));
         // 3. .hash
-        const auto chkHashLen = [&ret](const QByteArray & hash) -> bool {
-            if (hash.length() != HashLen) {
-                Warning() << "hash is not " << HashLen << " bytes. Serialize UndoInfo fail. FIXME!";
-                ret.clear();
-                return false;
-            }
-            return true;
-        };
-        if (!chkHashLen(u.hash)) return ret;
         ret.append(u.hash);
         // 4. .blkInfo
-        const QByteArray blkInfoBytes = Serialize(u.blkInfo);
-        ret.append(blkInfoBytes);
-        // 5. .scriptHashes, 32 bytes each, for all in set
-        for (const auto & sh : u.scriptHashes) {
-            if (UNLIKELY(!chkHashLen(sh))) return ret;
-            ret.append(sh);
-        }
-        // 6. .addUndos, 64 bytes each * nAddUndos
-        for (const auto & [txo, hashX, ctxo] : u.addUndos) {
-            if (UNLIKELY(!chkHashLen(hashX))) return ret;
-            ret.append(Serialize(txo));
-            ret.append(hashX);
-            ret.append(Serialize(ctxo));
-        }
-        // 7. .delUndos, 50 bytes each * nDelUndos
-        for (const auto & [txo, txoInfo] : u.delUndos) {
-            ret.append(Serialize(txo));
-            if (UNLIKELY(!chkHashLen(txoInfo.hashX))) return ret;
-            ret.append(Serialize(txoInfo));
-        }
-        assert(ret.length() == int(hdr.len));
+        ret.append(Serialize(u.blkInfo));
+        // 5. hashX table, 32 bytes each
+        AppendVarInt(ret, nExtras);
+        for (const auto *hashX : table)
+            ret.append(*hashX);
+        // 6. & 7. the varint-encoded .addUndos and .delUndos
+        ret.append(body);
+        reinterpret_cast<UndoInfoSerHeader *>(ret.data())->len = uint32_t(ret.size());
         return ret;
     }
 
-    // UndoInfo -- note this will fail if the byte array has extra bytes at the end
+    // UndoInfo -- note this will fail if the byte array has extra bytes at the end. Accepts both the current and the
+    // legacy (version 1) format. For the current format, the returned UndoInfo has txHashesMissing = true.
     template <> UndoInfo Deserialize(const QByteArray &ba, bool *ok) {
         UndoInfo ret;
         const auto setOk = [&ok, &ret] (bool b) { if (ok) *ok = b; if (!b) ret.clear(); };
@@ -2257,7 +4477,8 @@ namespace {
 
         // 1. .header
         const UndoInfoSerHeader *hdr = reinterpret_cast<decltype (hdr)>(ba.data());
-        if (!chkAssertion(int(hdr->len) == ba.size() && hdr->magic == hdr->defMagic && hdr->ver == hdr->defVer
+        if (!chkAssertion(int(hdr->len) == ba.size() && hdr->magic == hdr->defMagic
+                          && (hdr->ver == hdr->defVer || hdr->ver == hdr->legacyVer)
                           && hdr->isLenSane(), "Header sanity check fail"))
             return ret;
 
@@ -2278,40 +4499,95 @@ namespace {
         if (!chkAssertion(myok && cur <= end))
             return ret;
         cur += sizeof(BlkInfo);
-        // 5. .scriptHashes, 32 bytes each * hdr->nScriptHashes
+
+        if (hdr->ver == hdr->legacyVer) {
+            // 5. .scriptHashes, 32 bytes each * hdr->nScriptHashes
+            ret.scriptHashes.reserve(hdr->nScriptHashes);
+            for (unsigned i = 0; i < hdr->nScriptHashes; ++i) {
+                if (!chkAssertion(cur+HashLen <= end)) return ret;
+                ret.scriptHashes.insert(DeepCpy(cur, HashLen)); // deep copy
+                cur += HashLen;
+            }
+            // 6. .addUndos, 64 bytes each * nAddUndos
+            ret.addUndos.reserve(hdr->nAddUndos);
+            for (unsigned i = 0; i < hdr->nAddUndos; ++i) {
+                if (!chkAssertion(cur+TXO::serSize() <= end)) return ret;
+                TXO txo = Deserialize<TXO>(ShallowTmp(cur, TXO::serSize()), &myok);
+                cur += TXO::serSize();
+                if (!chkAssertion(myok && cur+HashLen <= end)) return ret;
+                QByteArray hashX = DeepCpy(cur, HashLen); // deep copy
+                cur += HashLen;
+                if (!chkAssertion(cur+CompactTXO::serSize() <= end)) return ret;
+                CompactTXO ctxo = Deserialize<CompactTXO>(ShallowTmp(cur, CompactTXO::serSize()), &myok);
+                cur += CompactTXO::serSize();
+                if (!chkAssertion(myok)) return ret;
+                ret.addUndos.emplace_back(std::move(txo), std::move(hashX), std::move(ctxo));
+            }
+            // 7. .delUndos, 50 bytes each * nDelUndos
+            ret.delUndos.reserve(hdr->nDelUndos);
+            for (unsigned i = 0; i < hdr->nDelUndos; ++i) {
+                if (!chkAssertion(cur+TXO::serSize() <= end)) return ret;
+                TXO txo = Deserialize<TXO>(ShallowTmp(cur, TXO::serSize()), &myok);
+                cur += TXO::serSize();
+                if (!chkAssertion(myok && cur+TXOInfo::serSize() <= end)) return ret;
+                TXOInfo info = Deserialize<TXOInfo>(ShallowTmp(cur, TXOInfo::serSize()), &myok);
+                cur += TXOInfo::serSize();
+                if (!chkAssertion(myok)) return ret;
+                ret.delUndos.emplace_back(std::move(txo), std::move(info));
+            }
+            chkAssertion(cur == end, "cur != end");
+            setOk(true);
+            return ret;
+        }
+
+        // 5. hashX table, 32 bytes each * (hdr->nScriptHashes + nExtras)
+        uint64_t nExtras;
+        if (!chkAssertion(ReadVarInt(cur, end, nExtras) && uint64_t(hdr->nScriptHashes) + nExtras <= uint64_t(end - cur) / HashLen,
+                          "Bad hashX table size"))
+            return ret;
+        const size_t tableSize = hdr->nScriptHashes + size_t(nExtras);
+        std::vector<HashX> table;
+        table.reserve(tableSize);
         ret.scriptHashes.reserve(hdr->nScriptHashes);
-        for (unsigned i = 0; i < hdr->nScriptHashes; ++i) {
-            if (!chkAssertion(cur+HashLen <= end)) return ret;
-            ret.scriptHashes.insert(DeepCpy(cur, HashLen)); // deep copy
+        for (size_t i = 0; i < tableSize; ++i) {
+            table.push_back(DeepCpy(cur, HashLen)); // deep copy
             cur += HashLen;
+            if (i < hdr->nScriptHashes)
+                ret.scriptHashes.insert(table.back()); // implicitly shared with the table entry
         }
-        // 6. .addUndos, 64 bytes each * nAddUndos
+        // every add undo is at least 3 bytes and every del undo at least 5 bytes -- check before we reserve
+        if (!chkAssertion(size_t(hdr->nAddUndos) * 3 + size_t(hdr->nDelUndos) * 5 <= size_t(end - cur), "Short byte count for undos"))
+            return ret;
+        // 6. .addUndos
         ret.addUndos.reserve(hdr->nAddUndos);
         for (unsigned i = 0; i < hdr->nAddUndos; ++i) {
-            if (!chkAssertion(cur+TXO::serSize() <= end)) return ret;
-            TXO txo = Deserialize<TXO>(ShallowTmp(cur, TXO::serSize()), &myok);
-            cur += TXO::serSize();
-            if (!chkAssertion(myok && cur+HashLen <= end)) return ret;
-            QByteArray hashX = DeepCpy(cur, HashLen); // deep copy
-            cur += HashLen;
-            if (!chkAssertion(cur+CompactTXO::serSize() <= end)) return ret;
-            CompactTXO ctxo = Deserialize<CompactTXO>(ShallowTmp(cur, CompactTXO::serSize()), &myok);
-            cur += CompactTXO::serSize();
-            if (!chkAssertion(myok)) return ret;
-            ret.addUndos.emplace_back(std::move(txo), std::move(hashX), std::move(ctxo));
+            uint64_t idx, txNumOffset, n;
+            if (!chkAssertion(ReadVarInt(cur, end, idx) && ReadVarInt(cur, end, txNumOffset) && ReadVarInt(cur, end, n)
+                              && idx < tableSize && txNumOffset < ret.blkInfo.nTx && n <= std::numeric_limits<IONum>::max(),
+                              "Bad addUndo"))
+                return ret;
+            const auto txNum = ret.blkInfo.txNum0 + txNumOffset;
+            ret.addUndos.emplace_back(TXO{{}, IONum(n)}, table[idx], CompactTXO(txNum, IONum(n)));
         }
-        // 7. .delUndos, 50 bytes each * nDelUndos
+        // 7. .delUndos
         ret.delUndos.reserve(hdr->nDelUndos);
         for (unsigned i = 0; i < hdr->nDelUndos; ++i) {
-            if (!chkAssertion(cur+TXO::serSize() <= end)) return ret;
-            TXO txo = Deserialize<TXO>(ShallowTmp(cur, TXO::serSize()), &myok);
-            cur += TXO::serSize();
-            if (!chkAssertion(myok && cur+TXOInfo::serSize() <= end)) return ret;
-            TXOInfo info = Deserialize<TXOInfo>(ShallowTmp(cur, TXOInfo::serSize()), &myok);
-            cur += TXOInfo::serSize();
-            if (!chkAssertion(myok)) return ret;
-            ret.delUndos.emplace_back(std::move(txo), std::move(info));
+            uint64_t n, idx, amt, txNum, heightCode;
+            if (!chkAssertion(ReadVarInt(cur, end, n) && ReadVarInt(cur, end, idx) && ReadVarInt(cur, end, amt)
+                              && ReadVarInt(cur, end, txNum) && ReadVarInt(cur, end, heightCode)
+                              && n <= std::numeric_limits<IONum>::max() && idx < tableSize
+                              && amt <= uint64_t(std::numeric_limits<int64_t>::max()) && heightCode <= uint64_t(ret.height) + 1,
+                              "Bad delUndo"))
+                return ret;
+            TXOInfo info;
+            info.amount = int64_t(amt) * bitcoin::Amount::satoshi();
+            info.hashX = table[idx];
+            if (heightCode)
+                info.confirmedHeight.emplace(unsigned(ret.height - (heightCode - 1)));
+            info.txNum = txNum;
+            ret.delUndos.emplace_back(TXO{{}, IONum(n)}, std::move(info));
         }
+        ret.txHashesMissing = true;
         chkAssertion(cur == end, "cur != end");
         setOk(true);
         return ret;
@@ -2319,17 +4595,56 @@ namespace {
 
     template <> QByteArray Serialize(const TxNumVec &v)
     {
-        // this serializes a vector of TxNums to a compact representation (6 bytes, eg 48 bits per TxNum), in little endian byte order
-        QByteArray ret(int(v.size()*6), Qt::Uninitialized);
-        uint8_t *cur = reinterpret_cast<uint8_t *>(ret.data());
+        QByteArray ret;
+        if (v.empty())
+            return ret;
+        ret.reserve(int(v.size() * 3 + kTxNumVecTrailerSize)); // heuristic: most deltas fit in <= 3 bytes
+        TxNum prev = 0;
         for (const auto num : v) {
-            CompactTXO::txNumToCompactBytes(cur, num);
-            cur += 6;
+            if (UNLIKELY(num < prev)) {
+                Warning() << "Serialize TxNumVec called with an unsorted vector. FIXME!";
+                ret.clear();
+                return ret;
+            }
+            AppendVarInt(ret, num - prev);
+            prev = num;
         }
+        // trailer: last txNum as 6 bytes, little endian
+        uint8_t trailer[kTxNumVecTrailerSize];
+        CompactTXO::txNumToCompactBytes(trailer, prev);
+        ret.append(reinterpret_cast<const char *>(trailer), int(kTxNumVecTrailerSize));
         return ret;
     }
-    // this deserializes a vector of TxNums from a compact representation (6 bytes, eg 48 bits per TxNum), assuming little endian byte order
     template <> TxNumVec Deserialize (const QByteArray &ba, bool *ok)
+    {
+        TxNumVec ret;
+        if (ba.isEmpty()) {
+            if (ok) *ok = true;
+            return ret;
+        }
+        if (size_t(ba.size()) <= kTxNumVecTrailerSize) {
+            if (ok) *ok = false;
+            return ret;
+        }
+        const char *cur = ba.constData(), *const end = ba.constData() + ba.size() - kTxNumVecTrailerSize;
+        ret.reserve(size_t(end - cur) / 2 + 1); // heuristic; deltas are usually 2-3 bytes
+        TxNum acc = 0;
+        uint64_t delta;
+        while (cur < end) {
+            if (UNLIKELY(!ReadVarInt(cur, end, delta))) {
+                if (ok) *ok = false;
+                ret.clear();
+                return ret;
+            }
+            acc += delta;
+            ret.push_back(acc);
+        }
+        const bool trailerOk = acc == CompactTXO::txNumFromCompactBytes(reinterpret_cast<const uint8_t *>(end));
+        if (ok) *ok = trailerOk;
+        if (!trailerOk) ret.clear();
+        return ret;
+    }
+    TxNumVec DeserializeTxNumVecV1(const QByteArray &ba, bool *ok)
     {
         const size_t blen = size_t(ba.length());
         const size_t N = blen / 6;
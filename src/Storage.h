@@ -36,12 +36,15 @@
 
 #include <QByteArray>
 #include <QFlags>
+#include <QVariantMap>
 
+#include <array>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <shared_mutex>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -96,9 +99,13 @@ public:
     /// 100 mln max headers for now.
     static constexpr size_t MAX_HEADERS = 100000000;
 
-    /// Hard-coded to 100 blocks of undo. TODO: have this come from actual config, and take into account
-    /// BTC::MaxReorgDepth (10) as a minimum.
-    inline unsigned configuredUndoDepth() const { return 100; }
+    /// The number of blocks from the tip for which undo info is kept. Comes from config db_undo_depth (default: 100,
+    /// minimum: BTC::MaxReorgDepth (10)).
+    inline unsigned configuredUndoDepth() const { return options->db.undoDepth; }
+    /// Thread-safe. The height of the oldest block we have undo info for (so the lowest height we can rewind to is one
+    /// below this), or nothing if there is no undo info at all. This may be further back than configuredUndoDepth()
+    /// (undos are pruned in batches), or less far back (e.g. right after db_undo_depth was raised).
+    std::optional<BlockHeight> earliestUndoHeight() const;
 
 
     /// Thread safe. May hit the database (or touch a cache).  Returns the header for the given height or nothing if
@@ -109,6 +116,32 @@ public:
     /// since it uses the RocksDB MultiGet API. Does not throw.
     std::vector<Header> headersFromHeight(BlockHeight height, unsigned count, QString *err = nullptr) const;
 
+    /// A read-only, zero-copy slice of consecutive raw headers, pointing straight into the in-RAM header array (see
+    /// config db_headers_in_ram). It keeps the memory it points to alive for as long as it exists, so it stays valid
+    /// (and unchanged) even if blocks are added or undone in the meantime.
+    class HeadersSlice {
+    public:
+        bool isEmpty() const { return !n; }
+        unsigned count() const { return n; }
+        size_t headerSize() const { return hdrSize; }
+        /// Pointer to count() * headerSize() contiguous bytes
+        const char *data() const { return ptr; }
+        /// Returns header i in this slice as a deep copy
+        Header header(unsigned i) const { return i < n ? Header(ptr + i * hdrSize, int(hdrSize)) : Header(); }
+    private:
+        friend class Storage;
+        std::shared_ptr<const void> keepAlive;
+        const char *ptr = nullptr;
+        unsigned n = 0;
+        size_t hdrSize = 0;
+    };
+    /// Like headersFromHeight, but returns a zero-copy slice. Thread safe, does no I/O. Returns an empty slice if the
+    /// in-RAM header array is disabled, or if no headers in the specified range exist; callers should fall back to
+    /// headersFromHeight in the former case.
+    HeadersSlice headersSliceFromHeight(BlockHeight height, unsigned count) const;
+    /// Returns true if the headers are also kept in RAM (config db_headers_in_ram)
+    bool headersInRam() const;
+
     /// Implicitly takes a lock to return this. Thread safe. Breakdown of info returned:
     ///   .first - the latest valid height we have synched or -1 if no headers.
     ///   .second - the latest valid chainTip 32-byte sha256 double hash of the header (the chainTip as it's called in
@@ -145,7 +178,7 @@ public:
     ///
     /// The most likely failure reason would be a HeaderVerificationFailure (due to a reorg).  If
     /// HeaderVerificationFailure is thrown, the db and Storage state is sane and the caller can/should proceed
-    /// to try and rewind the blocks in the db via successive calls to undoLatestBlock().
+    /// to try and rewind the blocks in the db via undoLatestBlocks() (or successive calls to undoLatestBlock()).
     ///
     /// If any other exception is thrown, the db and Storage state is not guaranteed to be in a sane state and the
     /// user will probably have to resynch the entire chain. (TODO FIXME).
@@ -166,17 +199,30 @@ public:
     ///  the same int value as latestTip().first).
     BlockHeight undoLatestBlock(bool notifySubs = false);
 
+    /// Thread-safe.  Like the above, but undoes the latest nBlocks blocks in one go: all the undo infos are read and
+    /// checked up-front, each affected scripthash history is rewritten once, the utxo and undo updates are
+    /// each committed as a single batch, the headers, txNum and blkinfos files are truncated once, and a single coalesced set
+    /// of scripthash notifications is emitted (if notifySubs).  Used by the Controller on reorg once it has located
+    /// the fork point.  Throws on the same conditions as undoLatestBlock() (including if fewer than nBlocks blocks
+    /// have undo info), in which case nothing has been modified unless a low-level database error occurred.
+    ///
+    /// Returns the new BlockHeight, which is the current height - nBlocks.
+    BlockHeight undoLatestBlocks(unsigned nBlocks, bool notifySubs = false);
+
     /// returns the "next" TxNum (thread safe)
     TxNum getTxNum() const;
 
     /// Helper for TxNum. Resolve a 64-bit TxNum to a TxHash -- this may throw a DatabaseError if throwIfMissing=true (thread safe, takes no class-level locks)
     std::optional<TxHash> hashForTxNum(TxNum, bool throwIfMissng = false, bool *wasCached = nullptr, bool skipCache = false) const;
     /// Given a TxNum, returns the block height for the TxNum's block (if it exists).
-    /// Used to resolve scripthash_history -> block height for get_history. (thread safe, takes blkInfo lock)
+    /// Used to resolve scripthash_history -> block height for get_history. (thread safe, lock-free)
     std::optional<unsigned> heightForTxNum(TxNum) const;
+    /// Thread-safe. Batched version of hashForTxNum: returns the TxHashes for txNums, in the same order. Cache misses
+    /// are read from the txnum2txhash file in one pass, in file order. Throws DatabaseError if any are missing.
+    std::vector<TxHash> hashesForTxNums(const std::vector<TxNum> &txNums) const;
     /// Given a block height and a position in the block (txIdx), return a TxHash.  Never throws. Returns !has_value if
     /// height/posInBlock pair is not found (or in very unlikely cases, if there was an underlying low-level error).
-    /// Thread safe, takes class-level locks.
+    /// Thread safe. Reads from the latest published view so it's not blocked by addBlock.
     std::optional<TxHash> hashForHeightAndPos(BlockHeight height, unsigned posInBlock) const;
 
     /// Given a block height, return all of the TxHashes in a block, in bitcoind memory order.
@@ -188,7 +234,7 @@ public:
     /// Never throws. Returns an empty vector if height is not found (or in very unlikely cases, if there was an
     /// underlying low-level error).
     ///
-    /// Thread safe, takes class-level locks.
+    /// Thread safe. Reads from the latest published view so it's not blocked by addBlock.
     std::vector<TxHash> txHashesForBlockInBitcoindMemoryOrder(BlockHeight height) const;
 
     /// Returns the known size of the utxo set (for now this is a signed value -- to debug underflow errors)
@@ -209,8 +255,15 @@ public:
     using History = std::vector<HistoryItem>;
 
     /// Thread-safe. Will return an empty vector if the confirmed history size exceeds MaxHistory, or a truncated
-    /// vector if the confirmed + unconfirmed history exceeds MaxHistory.
+    /// vector if the confirmed + unconfirmed history exceeds MaxHistory. Reads a consistent snapshot of the db as of
+    /// the last block committed, so it is never blocked by a block being added (only by a reorg rewind).
     History getHistory(const HashX &, bool includeConfirmed, bool includeMempool) const;
+    /// Thread-safe. Batched getHistory(hashX, true, true) for many scripthashes (used by bulk subscribe). The confirmed
+    /// histories are read with a single MultiGet (in key order), all of their TxNums are resolved together via
+    /// hashesForTxNums(), and the mempool is read under one lock acquisition. Returns a vector parallel to `hashXs`.
+    /// As with getHistory, an entry is empty if its history exceeds MaxHistory. Unlike getHistory, this throws on db
+    /// error (rather than returning empty histories which callers can't tell apart from "no history").
+    std::vector<History> getHistories(const std::vector<HashX> &hashXs) const;
 
     struct UnspentItem : HistoryItem {
         IONum tx_pos = 0;
@@ -237,13 +290,80 @@ public:
     /// if there was a reorg and cp_height is no longer <= chain height.
     Merkle::BranchAndRootPair headerBranchAndRoot(unsigned height, unsigned cp_height);
 
-    /// Caller must hold the returned SharedLockGuard for as long as they use the reference otherwise bad things happen!
-    std::pair<const Mempool &, SharedLockGuard> mempool() const;
-    /// Caller must hold the returned ExclusiveLockGuard for as long as they use the reference otherwise bad things happen!
+    // -- Mempool locking
+    //
+    // The mempool is guarded by several locks, always taken in this order:
+    //   1. a global lock: taken exclusively only for graph-wide operations (clearing the mempool on a new block or a
+    //      drop, restoring it at startup -- see mutableMempool()), and shared by everything else.
+    //   2. the tx map lock: guards Mempool::txs, hashXTable, hashXIdxMap, feeRateBuckets and generation.
+    //   3. one lock per Mempool::hashXTxShards shard: guards that shard, and the Tx::Out::spentInMempool flags of the
+    //      outputs whose scripthash lives in it.
+    // Readers of a single scripthash thus only contend with the writer while it updates that scripthash's shard.
+    // A lock that comes later in this order must never be held while taking one that comes earlier (even in shared
+    // mode), since a writer may be waiting on them in this order.
+
+    /// Holds all of the mempool locks in shared mode.
+    struct MempoolReadLock {
+        SharedLockGuard global, txs;
+        std::array<SharedLockGuard, Mempool::kNumHashXShards> shards;
+    };
+    /// For whole-mempool readers (stats, debug, etc). Caller must hold the returned lock for as long as they use the
+    /// reference otherwise bad things happen!
+    std::pair<const Mempool &, MempoolReadLock> mempool() const;
+
+    /// Holds the global mempool lock and one shard lock in shared mode.
+    struct MempoolHashXReadLock {
+        SharedLockGuard global, shard;
+    };
+    /// For readers of a single scripthash (get_history, get_balance, listunspent). Only Mempool::txsForHashX(hashX),
+    /// and the Tx's it returns, may be accessed while holding the returned lock. If `idx` is not nullptr, it is set to
+    /// the interned index of `hashX` (Mempool::NoHashXIdx if it is not in the mempool).
+    std::pair<const Mempool &, MempoolHashXReadLock> mempoolForHashX(const HashX &hashX, Mempool::HashXIdx *idx = nullptr) const;
+
+    /// Takes the global mempool lock exclusively, for graph-wide operations. Caller must hold the returned
+    /// ExclusiveLockGuard for as long as they use the reference otherwise bad things happen!
     std::pair<Mempool &, ExclusiveLockGuard> mutableMempool();
 
+    /// Access for an incremental mempool writer (such as SynchMempoolTask), which adds tx's without blocking the readers
+    /// of unrelated scripthashes. Writers are serialized with each other, and hold the global lock in shared mode
+    /// (so graph-wide operations wait for them). Mutations must additionally be done under lockTxs() and/or
+    /// lockShard(), as described above. Do not call mempool() or mempoolForHashX() while holding one of these.
+    class MempoolWriter {
+    public:
+        Mempool & mempool;
+        ExclusiveLockGuard lockTxs() const { return ExclusiveLockGuard(txsLock); }
+        ExclusiveLockGuard lockShard(unsigned shard) const { return ExclusiveLockGuard(shardLocks[shard]); }
+    private:
+        friend class Storage;
+        MempoolWriter(Mempool &m, Lock &writerLock, RWLock &globalLock, RWLock &txsLock, RWLock *shardLocks)
+            : mempool(m), writerGuard(writerLock), globalGuard(globalLock), txsLock(txsLock), shardLocks(shardLocks) {}
+        LockGuard writerGuard;
+        SharedLockGuard globalGuard;
+        RWLock &txsLock;
+        RWLock *shardLocks;
+    };
+    MempoolWriter mempoolWriter();
+
+    /// Returned by addMempoolTxs() below
+    struct MempoolAddResult {
+        size_t nAdded = 0; ///< the number of tx's actually added (tx's that were already in the mempool are skipped)
+        size_t oldSize = 0, newSize = 0, oldNumHashXs = 0, newNumHashXs = 0;
+        double lockHeldSecs = 0.; ///< the sum of the time the tx map lock and each shard lock were held exclusively
+    };
+    /// Adds the decoded tx's in `txs` to the mempool, wiring up their inputs to the mempool tx's or confirmed utxos
+    /// they spend (the latter are looked up with a single MultiGet). Tx's already in the mempool are skipped (and
+    /// erased from `txs`). Every scripthash touched is inserted into `scriptHashesAffected`. Takes a MempoolWriter.
+    ///
+    /// Throws InternalError, before anything is modified, if a prevout can't be found in either the mempool or the
+    /// db. May also throw DatabaseError. Thread-safe; called by SynchMempoolTask and after a successful tx broadcast.
+    MempoolAddResult addMempoolTxs(Mempool::NewTxsMap &txs, std::unordered_set<HashX, HashHasher> &scriptHashesAffected,
+                                   bool trace = false);
+
     /// Thread-safe. Query db for a UTXO, and return it if found.  May throw on database error.
     std::optional<TXOInfo> utxoGetFromDB(const TXO &, bool throwIfMissing = false);
+    /// Thread-safe. Batched version of the above using a single RocksDB MultiGet. The returned vector is parallel to
+    /// `txos`; missing UTXOs are returned as empty optionals. Throws DatabaseError on low-level db error.
+    std::vector<std::optional<TXOInfo>> utxosGetFromDB(const std::vector<TXO> &txos);
 
     /// This pointer is guaranteed to always be valid once this instance has been constructed. It points to the
     /// subsmgr unique_ptr which this instance owns.
@@ -269,8 +389,25 @@ public:
     /// optionally indented by `indent*indentLevel` spaces.  If indent is 0, the output will all be on 1 line with no padding.
     size_t dumpAllScriptHashes(QIODevice *outDev, unsigned indent=0, unsigned indentLevel=0, const DumpProgressFunc & = {}, size_t progInterval = 100000) const;
 
+    // --- Snapshot export/import (used to bootstrap new servers quickly)
+
+    /// Thread-safe, but it holds the blocks lock (shared) for as long as it takes to checkpoint all of the db's and
+    /// copy the RecordFiles, so no blocks may be added or undone in the meantime. Exports a consistent snapshot of the
+    /// database at the current tip to directory `dirName` (which must not exist or must be empty): a RocksDB
+    /// checkpoint of each table, copies of the headers and txnum2txhash files, and a manifest.json with the height,
+    /// tip hash, and a SHA256 hash of each table. Returns the manifest. Throws on error.
+    QVariantMap exportSnapshot(const QString &dirName) const;
+
+    /// Thread-safe. If the database was imported from a snapshot (--import-snapshot) and it has not yet been checked
+    /// against bitcoind's chain, returns the snapshot height. The Controller checks bitcoind's block hash at this height
+    /// before synching, and calls setSnapshotVerified() if it matches.
+    std::optional<BlockHeight> unverifiedSnapshotHeight() const;
+    /// Thread-safe. Marks the imported snapshot as verified (persisted to the meta db). May throw on db error.
+    void setSnapshotVerified();
+
 protected:
     virtual Stats stats() const override; ///< from StatsMixin
+    void on_started() override; ///< from ThreadObjectMixin
 
     // -- Header and misc
 
@@ -305,7 +442,7 @@ protected:
 
 
     /// Internally called by addBlock. Call this with the heaverVerifier lock held.
-    /// Appends header h to the database at height. Note that it is undefined to call this function
+    /// Appends header h to the database (and the in-RAM header array, if enabled) at height. Note that it is undefined to call this function
     /// if height already exists in the database or if height is more than 1+ latestTip().first. For internal use
     /// in addBlock, basically.
     void appendHeader(const Header &h, BlockHeight height);
@@ -335,10 +472,73 @@ private:
     void save_impl(SaveSpec override = SaveItem::None); ///< may abort app on database failure (unlikely).
     void saveMeta_impl(); ///< This may throw if db error. Caller should hold locks or be in single-threaded mode.
 
+    /// Reads and checks the meta db, writing a new one if missing. Returns the on-disk format version if it is older
+    /// than the current version and must be upgraded via upgradeDB(). May throw -- called from startup().
+    std::optional<uint32_t> loadCheckMeta();
+    /// Upgrades the on-disk format in-place from fromVersion to the current version, in one pass. May throw -- called
+    /// from startup() after all db's are open.
+    void upgradeDB(uint32_t fromVersion);
+
+    /// Called by addBlock with all locks held. Deletes the undo infos for heights [earliestUndoHeight, expireHeight]
+    /// using a single DeleteRange, and schedules a compaction of that key range in the thread pool. May throw.
+    void pruneUndos(BlockHeight expireHeight);
+
+    /// Runs periodically in our thread. Samples all db's for stopped/delayed writes and pending compaction bytes, and
+    /// raises or lowers the shared compaction rate limit (config db_compaction_rate_limit) accordingly.
+    void monitorCompactions();
+
+    /// Initial sync write mode (see Options::DBOpts::initialSyncMode). beginInitialSync switches the block data db's
+    /// to WAL-less writes with compactions deferred and takes a first checkpoint; checkpointInitialSync flushes
+    /// everything and hard-links the db's into the datadir's checkpoint dir; endInitialSync flushes, restores the
+    /// normal write mode, removes the checkpoint and, if `compact`, runs the deferred compaction in the thread pool.
+    /// All are called with blocksLock held, and may throw.
+    void beginInitialSync();
+    void checkpointInitialSync();
+    void endInitialSync(bool compact);
+    void flushAllForInitialSync(); ///< flushes all db's and RecordFiles, may throw
+    /// Called from startup() before any db's are opened. If a previous run died while in initial sync mode, moves the
+    /// checkpointed db's back into place and returns true (the RecordFiles are truncated later, by the loadCheck*
+    /// functions). May throw.
+    bool restoreInitialSyncCheckpoint();
+
     void loadCheckHeadersInDB(); ///< may throw -- called from startup()
     void loadCheckUTXOsInDB(); ///< may throw -- called from startup()
     void loadCheckTxNumsFileAndBlkInfo(); ///< may throw -- called from startup()
+    /// Called from loadCheckTxNumsFileAndBlkInfo if the blkinfo db of older versions is in the datadir. Copies its
+    /// nBlocks BlkInfos into the blkinfos file, then deletes the db. May throw.
+    void migrateLegacyBlkInfoDB(const QString &path, size_t nBlocks);
     void loadCheckEarliestUndo(); ///< may throw -- called from startup()
+    /// Called at the end of startup() if checkdb_background is set. Submits the utxo set check to the thread pool as
+    /// shards that run against a db snapshot, and returns immediately. A failed check is fatal.
+    void startBackgroundUTXOCheck();
+
+    /// Called from startup() before any db's are opened if --import-snapshot was specified. Verifies the snapshot's
+    /// manifest and table hashes and copies the snapshot into the (empty) datadir. Returns the manifest. May throw.
+    QVariantMap importSnapshot(const QString &dirName);
+    /// Called from startup() after the imported db's are opened and loaded. Checks that the loaded tip and counts
+    /// match the snapshot manifest, and flags the snapshot as not yet verified against bitcoind. May throw.
+    void checkImportedSnapshot(const QVariantMap &manifest);
+
+    /// Called from cleanup(). Saves the keys of the TxNum -> TxHash and height -> TxHashes caches to the datadir, so that
+    /// prefetchWarmCaches() can reload them on the next startup.
+    void saveWarmCaches();
+    /// Called at the end of startup(). Reads (and deletes) the keys saved by saveWarmCaches(), if any, and reloads
+    /// the caches in the background, in sorted chunks on the thread pool. Returns immediately.
+    void prefetchWarmCaches();
+
+    /// Called from cleanup(). Saves the mempool to the datadir along with the chain tip it was built against, so that
+    /// loadMempool() can restore it on the next startup.
+    void saveMempool();
+    /// Called at the end of startup(). Reads (and deletes) the file saved by saveMempool(), if any, and installs it as
+    /// the mempool if the chain tip still matches. The first SynchMempoolTask run then only downloads tx's that are
+    /// new since, and drops the ones no longer in bitcoind's mempool, as it would for any other refresh.
+    void loadMempool();
+
+    /// Called from loadCheckHeadersInDB with the hashes of all the headers. Opens the header merkle roots file and
+    /// initializes the merkle cache from it, computing (and persisting) any roots that are missing. May throw.
+    void loadMerkleCache(const std::vector<QByteArray> &hashes);
+    /// Appends newly-completed merkle cache segment roots to the header merkle roots file. May throw.
+    void appendMerkleRoots(const Merkle::HashVec &roots);
 
     std::optional<Header> headerForHeight_nolock(BlockHeight height, QString *errMsg = nullptr) const;
     std::vector<Header> headersFromHeight_nolock_nocheck(BlockHeight height, unsigned count, QString *errMsg = nullptr) const;
@@ -369,27 +569,32 @@ RecordFile: "txnum2txhash"
   monotonically increasing txnum based on where it appeared on the blockchain. Block 0, tx 0 has "txnum" 0, up until
   the last tx N in block 0, which has "txnum" N. Tx 0 in block 1 then follows with "txnum" N+1, and so on.
 
-RocksDB: "blkinfo"
+RecordFile: "blkinfos"
   Purpose:  Allow for undoing on reorg and store some metadata for each block
-  Key:  "num_blocks" -> value (uint32) one past the last block height saved (eg the latest valid block_height
-  to use above would be one less than this number).
-  Key:  block_height (serialized uint32 of the height in question) -> values:  txNum0, nTx
+  Data layout: One BlkInfo (txNum0, nTx) per block height, laid out one after another. On startup the whole file is
+  read with a single sequential read. (Older versions kept this in a RocksDB table "blkinfo", keyed by block_height;
+  that table is migrated to this file on first startup -- see Storage::migrateLegacyBlkInfoDB.)
   Discussion:  Undoing involves going to the height to undo, getting the list of scripthashes, then hitting the
   scripthash_history table (and other scripthash related tables) for each one touched and removing the history entry
   for this block.  TODO: Finish this section...
 
 RocksDB: "undo"
-  We store max 10-1000 of these or so for undoing on reorg
-  Key: block_height (uint32) (see Storage.cpp)
+  We store configuredUndoDepth() (config: db_undo_depth) of these for undoing on reorg. Expired entries are pruned
+  periodically with a DeleteRange (see Storage::pruneUndos).
+  Key: block_height (uint32, big-endian so that key order is height order, see UndoKey in Storage.cpp)
   Value: a serialized structure that captures the undo info (see struct UnfoInfo in Storage.cpp).. such as
   scripthashes, txo outs, txo ins (spends), etc.  The idea is to be able to roll back the utxoset to the state it had
-  before this block occurred, as well as roll back the scripthash history and the txids
+  before this block occurred, as well as roll back the scripthash history and the txids.  The scripthashes are stored
+  once each in a table and referenced by index, and the txo's are stored as varints without their txid (which is
+  recovered from the txNum2txHash file via the txNum), see Serialize(const UndoInfo &) in Storage.cpp.
 
 RocksDB: "scripthash_history"
   Purpose: the place where the history is stored for eg scripthash_status and get_history
   Key: scripthash_raw_bytes (32 bytes)
-  -> values: An ordered list of unique txNums: 6-byte txNums (txNum [uint48] , ... ), for all tx's spending from or to
-  a scripthash.
+  -> values: An ordered list of unique txNums for all tx's spending from or to a scripthash. The first txNum is
+  written as a varint, and each subsequent txNum as a varint delta from the previous one, followed by a 6-byte trailer
+  holding the last txNum [uint48] so that appends (via the merge operator) are constant-time.  (DB version 1 used
+  fixed 6-byte txNums; such db's are upgraded on startup.)
 
 RocksDB: "utxoset"
   Purpose: serialize the UTXOSet structure as seen in the sources. loading this involves iterating over entire table.
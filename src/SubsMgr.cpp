@@ -16,7 +16,9 @@
 // along with this program (see LICENSE.txt).  If not, see
 // <https://www.gnu.org/licenses/>.
 //
+#include "App.h"
 #include "SubsMgr.h"
+#include "ThreadPool.h"
 #include "Util.h"
 
 #include "robin_hood/robin_hood.h"
@@ -24,8 +26,10 @@
 #include <QThread>
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <mutex>
+#include <utility>
 
 Subscription::Subscription(const HashX &sh)
     : QObject(nullptr), scriptHash(sh)
@@ -42,8 +46,28 @@ namespace {
     constexpr const char *kNotifTimerName = "NotificationTimer";
     constexpr int kRemoveZombiesTimerIntervalMS = 60000; ///< we remove zombie subs entries every minute
     constexpr const char *kRemoveZombiesTimerName = "ZombieTimer";
+    constexpr size_t kNotifyBatchSize = 256; ///< doNotifyAllPending computes statuses (and emits them) this many scripthashes at a time
+    constexpr size_t kMinItemsPerShard = 64; ///< doNotifyAllPending only spreads the work over more threads if each one gets at least this many scripthashes
 
     constexpr bool debugPrint = false; ///< some of the more performance critical code in this file has its trace/debug prints compiled in or out based on this flag.
+
+    /// The Electrum status of a history: the single sha256 of "txid:height:" for each item, or empty if no history.
+    StatusHash statusForHistory(const Storage::History &hist) {
+        StatusHash ret;
+        if (hist.empty())
+            // no history, return an empty QByteArray
+            return ret;
+        QString historyString;
+        {
+            QTextStream ts(&historyString, QIODevice::WriteOnly);
+            for (const auto & item : hist) {
+                ts << Util::ToHexFast(item.hash) << ":" << item.height << ":";
+            }
+        }
+        // status is non-reversed, single sha256 (32 bytes)
+        ret = BTC::HashOnce(historyString.toUtf8());
+        return ret;
+    }
 }
 
 struct SubsMgr::Pvt
@@ -55,6 +79,10 @@ struct SubsMgr::Pvt
     std::atomic_int64_t nClientSubsActive{0};
     std::atomic_uint64_t cacheHits{0}, cacheMisses{0};
 
+    int64_t pendingSinceNS = 0; ///< when pendingNotificatons last went from empty to non-empty (0 if empty)
+    uint64_t nNotifyRuns = 0; ///< the number of doNotifyAllPending() runs that had subscribed scripthashes to do
+    NotifyLatency lastNotifyLatency, worstNotifyLatency; ///< for stats()
+
     static constexpr size_t kSubsReserveSize = 16384;
     Pvt() {
         subs.reserve(kSubsReserveSize);
@@ -112,7 +140,9 @@ void SubsMgr::on_finished()
 void SubsMgr::doNotifyAllPending()
 {
     const auto t0 = Util::getTimeNS();
-    size_t ctr = 0, ctrSH = 0;
+    size_t ctrSH = 0;
+    std::atomic_size_t ctr{0};
+    int64_t pendingSinceNS = 0;
     bool emitQueueEmpty = false;
     std::vector<SubRef> pending; // this ends up being the intersection of the sh's in p->pendingNotifications and p->subs
     {
@@ -144,6 +174,7 @@ void SubsMgr::doNotifyAllPending()
             }
         }
         p->clearPending_nolock();
+        pendingSinceNS = std::exchange(p->pendingSinceNS, 0);
         emitQueueEmpty = !pendingWasEmpty; // emit queueEmpty below only if it wasn't empty before
     }
     if (emitQueueEmpty) {
@@ -151,48 +182,132 @@ void SubsMgr::doNotifyAllPending()
         // signal via a direct connection to a slot in this thread that then tries to take the same lock.
         emit queueEmpty();
     }
-    // at this point we got all the subrefs for the scripthashes that changed.. and the lock is released .. now run through them all and notify each
+    // at this point we got all the subrefs for the scripthashes that changed.. and the lock is released .. now pick out
+    // the ones that still have clients
+    std::vector<SubRef> active;
+    std::vector<HashX> shs; // parallel to `active`
+    active.reserve(pending.size());
+    shs.reserve(pending.size());
     for (const auto & sub : pending) {
-        HashX sh; // we take a copy of this from sub in the block below with the lock held for paranoia purposes (technically we could take it now, though)
         ++ctrSH;
-        {
-            LockGuard g(sub->mut);
-            if (sub->subscribedClientIds.empty()) {
-                // We need to clear the "last status notified" because we have no clients now and we are skipping a
-                // notification. The "last status notified"'s primary purpose is to prevent sending existing clients
-                // dupe notifications (if status didn't change). Since we are skipping a notification, we must clear
-                // it to invalidate it.
-                sub->lastStatusNotified.reset();
-                sub->cachedStatus.reset(); // forget the cached status as it is now very definitely wrong.
+        LockGuard g(sub->mut);
+        if (sub->subscribedClientIds.empty()) {
+            // We need to clear the "last status notified" because we have no clients now and we are skipping a
+            // notification. The "last status notified"'s primary purpose is to prevent sending existing clients
+            // dupe notifications (if status didn't change). Since we are skipping a notification, we must clear
+            // it to invalidate it.
+            sub->lastStatusNotified.reset();
+            sub->cachedStatus.reset(); // forget the cached status as it is now very definitely wrong.
+            continue;
+        } // else..
+        shs.push_back(sub->scriptHash);
+        active.push_back(sub);
+    }
+    if (active.empty())
+        return;
+    // ^^^ We must release the above locks here because we do not want to hold them while also implicitly grabbing
+    // Storage locks in getFullStatuses() below.
+    //
+    // The statuses are computed in the ThreadPool: `active` is split into up to 1 contiguous range per pool thread, and
+    // each range is done kNotifyBatchSize scripthashes at a time (each batch is a single Storage::getHistories()
+    // call). Each batch is emitted as soon as it's done, so the first clients hear about a big block long before the
+    // last ones.
+    const size_t n = active.size();
+    std::atomic<int64_t> firstBatchNS{0}, lastBatchNS{0};
+    // `progress` is set to the end of each batch once it is done, so that if a shard doesn't complete, we know where
+    // to pick up again (see below).
+    const auto notifyRange = [&](size_t begin, size_t end, size_t &progress) {
+        for (size_t b = begin; b < end; progress = b = std::min(end, b + kNotifyBatchSize)) {
+            const size_t e = std::min(end, b + kNotifyBatchSize);
+            std::vector<StatusHash> statuses;
+            try {
+                statuses = getFullStatuses(std::vector<HashX>(shs.begin() + long(b), shs.begin() + long(e)));
+            } catch (const std::exception &ex) {
+                // Skip this batch: we must not emit (or cache) a bogus status. Forget any cached status since it may
+                // now be stale. The last status notified is left alone, since that's still what the clients have.
+                Warning() << "doNotifyAllPending: failed to compute statuses for " << (e - b) << " scripthashes: " << ex.what();
+                for (size_t i = b; i < e; ++i) {
+                    LockGuard g(active[i]->mut);
+                    active[i]->cachedStatus.reset();
+                }
                 continue;
-            } // else..
-            sh = sub->scriptHash;
+            }
+            for (size_t i = b; i < e; ++i) {
+                const auto & sub = active[i];
+                const auto & sh = shs[i];
+                const auto & status = statuses[i - b];
+                // Now, re-acquire sub lock. Temporarily having released it above should be fine for our purposes, since
+                // the above empty() check was only a performance optimization and the predicate not holding for the
+                // duration of this code block is fine. In the unlikely event that a sub lost its clients while the lock
+                // was released, the below emit sub->statusChanged(...) will just be a no-op.
+                LockGuard g(sub->mut);
+                const bool doemit = !sub->lastStatusNotified.has_value() || *sub->lastStatusNotified != status;
+                // we basically cache 2 statuses but they are implicitly shared copies of the same memory so it's ok.
+                sub->lastStatusNotified = status;
+                sub->cachedStatus = status;
+                if (doemit) {
+                    const auto nClients = sub->subscribedClientIds.size();
+                    ctr += nClients;
+                    DebugM("Notifying ", nClients, Util::Pluralize(" client", nClients), " of status for ", Util::ToHexFast(sh));
+                    sub->updateTS();
+                    emit sub->statusChanged(sh, status); // queued to each client's thread
+                }
+            }
+            const auto now = Util::getTimeNS();
+            int64_t expected = 0;
+            firstBatchNS.compare_exchange_strong(expected, now);
+            for (int64_t prev = lastBatchNS; prev < now && !lastBatchNS.compare_exchange_weak(prev, now); ) {}
         }
-        // ^^^ We must release the above lock here temporarily because we do not want to hold it while also implicitly
-        // grabbing the Storage 'blocksLock' below for getFullStatus* (storage->getHistory acquires that lock in
-        // read-only mode).
-        const auto status = getFullStatus(sh);
-        // Now, re-acquire sub lock. Temporarily having released it above should be fine for our purposes, since the
-        // above empty() check was only a performance optimization and the predicate not holding for the duration of
-        // this code block is fine. In the unlikely event that a sub lost its clients while the lock was released, the
-        // below emit sub->statusChanged(...) will just be a no-op.
-        LockGuard g(sub->mut);
-        const bool doemit = !sub->lastStatusNotified.has_value() || *sub->lastStatusNotified != status;
-        // we basically cache 2 statuses but they are implicitly shared copies of the same memory so it's ok.
-        sub->lastStatusNotified = status;
-        sub->cachedStatus = status;
-        if (doemit) {
-            const auto nClients = sub->subscribedClientIds.size();
-            ctr += nClients;
-            DebugM("Notifying ", nClients, Util::Pluralize(" client", nClients), " of status for ", Util::ToHexFast(sh));
-            sub->updateTS();
-            emit sub->statusChanged(sh, status);
+    };
+    // Use at most half of the pool's threads, so that client RPCs and mempool tx decoding aren't all stuck behind the
+    // notifications after a big block.
+    unsigned nShards = 1;
+    if (n > kMinItemsPerShard)
+        nShards = unsigned(std::min<size_t>(size_t(std::max(::AppThreadPool()->maxThreadCount() / 2, 1)),
+                                            (n + kMinItemsPerShard - 1) / kMinItemsPerShard));
+    const size_t perShard = (n + nShards - 1) / nShards;
+    const auto shardBegin = [&](unsigned shard) { return std::min(n, shard * perShard); };
+    const auto shardEnd = [&](unsigned shard) { return std::min(n, (shard + 1) * perShard); };
+    std::vector<size_t> progress(nShards);
+    for (unsigned shard = 0; shard < nShards; ++shard)
+        progress[shard] = shardBegin(shard);
+    try {
+        ::AppThreadPool()->runShardsBlocking(nShards, [&](unsigned shard) {
+            notifyRange(shardBegin(shard), shardEnd(shard), progress[shard]);
+        });
+    } catch (const std::exception &e) {
+        // Some shards didn't run to completion (ThreadPool overloaded or shutting down). The pending set was already
+        // cleared above so we must not drop these notifications: finish the remaining ranges here, in this thread.
+        // (runShardsBlocking guarantees no shard is still running at this point).
+        Warning() << __func__ << ": " << e.what() << ", finishing the remaining notifications in this thread";
+        try {
+            for (unsigned shard = 0; shard < nShards; ++shard)
+                notifyRange(progress[shard], shardEnd(shard), progress[shard]);
+        } catch (const std::exception &e2) {
+            // notifyRange handles db errors itself, so this is something like bad_alloc. Don't let it escape the
+            // timer slot that called us.
+            Error() << __func__ << ": " << e2.what();
         }
     }
+    {
+        const auto t1 = Util::getTimeNS();
+        const auto since = pendingSinceNS ? pendingSinceNS : t0;
+        NotifyLatency lat;
+        lat.nScripthashes = n;
+        lat.nShards = nShards;
+        lat.firstBatchMsec = firstBatchNS ? (firstBatchNS - since) / 1e6 : 0.;
+        lat.lastBatchMsec = lastBatchNS ? (lastBatchNS - since) / 1e6 : 0.;
+        lat.computeMsec = (t1 - t0) / 1e6;
+        LockGuard g(p->mut);
+        ++p->nNotifyRuns;
+        p->lastNotifyLatency = lat;
+        if (lat.lastBatchMsec >= p->worstNotifyLatency.lastBatchMsec)
+            p->worstNotifyLatency = lat;
+    }
     if (ctr || ctrSH) {
         const auto elapsedMS = (Util::getTimeNS() - t0)/1e6;
-        DebugM(__func__, ": ", ctr, Util::Pluralize(" client", ctr), ", ", ctrSH, Util::Pluralize(" scripthash", ctrSH),
-               " in ", QString::number(elapsedMS, 'f', 4), " msec");
+        DebugM(__func__, ": ", ctr.load(), Util::Pluralize(" client", ctr.load()), ", ", ctrSH, Util::Pluralize(" scripthash", ctrSH),
+               " in ", QString::number(elapsedMS, 'f', 4), " msec (", nShards, Util::Pluralize(" shard", nShards), ")");
     }
 }
 
@@ -202,8 +317,10 @@ void SubsMgr::enqueueNotifications(std::unordered_set<HashX, HashHasher> &s)
     LockGuard g(p->mut);
     const bool wasEmpty = p->pendingNotificatons.empty();
     p->pendingNotificatons.merge(s);
-    if (wasEmpty)
+    if (wasEmpty) {
+        p->pendingSinceNS = Util::getTimeNS();
         emit queueNoLongerEmpty();
+    }
 }
 void SubsMgr::enqueueNotifications(std::unordered_set<HashX, HashHasher> &&s)
 {
@@ -211,8 +328,10 @@ void SubsMgr::enqueueNotifications(std::unordered_set<HashX, HashHasher> &&s)
     LockGuard g(p->mut);
     const bool wasEmpty = p->pendingNotificatons.empty();
     p->pendingNotificatons.merge(std::move(s));
-    if (wasEmpty)
+    if (wasEmpty) {
+        p->pendingSinceNS = Util::getTimeNS();
         emit queueNoLongerEmpty();
+    }
 }
 
 auto SubsMgr::makeSubRef(const HashX &sh) -> SubRef
@@ -247,6 +366,34 @@ auto SubsMgr::getOrMakeSubRef(const HashX &sh) -> std::pair<SubRef, bool>
     return ret;
 }
 
+// may throw LimitReached
+auto SubsMgr::getOrMakeSubRefs(const std::vector<HashX> &shs) -> std::vector<std::pair<SubRef, bool>>
+{
+    std::vector<std::pair<SubRef, bool>> ret;
+    ret.reserve(shs.size());
+    LockGuard g(p->mut);
+
+    // Check the limit up-front for all of the new subs, so that we either add all of them or none of them. `shs` may
+    // contain duplicates, so we count the unique new ones.
+    std::unordered_set<HashX, HashHasher> newShs;
+    for (const auto & sh : shs)
+        if (!p->subs.count(sh))
+            newShs.insert(sh);
+    if (UNLIKELY(p->subs.size() + newShs.size() > size_t(options->maxSubsGlobally)))
+        throw LimitReached(QString("Global subs limit of %1 has been reached").arg(options->maxSubsGlobally));
+
+    for (const auto & sh : shs) {
+        if (auto it = p->subs.find(sh); it != p->subs.end()) {
+            ret.emplace_back(it->second, false); // was not new
+        } else {
+            auto sub = makeSubRef(sh);
+            p->subs[sh] = sub;
+            ret.emplace_back(std::move(sub), true); // was new
+        }
+    }
+    return ret;
+}
+
 auto SubsMgr::findExistingSubRef(const HashX &sh) const -> SubRef
 {
     SubRef ret;
@@ -262,8 +409,40 @@ auto SubsMgr::subscribe(RPC::ConnectionBase *c, const HashX &sh, const StatusCal
     if (UNLIKELY(!notifyCB))
         throw BadArgs("SubsMgr::subscribe must be called with a valid notifyCB. FIXME!");
 
-    SubscribeResult ret = { false, {} };
     auto [sub, wasnew] = getOrMakeSubRef(sh); // may throw LimitReached
+    auto ret = subscribeClientToSub(c, sub, wasnew, notifyCB);
+
+    if constexpr (debugPrint) {
+        const auto elapsed = Util::getTimeNS() - t0;
+        Debug() << "subscribed " << Util::ToHexFast(sh) << " in " << QString::number(elapsed/1e6, 'f', 4) << " msec";
+    }
+    return ret;
+}
+
+auto SubsMgr::subscribeMany(RPC::ConnectionBase *c, const std::vector<HashX> &shs, const StatusCallback &notifyCB)
+    -> std::vector<SubscribeResult>
+{
+    const auto t0 = debugPrint ? Util::getTimeNS() : 0LL;
+    if (UNLIKELY(!notifyCB))
+        throw BadArgs("SubsMgr::subscribeMany must be called with a valid notifyCB. FIXME!");
+
+    std::vector<SubscribeResult> ret;
+    ret.reserve(shs.size());
+    const auto subs = getOrMakeSubRefs(shs); // may throw LimitReached
+    for (const auto & [sub, wasnew] : subs)
+        ret.push_back(subscribeClientToSub(c, sub, wasnew, notifyCB));
+
+    if constexpr (debugPrint) {
+        const auto elapsed = Util::getTimeNS() - t0;
+        Debug() << "subscribed " << shs.size() << " scripthashes in " << QString::number(elapsed/1e6, 'f', 4) << " msec";
+    }
+    return ret;
+}
+
+auto SubsMgr::subscribeClientToSub(RPC::ConnectionBase *c, const SubRef &sub, bool wasnew, const StatusCallback &notifyCB)
+    -> SubscribeResult
+{
+    SubscribeResult ret = { false, {} };
     {
         LockGuard g(sub->mut);
         if (!wasnew && sub->subscribedClientIds.count(c->id)) {
@@ -301,10 +480,6 @@ auto SubsMgr::subscribe(RPC::ConnectionBase *c, const HashX &sh, const StatusCal
     else
         ++p->cacheMisses;
 
-    if constexpr (debugPrint) {
-        const auto elapsed = Util::getTimeNS() - t0;
-        Debug() << "subscribed " << Util::ToHexFast(sh) << " in " << QString::number(elapsed/1e6, 'f', 4) << " msec";
-    }
     return ret;
 }
 
@@ -361,20 +536,8 @@ std::pair<bool, bool> SubsMgr::globalSubsLimitFlags() const
 auto SubsMgr::getFullStatus(const HashX &sh) const -> StatusHash
 {
     const auto t0 = Util::getTimeNS();
-    StatusHash ret;
     const auto hist = storage->getHistory(sh, true, true);
-    if (hist.empty())
-        // no history, return an empty QByteArray
-        return ret;
-    QString historyString;
-    {
-        QTextStream ts(&historyString, QIODevice::WriteOnly);
-        for (const auto & item : hist) {
-            ts << Util::ToHexFast(item.hash) << ":" << item.height << ":";
-        }
-    }
-    // status is non-reversed, single sha256 (32 bytes)
-    ret = BTC::HashOnce(historyString.toUtf8());
+    const StatusHash ret = statusForHistory(hist);
     const auto elapsed = Util::getTimeNS() - t0;
     constexpr qint64 kTookKindaLongNS = 7500000LL; // 7.5mec -- if it takes longer than this, log it to debug log, otherwise don't as this can get spammy.
     if (elapsed > kTookKindaLongNS) {
@@ -383,6 +546,26 @@ auto SubsMgr::getFullStatus(const HashX &sh) const -> StatusHash
     return ret;
 }
 
+auto SubsMgr::getFullStatuses(const std::vector<HashX> &shs) const -> std::vector<StatusHash>
+{
+    const auto t0 = Util::getTimeNS();
+    std::vector<StatusHash> ret;
+    ret.reserve(shs.size());
+    const auto hists = storage->getHistories(shs);
+    size_t nItems = 0;
+    for (const auto & hist : hists) {
+        ret.push_back(statusForHistory(hist));
+        nItems += hist.size();
+    }
+    const auto elapsed = Util::getTimeNS() - t0;
+    constexpr qint64 kTookKindaLongNS = 50000000LL; // 50 msec -- as in getFullStatus, only log the slow ones since this can get spammy.
+    if (elapsed > kTookKindaLongNS) {
+        DebugM("full status for ", shs.size(), Util::Pluralize(" scripthash", shs.size()), " (", nItems, " items) in ",
+               QString::number(elapsed/1e6, 'f', 4), " msec");
+    }
+    return ret;
+}
+
 void SubsMgr::removeZombies(bool forced)
 {
     const auto t0 = Util::getTimeNS();
@@ -450,6 +633,20 @@ auto SubsMgr::stats() const -> Stats
             l.push_back(Util::ToHexFast(sh));
         }
         ret["pendingNotifications"] = l;
+        const auto fmt = [](const NotifyLatency &lat) {
+            return QVariantMap{
+                {"scripthashes", qulonglong(lat.nScripthashes)},
+                {"shards", lat.nShards},
+                {"firstBatchMsec", QString::number(lat.firstBatchMsec, 'f', 3)},
+                {"lastBatchMsec", QString::number(lat.lastBatchMsec, 'f', 3)},
+                {"computeMsec", QString::number(lat.computeMsec, 'f', 3)},
+            };
+        };
+        ret["notification latency"] = p->nNotifyRuns ? QVariantMap{
+            {"runs", qulonglong(p->nNotifyRuns)},
+            {"latest", fmt(p->lastNotifyLatency)},
+            {"worst", fmt(p->worstNotifyLatency)},
+        } : QVariant();
     }
     ret["subscriptions cache hits"] = qlonglong(p->cacheHits.load()); // atomic, no lock needed
     ret["subscriptions cache misses"] = qlonglong(p->cacheMisses.load()); // atomic, no lock needed
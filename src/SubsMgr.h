@@ -128,6 +128,14 @@ public:
     /// Will throw LimitReached if the subs table is full.  Calling code should catch this exception.
     /// (May also throw BadArgs).
     SubscribeResult subscribe(RPC::ConnectionBase *client, const HashX &sh, const StatusCallback &notifyCB);
+    /// Thread-safe. Like subscribe() above, but for many scripthashes at once (the same `notifyCB` is registered for
+    /// each of them). The subscription table is looked up and added to under a single lock acquisition. Returns a
+    /// vector parallel to `shs`.
+    ///
+    /// Throws LimitReached, before subscribing to anything, if the new subs would not fit in the subs table.
+    /// (May also throw BadArgs or InternalError, as above).
+    std::vector<SubscribeResult> subscribeMany(RPC::ConnectionBase *client, const std::vector<HashX> &shs,
+                                               const StatusCallback &notifyCB);
     /// Thread-safe. The inverse of subscribe. Returns true if the client was previously subscribed, false otherwise.
     /// Always call this from the client's thread otherwise undefined behavior may result.
     bool unsubscribe(RPC::ConnectionBase *client, const HashX &sh);
@@ -152,9 +160,12 @@ public:
     /// Thread-safe. Returns the status hash bytes (32 bytes single sha256 hash of the status text). Will return
     /// an empty byte vector if the scriptHash in question has no history.
     ///
-    /// Note that this implicitly will take the Storage "blocksLock" as a shared lock -- so bear that in mind if calling
-    /// this from `Storage` with that lock already held.
+    /// Note that this implicitly will take the Storage "rewindLock" and the mempool locks as shared locks -- so bear that
+    /// in mind if calling this from `Storage` with either of those held exclusively.
     StatusHash getFullStatus(const HashX &scriptHash) const;
+    /// Thread-safe. Batched version of the above, using Storage::getHistories(). Returns a vector parallel to
+    /// `scriptHashes`. Unlike getFullStatus, this throws on db error rather than returning bogus (empty) statuses.
+    std::vector<StatusHash> getFullStatuses(const std::vector<HashX> &scriptHashes) const;
 
     /// Thread-safe.  Client calls this to maybe save the status hash it just got from getFullStatus. We don't always
     /// take the value and cache it -- only under very specific conditions.
@@ -187,10 +198,24 @@ private:
     struct Pvt;
     std::unique_ptr<Pvt> p;
 
+    /// Timings for a doNotifyAllPending() run, shown in stats(). The latencies are measured from when the first of
+    /// the notifications was enqueued (e.g. when a block was added) to when the first and the last batch of statuses
+    /// had been computed and emitted to the clients' threads.
+    struct NotifyLatency {
+        size_t nScripthashes = 0; ///< the number of subscribed scripthashes (with clients) notified
+        unsigned nShards = 0; ///< the number of ThreadPool threads the work was spread over
+        double firstBatchMsec = 0., lastBatchMsec = 0.;
+        double computeMsec = 0.; ///< the time taken by doNotifyAllPending() itself
+    };
+
     using SubRef = std::shared_ptr<Subscription>;
     SubRef makeSubRef(const HashX &sh);
     std::pair<SubRef, bool> getOrMakeSubRef(const HashX &sh); // takes locks, returns a new subref or an existing subref, may throw LimitReached
+    /// Batched version of getOrMakeSubRef: takes the lock once. May throw LimitReached (in which case nothing was added).
+    std::vector<std::pair<SubRef, bool>> getOrMakeSubRefs(const std::vector<HashX> &shs);
     SubRef findExistingSubRef(const HashX &) const; // takes locks, returns an existing subref or empty ref.
+    /// Attaches client `c` (and its `notifyCB`) to `sub`. Common code for subscribe() and subscribeMany().
+    SubscribeResult subscribeClientToSub(RPC::ConnectionBase *c, const SubRef &sub, bool wasnew, const StatusCallback &notifyCB);
 
     void doNotifyAllPending();
 
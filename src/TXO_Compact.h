@@ -114,7 +114,7 @@ struct CompactTXO {
         bytes[2] = (num >> 16) & 0xff;
         bytes[3] = (num >> 24) & 0xff;
         bytes[4] = (num >> 32) & 0xff;
-        bytes[5] = (num >> 48) & 0xff;
+        bytes[5] = (num >> 40) & 0xff;
     }
 
     static constexpr size_t compactTxNumSize() { return 6; }
@@ -21,6 +21,10 @@
 
 #include <QThreadPool>
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
 namespace {
     constexpr bool debugPrt = false;
 }
@@ -119,6 +123,59 @@ void ThreadPool::submitWork(QObject *context, const VoidFunc & work, const VoidF
     pool->start(job, priority);
 }
 
+void ThreadPool::runShardsBlocking(unsigned nShards, const ShardFunc & work)
+{
+    if (!nShards)
+        return;
+    if (nShards == 1) {
+        work(0);
+        return;
+    }
+    struct State {
+        std::mutex mut;
+        std::condition_variable cond;
+        unsigned remaining = 0;
+        QString firstError;
+    };
+    auto st = std::make_shared<State>();
+    st->remaining = nShards;
+    // Each submitted job owns one of these (via its lambda capture). It marks the shard as done when the last copy
+    // of the job's lambda goes away -- which happens after the shard ran, but also if the job was dropped without
+    // running (job limit exceeded, blockNewWork, early exit in Job::run, or the pool being cleared on shutdown).
+    // This way every shard is always accounted for, and we never return while a shard may still be referencing
+    // the caller's stack.
+    struct ShardDone {
+        std::shared_ptr<State> st;
+        QString err = "Shard was not run (job limit exceeded or pool shutting down)";
+        explicit ShardDone(const std::shared_ptr<State> &st) : st(st) {}
+        ~ShardDone() {
+            std::unique_lock g(st->mut);
+            if (!err.isEmpty() && st->firstError.isEmpty())
+                st->firstError = err;
+            if (--st->remaining == 0)
+                st->cond.notify_all();
+        }
+    };
+    for (unsigned i = 0; i < nShards; ++i) {
+        auto done = std::make_shared<ShardDone>(st);
+        submitWork(this, [work, i, done]{
+            done->err.clear();
+            try {
+                work(i);
+            } catch (const std::exception &e) {
+                done->err = e.what();
+                if (done->err.isEmpty()) done->err = "Unknown error";
+            } catch (...) {
+                done->err = "Unknown exception";
+            }
+        });
+    }
+    std::unique_lock g(st->mut);
+    st->cond.wait(g, [&st]{ return !st->remaining; });
+    if (!st->firstError.isEmpty())
+        throw Exception(st->firstError);
+}
+
 bool ThreadPool::shutdownWaitForJobs(int timeout_ms)
 {
     blockNewWork = true;
@@ -49,6 +49,9 @@ public:
     using FailFunc = std::function<void(const QString &)>;
     using VoidFunc = std::function<void()>;
 
+    /// Priority for long-running background jobs (see submitWork).
+    static constexpr int LowPriority = -1;
+
     /// Submit work to be performed asynchronously from a thread pool thread.
     ///
     /// `work` is called in the context of one of this instance's QThreadPool threads (it should lambda-capture all
@@ -71,9 +74,26 @@ public:
     ///
     /// Using shared_ptr to share data between `work` and `completion` (via lambda-capture) is thus the intended
     /// way to use this mechanism.
+    ///
+    /// `priority` orders the queue of jobs waiting for a free thread: higher priority jobs are started first (as per
+    /// QThreadPool::start). Long-running background work should pass LowPriority so it doesn't delay client work.
     void submitWork(QObject *context, const VoidFunc & work, const VoidFunc & completion = VoidFunc(),
                     const FailFunc & fail = FailFunc(), int priority = 0);
 
+    using ShardFunc = std::function<void(unsigned)>;
+    /// Runs `work(0) ... work(nShards-1)` concurrently on this pool's threads and blocks until they have all returned.
+    /// Intended for large batch jobs that the caller needs the result of before proceeding (such as the startup db
+    /// checks in Storage). `work` may reference the caller's stack since this call doesn't return until all shards are
+    /// done. If nShards is 1, `work` is called directly in the calling thread.
+    ///
+    /// Unlike the other methods of this class, this one throws: if any shard throws, an Exception with the first
+    /// shard error message is thrown once all of the shards have finished. It also throws if a shard could not be
+    /// run (job limit exceeded or pool shutting down). In all cases this only returns (or throws) once no shard
+    /// is running anymore.
+    ///
+    /// Do not call this from one of this pool's own threads, since that may deadlock.
+    void runShardsBlocking(unsigned nShards, const ShardFunc & work);
+
     /// Call this on app or pool shutdown to wait for extant jobs that may be running to complete. This prevents jobs
     /// that are currently running from referencing data that may go away during shutdown (a situation that would cause
     /// a segfault).